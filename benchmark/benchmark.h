@@ -0,0 +1,80 @@
+#ifndef benchmark_h_j6k5l4m3
+#define benchmark_h_j6k5l4m3
+
+#include "../sources/terrain/terrain.h"
+#include "../sources/terrain/collisionTree.h"
+
+#include <cage-core/collisionStructure.h>
+#include <cage-core/string.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+
+// headless measurements of the game systems, each feature reports one or more sections
+// the sections are logged, written to a json file, and any failed check makes the benchmark exit with an error
+
+constexpr sint32 BenchmarkTileSize = 32;
+
+// inputs shared by the features
+struct BenchmarkContext
+{
+	std::vector<TilePos> all; // several radii, deterministic
+	std::vector<TilePos> view; // requested by the level of detail hierarchy around the origin
+	std::vector<TilePos> flight; // requested, including prefetched, along a flight path
+	uint32 threads = 1;
+};
+
+struct BenchmarkSection
+{
+	struct Entry
+	{
+		std::string key;
+		std::string json; // encoded value
+		bool logged = true;
+	};
+
+	std::string name;
+	std::vector<Entry> entries;
+	std::vector<std::string> failures;
+
+	explicit BenchmarkSection(const std::string &name) : name(name) {}
+
+	template<class T>
+	BenchmarkSection &value(const std::string &key, T v) { return add(key, std::to_string(v), true); }
+	BenchmarkSection &value(const std::string &key, real v) { return add(key, std::to_string(v.value), true); }
+	BenchmarkSection &value(const std::string &key, bool v) { return add(key, v ? "true" : "false", true); }
+	BenchmarkSection &json(const std::string &key, const std::string &encoded) { return add(key, encoded, false); } // not logged
+	BenchmarkSection &check(bool condition, const std::string &failure); // deterministic checks only, the timings vary between runs and are reported as values
+
+private:
+	BenchmarkSection &add(const std::string &key, const std::string &encoded, bool logged);
+};
+
+void benchmarkSubmit(BenchmarkSection &&section); // logs the section and keeps it for the output
+bool benchmarkWrite(const string &path); // returns whether all checks passed
+
+// fixtures
+double ms(uint64 micros);
+std::vector<TilePos> generatePositions(uint32 countPerRadius);
+std::vector<TilePos> typicalView();
+std::vector<TilePos> flightPath();
+std::vector<TerrainCollisionItem> generateCollisionItems(const std::vector<TilePos> &positions, uint32 maxTiles);
+TerrainRayHit bruteForceHit(const std::vector<TerrainCollisionItem> &items, const Line &ln);
+bool sameHit(const TerrainRayHit &a, const TerrainRayHit &b);
+vec3 rayHit(CollisionQuery *query, const Line &ln);
+
+// features
+void benchmarkScheduler(const BenchmarkContext &context);
+void benchmarkUpload(const BenchmarkContext &context);
+void benchmarkGeneration(const BenchmarkContext &context);
+void benchmarkCompression(const BenchmarkContext &context);
+void benchmarkAtlas(const BenchmarkContext &context);
+void benchmarkColliders(const BenchmarkContext &context);
+void benchmarkCollisionTree(const BenchmarkContext &context);
+void benchmarkRayBatches(const BenchmarkContext &context);
+void benchmarkSweeps(const BenchmarkContext &context);
+void benchmarkLightning(const BenchmarkContext &context);
+void benchmarkTimeouts(const BenchmarkContext &context);
+
+#endif
@@ -0,0 +1,137 @@
+#include "benchmark.h"
+
+#include <cage-core/config.h>
+#include <cage-core/random.h>
+#include <cage-core/timer.h>
+#include <cage-core/mesh.h>
+#include <cage-core/image.h>
+#include <cage-core/collider.h>
+#include <cage-core/geometry.h>
+
+#include <atomic>
+
+namespace
+{
+	struct ColliderResult
+	{
+		uint64 triangles = 0;
+		uint64 rebuildTime = 0; // microseconds, whole collision structure
+		uint64 rayTime = 0; // microseconds, all rays
+	};
+
+	struct CollidersResult
+	{
+		ColliderResult full; // from the render meshes
+		ColliderResult decimated;
+		double meanDeviation = 0; // distance between the hits of the same ray
+		uint32 tiles = 0;
+		uint32 rays = 0;
+		uint32 mismatches = 0; // rays that hit only one of the colliders
+	};
+
+	// colliders of the same tiles built from the render meshes and from the decimated collision meshes
+	CollidersResult measureColliders(const std::vector<TilePos> &positions, uint32 maxTiles, uint32 raysPerTile)
+	{
+		CollidersResult r;
+		std::atomic<bool> cancelled {false};
+		Holder<CollisionStructure> structures[2] = { newCollisionStructure({}), newCollisionStructure({}) };
+		std::vector<TilePos> used;
+		for (const TilePos &p : positions)
+		{
+			if (r.tiles >= maxTiles)
+				break;
+			Holder<Collider> colliders[2];
+			for (uint32 i = 0; i < 2; i++)
+			{
+				configSetBool("flittermouse/terrain/collider/decimation", i == 1);
+				Holder<Mesh> mesh;
+				Holder<Image> albedo, special;
+				terrainGenerate(p, cancelled, mesh, colliders[i], albedo, special);
+			}
+			if (!colliders[0] || !colliders[1])
+				continue;
+			r.full.triangles += colliders[0]->triangles().size();
+			r.decimated.triangles += colliders[1]->triangles().size();
+			for (uint32 i = 0; i < 2; i++)
+				structures[i]->update(r.tiles, colliders[i].share(), p.getTransform());
+			used.push_back(p);
+			r.tiles++;
+		}
+		configSetBool("flittermouse/terrain/collider/decimation", true);
+
+		ColliderResult *results[2] = { &r.full, &r.decimated };
+		Holder<CollisionQuery> queries[2];
+		for (uint32 i = 0; i < 2; i++)
+		{
+			Holder<Timer> timer = newTimer();
+			structures[i]->rebuild();
+			results[i]->rebuildTime = timer->microsSinceStart();
+			queries[i] = newCollisionQuery(structures[i].share());
+		}
+
+		// short segments through the tiles, like the shots and the camera probes
+		RandomGenerator rng(3, 5);
+		std::vector<Line> rays;
+		for (const TilePos &p : used)
+		{
+			const Aabb box = p.getBox();
+			for (uint32 j = 0; j < raysPerTile; j++)
+			{
+				vec3 a, b;
+				for (uint32 k = 0; k < 3; k++)
+				{
+					a[k] = rng.randomRange(box.a[k], box.b[k]);
+					b[k] = rng.randomRange(box.a[k], box.b[k]);
+				}
+				if (distance(a, b) > 1e-3)
+					rays.push_back(makeSegment(a, b));
+			}
+		}
+		std::vector<vec3> hits[2];
+		for (uint32 i = 0; i < 2; i++)
+		{
+			hits[i].reserve(rays.size());
+			Holder<Timer> timer = newTimer();
+			for (const Line &ln : rays)
+				hits[i].push_back(rayHit(+queries[i], ln));
+			results[i]->rayTime = timer->microsSinceStart();
+		}
+		uint32 both = 0;
+		for (uint32 j = 0; j < rays.size(); j++)
+		{
+			const bool a = hits[0][j].valid(), b = hits[1][j].valid();
+			if (a != b)
+				r.mismatches++;
+			else if (a)
+			{
+				r.meanDeviation += distance(hits[0][j], hits[1][j]).value;
+				both++;
+			}
+		}
+		if (both)
+			r.meanDeviation /= both;
+		r.rays = numeric_cast<uint32>(rays.size());
+		return r;
+	}
+}
+
+void benchmarkColliders(const BenchmarkContext &context)
+{
+	const CollidersResult colliders = measureColliders(context.all, 24, 200);
+	BenchmarkSection s("colliders");
+	s.value("tiles", colliders.tiles);
+	s.value("triangles", colliders.decimated.triangles);
+	s.value("fullTriangles", colliders.full.triangles);
+	s.value("rebuildMs", ms(colliders.decimated.rebuildTime));
+	s.value("fullRebuildMs", ms(colliders.full.rebuildTime));
+	s.value("rays", colliders.rays);
+	s.value("raysMs", ms(colliders.decimated.rayTime));
+	s.value("fullRaysMs", ms(colliders.full.rayTime));
+	s.value("mismatches", colliders.mismatches);
+	s.value("meanDeviation", colliders.meanDeviation);
+	s.check(colliders.decimated.triangles <= colliders.full.triangles, "the decimation added triangles");
+	// the rays that graze the surface may differ, the bulk must agree within the error bound
+	const real colliderError = configGetFloat("flittermouse/terrain/collider/error", 0.05);
+	s.check(colliders.mismatches <= colliders.rays / 20 && colliders.meanDeviation <= 2 * colliderError.value, "the decimated colliders deviate too much");
+	benchmarkSubmit(std::move(s));
+}
@@ -0,0 +1,360 @@
+#include "benchmark.h"
+
+#include <cage-core/random.h>
+#include <cage-core/timer.h>
+#include <cage-core/threadPool.h>
+#include <cage-core/collider.h>
+#include <cage-core/geometry.h>
+
+namespace
+{
+	struct CollisionTreeResult
+	{
+		uint64 incrementalTime = 0; // microseconds, inserts and removes of the whole churn
+		uint64 fullRebuildTime = 0; // rebuilding the whole collision structure after each step, like before
+		uint64 balancedBuildTime = 0; // one balanced build of the final set
+		uint32 steps = 0;
+		uint32 tiles = 0;
+		uint32 rays = 0;
+		uint32 normalMismatches = 0; // hits on the edges may report either triangle
+		uint32 maxDepth = 0;
+		real degradation = 1; // cost of the incremental tree / cost of the balanced tree
+		bool valid = true;
+	};
+
+	// tiles streamed in and out of the two-level collision tree, compared to rebuilding the whole structure every step
+	CollisionTreeResult measureCollisionTree(const std::vector<TilePos> &positions, uint32 maxTiles)
+	{
+		CollisionTreeResult r;
+		const std::vector<TerrainCollisionItem> pool = generateCollisionItems(positions, maxTiles);
+		r.tiles = numeric_cast<uint32>(pool.size());
+		if (pool.empty())
+			return r;
+
+		TerrainCollisionTree tree;
+		Holder<CollisionStructure> structure = newCollisionStructure({});
+		std::vector<bool> present(pool.size(), false);
+		RandomGenerator rng(17, 19);
+		for (uint32 step = 0; step < 300; step++)
+		{
+			// a few tiles change each step, like while flying
+			for (uint32 k = 0; k < 3; k++)
+			{
+				const uint32 i = numeric_cast<uint32>(rng.randomRange(0u, numeric_cast<uint32>(pool.size())));
+				const TerrainCollisionItem &it = pool[i];
+				Holder<Timer> timer = newTimer();
+				if (present[i])
+					tree.remove(it.name);
+				else
+					tree.insert(it.name, it.collider.share(), it.tr);
+				r.incrementalTime += timer->microsSinceStart();
+				if (present[i])
+					structure->remove(it.name);
+				else
+					structure->update(it.name, it.collider.share(), it.tr);
+				present[i] = !present[i];
+			}
+			{
+				Holder<Timer> timer = newTimer();
+				structure->rebuild();
+				r.fullRebuildTime += timer->microsSinceStart();
+			}
+			r.maxDepth = max(r.maxDepth, tree.depth());
+			r.steps++;
+		}
+
+		std::vector<TerrainCollisionItem> live;
+		for (uint32 i = 0; i < pool.size(); i++)
+		{
+			if (!present[i])
+				continue;
+			TerrainCollisionItem c;
+			c.collider = pool[i].collider.share();
+			c.tr = pool[i].tr;
+			c.box = pool[i].box;
+			c.name = pool[i].name;
+			live.push_back(std::move(c));
+		}
+		r.valid = tree.count() == live.size();
+		TerrainCollisionTree balanced;
+		{
+			Holder<Timer> timer = newTimer();
+			balanced.build(tree.items());
+			r.balancedBuildTime = timer->microsSinceStart();
+		}
+		if (balanced.cost() > 0)
+			r.degradation = tree.cost() / balanced.cost();
+
+		// both trees must find the same closest hits as testing every tile
+		for (const TerrainCollisionItem &it : live)
+		{
+			for (uint32 j = 0; j < 20; j++)
+			{
+				vec3 a, b;
+				for (uint32 k = 0; k < 3; k++)
+				{
+					a[k] = rng.randomRange(it.box.a[k], it.box.b[k]);
+					b[k] = rng.randomRange(it.box.a[k], it.box.b[k]);
+				}
+				if (distance(a, b) < 1e-3)
+					continue;
+				const Line ln = makeSegment(a, b);
+				const TerrainRayHit expected = bruteForceHit(live, ln);
+				const TerrainRayHit hit = tree.intersection(ln);
+				r.valid = r.valid && sameHit(hit, expected) && sameHit(balanced.intersection(ln), expected);
+				if (hit && expected && dot(hit.normal, expected.normal) < 0.999)
+					r.normalMismatches++;
+				r.rays++;
+			}
+		}
+		return r;
+	}
+
+	struct RayBatchResult
+	{
+		uint64 structureTime = 0; // microseconds, one query of the collision structure per segment, like before
+		uint64 singleTime = 0; // one segment at a time in the collision tree
+		uint64 packetsTime = 0; // whole batches, one thread
+		uint64 parallelTime = 0; // whole batches, thread pool
+		uint32 batches = 0;
+		uint32 segments = 0;
+		uint32 hits = 0;
+		uint32 threads = 0;
+		bool valid = true;
+
+		double segmentsPerSecond(uint64 time) const { return time ? segments * 1e6 / time : 0; }
+	};
+
+	// batches shaped like the aiming of the doodads: several segments from each of a few origins, in narrow cones
+	std::vector<Line> aimingBatch(RandomGenerator &rng, const Aabb &box, uint32 origins)
+	{
+		std::vector<Line> r;
+		for (uint32 i = 0; i < origins; i++)
+		{
+			vec3 o;
+			for (uint32 k = 0; k < 3; k++)
+				o[k] = rng.randomRange(box.a[k], box.b[k]);
+			const vec3 dir = rng.randomDirection3();
+			const uint32 count = i % 10 == 0 ? 7 : 3;
+			for (uint32 j = 0; j < count; j++)
+				r.push_back(makeSegment(o, o + normalize(dir + rng.randomDirection3() * 0.2) * 12));
+		}
+		return r;
+	}
+
+	RayBatchResult measureRayBatches(const std::vector<TilePos> &positions, uint32 maxTiles, uint32 threads)
+	{
+		RayBatchResult r;
+		r.threads = threads;
+		std::vector<TerrainCollisionItem> items = generateCollisionItems(positions, maxTiles);
+		if (items.empty())
+			return r;
+		Holder<CollisionStructure> structure = newCollisionStructure({});
+		for (const TerrainCollisionItem &it : items)
+			structure->update(it.name, it.collider.share(), it.tr);
+		structure->rebuild();
+		Holder<CollisionQuery> query = newCollisionQuery(structure.share());
+		std::vector<Aabb> boxes;
+		for (const TerrainCollisionItem &it : items)
+			boxes.push_back(it.box);
+		TerrainCollisionTree tree;
+		tree.build(std::move(items));
+		Holder<ThreadPool> pool = newThreadPool("rays_", threads);
+
+		RandomGenerator rng(23, 29);
+		std::vector<TerrainRayHit> single, packets, parallel;
+		for (uint32 b = 0; b < 200; b++)
+		{
+			// mostly per frame sized batches, occasionally a large one
+			const std::vector<Line> segments = aimingBatch(rng, boxes[b % boxes.size()], b % 20 == 0 ? 1000 : 22);
+			single.resize(segments.size());
+			packets.resize(segments.size());
+			parallel.resize(segments.size());
+			{
+				Holder<Timer> timer = newTimer();
+				for (const Line &ln : segments)
+					rayHit(+query, ln);
+				r.structureTime += timer->microsSinceStart();
+			}
+			{
+				Holder<Timer> timer = newTimer();
+				for (uint32 i = 0; i < segments.size(); i++)
+					single[i] = tree.intersection(segments[i]);
+				r.singleTime += timer->microsSinceStart();
+			}
+			{
+				Holder<Timer> timer = newTimer();
+				tree.intersections(segments, packets);
+				r.packetsTime += timer->microsSinceStart();
+			}
+			{
+				Holder<Timer> timer = newTimer();
+				tree.intersections(segments, parallel, +pool);
+				r.parallelTime += timer->microsSinceStart();
+			}
+			for (uint32 i = 0; i < segments.size(); i++)
+			{
+				const TerrainRayHit &a = single[i], &p = packets[i], &q = parallel[i];
+				r.valid = r.valid && a.name == p.name && a.name == q.name && sameHit(a, p) && sameHit(a, q);
+				if (a)
+				{
+					r.valid = r.valid && a.normal.valid() && abs(length(a.normal) - 1) < 1e-3 && dot(a.normal, segments[i].direction) <= 0;
+					r.hits++;
+				}
+			}
+			r.segments += numeric_cast<uint32>(segments.size());
+			r.batches++;
+		}
+		return r;
+	}
+
+	struct SweepResult
+	{
+		uint64 time = 0; // microseconds, all ticks
+		uint64 maxTickTime = 0;
+		uint64 crowdedTime = 0; // the same paths with many more tiles resident
+		uint64 tilesTested = 0;
+		uint64 trianglesTested = 0;
+		uint64 crowdedTilesTested = 0;
+		uint64 triangles = 0; // in all the close tiles
+		uint32 tiles = 0;
+		uint32 crowdedTiles = 0;
+		uint32 ticks = 0;
+		uint32 contacts = 0;
+		uint32 crossings = 0; // the center passed through a surface
+		bool valid = true;
+
+		double tickMicros() const { return ticks ? double(time) / ticks : 0; }
+		double crowdedTickMicros() const { return ticks ? double(crowdedTime) / ticks : 0; }
+		double tilesPerTick() const { return ticks ? double(tilesTested) / ticks : 0; }
+		double trianglesPerTick() const { return ticks ? double(trianglesTested) / ticks : 0; }
+		double trianglesPerTile() const { return tiles ? double(triangles) / tiles : 0; }
+	};
+
+	// scripted flights of the ship through the generated tiles around the origin, the ship must never pass through a surface
+	void flyPaths(const TerrainCollisionTree &tree, SweepResult &r, bool crowded)
+	{
+		constexpr float Radius = 0.08;
+		RandomGenerator rng(31, 37);
+		for (uint32 path = 0; path < 32; path++)
+		{
+			vec3 position = vec3(rng.randomRange(real(-12), real(12)), rng.randomRange(real(-12), real(12)), rng.randomRange(real(-12), real(12)));
+			vec3 direction = rng.randomDirection3();
+			vec3 speed;
+			for (uint32 tick = 0; tick < 300; tick++)
+			{
+				direction = normalize(direction + rng.randomDirection3() * 0.1);
+				speed = speed * 0.93 + direction * 0.006;
+				Holder<Timer> timer = newTimer();
+				const TerrainSlideResult s = tree.slide(position, Radius, speed);
+				const uint64 t = timer->microsSinceStart();
+				if (crowded)
+				{
+					r.crowdedTime += t;
+					r.crowdedTilesTested += s.tiles;
+				}
+				else
+				{
+					r.time += t;
+					r.maxTickTime = max(r.maxTickTime, t);
+					r.tilesTested += s.tiles;
+					r.trianglesTested += s.triangles;
+					r.contacts += s.contacts;
+					r.ticks++;
+					if (distance(position, s.position) > 1e-5 && tree.intersection(makeSegment(position, s.position)))
+						r.crossings++;
+				}
+				if (s.contacts)
+					speed -= s.normal * min(dot(speed, s.normal), real(0));
+				position = s.position;
+			}
+		}
+	}
+
+	SweepResult measureSweeps(const std::vector<TilePos> &view, const std::vector<TilePos> &others)
+	{
+		SweepResult r;
+		std::vector<TilePos> closeTiles;
+		for (const TilePos &p : view)
+			if (p.distance(vec3()) < 20)
+				closeTiles.push_back(p);
+		std::vector<TerrainCollisionItem> items = generateCollisionItems(closeTiles, 1000);
+		r.tiles = numeric_cast<uint32>(items.size());
+		for (const TerrainCollisionItem &it : items)
+			r.triangles += it.collider->triangles().size();
+		TerrainCollisionTree tree;
+		for (const TerrainCollisionItem &it : items)
+			tree.insert(it.name, it.collider.share(), it.tr);
+		flyPaths(tree, r, false);
+
+		// many more resident tiles, out of reach of the flights, which must not add any work to the ticks
+		std::vector<TilePos> farTiles;
+		for (const TilePos &p : others)
+			if (p.distance(vec3()) > 64) // the flights start within 21 units and travel less than 26
+				farTiles.push_back(p);
+		for (TerrainCollisionItem &it : generateCollisionItems(farTiles, 64))
+			tree.insert(it.name + 100000, std::move(it.collider), it.tr);
+		r.crowdedTiles = tree.count();
+		flyPaths(tree, r, true);
+
+		r.valid = r.crossings == 0;
+		return r;
+	}
+}
+
+void benchmarkCollisionTree(const BenchmarkContext &context)
+{
+	const CollisionTreeResult collisionTree = measureCollisionTree(context.all, 64);
+	BenchmarkSection s("collisionTree");
+	s.value("tiles", collisionTree.tiles);
+	s.value("steps", collisionTree.steps);
+	s.value("incrementalMs", ms(collisionTree.incrementalTime));
+	s.value("fullRebuildMs", ms(collisionTree.fullRebuildTime));
+	s.value("balancedBuildMs", ms(collisionTree.balancedBuildTime));
+	s.value("maxDepth", collisionTree.maxDepth);
+	s.value("degradation", collisionTree.degradation);
+	s.value("rays", collisionTree.rays);
+	s.value("normalMismatches", collisionTree.normalMismatches);
+	s.check(collisionTree.valid, "the hits differ from testing every tile");
+	s.check(collisionTree.normalMismatches * 100 <= collisionTree.rays, "the normals differ from the hit triangles");
+	benchmarkSubmit(std::move(s));
+}
+
+void benchmarkRayBatches(const BenchmarkContext &context)
+{
+	const RayBatchResult rayBatches = measureRayBatches(context.all, 64, context.threads);
+	BenchmarkSection s("rayBatches");
+	s.value("batches", rayBatches.batches);
+	s.value("segments", rayBatches.segments);
+	s.value("hits", rayBatches.hits);
+	s.value("structureMs", ms(rayBatches.structureTime));
+	s.value("singleMs", ms(rayBatches.singleTime));
+	s.value("packetsMs", ms(rayBatches.packetsTime));
+	s.value("parallelMs", ms(rayBatches.parallelTime));
+	s.value("threads", rayBatches.threads);
+	s.check(rayBatches.valid, "the hits differ");
+	benchmarkSubmit(std::move(s));
+}
+
+void benchmarkSweeps(const BenchmarkContext &context)
+{
+	const SweepResult sweeps = measureSweeps(context.view, context.all);
+	BenchmarkSection s("sweeps");
+	s.value("tiles", sweeps.tiles);
+	s.value("ticks", sweeps.ticks);
+	s.value("contacts", sweeps.contacts);
+	s.value("tickUs", sweeps.tickMicros());
+	s.value("maxTickUs", sweeps.maxTickTime);
+	s.value("crowdedTiles", sweeps.crowdedTiles);
+	s.value("crowdedTickUs", sweeps.crowdedTickMicros());
+	s.value("tilesPerTick", sweeps.tilesPerTick());
+	s.value("trianglesPerTick", sweeps.trianglesPerTick());
+	s.value("trianglesPerTile", sweeps.trianglesPerTile());
+	s.value("crowdedTilesTested", sweeps.crowdedTilesTested);
+	s.value("crossings", sweeps.crossings);
+	s.check(sweeps.valid, "the ship passed through a surface");
+	s.check(sweeps.tilesPerTick() <= 8, "the sweeps test more tiles than can touch the ship"); // a point lies in at most 8 tiles of the view
+	s.check(sweeps.trianglesPerTick() * 20 <= sweeps.tilesPerTick() * sweeps.trianglesPerTile(), "the sweeps test too many triangles of each tile");
+	s.check(sweeps.crowdedTilesTested == sweeps.tilesTested, "the distant resident tiles are tested by the sweeps");
+	benchmarkSubmit(std::move(s));
+}
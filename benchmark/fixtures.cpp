@@ -0,0 +1,182 @@
+#include "benchmark.h"
+
+#include <cage-core/random.h>
+#include <cage-core/mesh.h>
+#include <cage-core/image.h>
+#include <cage-core/collider.h>
+#include <cage-core/geometry.h>
+
+#include <atomic>
+#include <algorithm>
+#include <unordered_set>
+
+double ms(uint64 micros)
+{
+	return micros * 1e-3;
+}
+
+// deterministic set of tiles at several radii, shaped like the tiles requested by the game
+std::vector<TilePos> generatePositions(uint32 countPerRadius)
+{
+	RandomGenerator rng(13, 42);
+	std::vector<TilePos> result;
+	for (sint32 radius = BenchmarkTileSize / 2; radius >= 4; radius /= 2)
+	{
+		for (uint32 i = 0; i < countPerRadius; i++)
+		{
+			TilePos p;
+			p.radius = BenchmarkTileSize / 2;
+			for (uint32 j = 0; j < 3; j++)
+				p.pos[j] = rng.randomRange(-8, 9) * BenchmarkTileSize;
+			while (p.radius > radius)
+			{
+				p.radius /= 2;
+				for (uint32 j = 0; j < 3; j++)
+					p.pos[j] += (rng.randomChance() < 0.5 ? -1 : 1) * p.radius;
+			}
+			result.push_back(p);
+		}
+	}
+	return result;
+}
+
+// tiles requested by the level of detail hierarchy around a stationary player at the origin
+std::vector<TilePos> typicalView()
+{
+	playerPosition = playerSpeed = vec3();
+	std::vector<TileChange> changes;
+	std::vector<TilePos> tiles;
+	for (uint32 iteration = 0; iteration < 100; iteration++)
+	{
+		changes.clear();
+		updateNeededTiles(changes);
+		if (changes.empty())
+			break;
+		for (const TileChange &c : changes)
+		{
+			if (c.change == TileChangeEnum::Add)
+			{
+				tiles.push_back(c.pos);
+				neededTileReady(c.pos, true);
+			}
+			else if (c.change == TileChangeEnum::Remove)
+			{
+				tiles.erase(std::remove(tiles.begin(), tiles.end(), c.pos), tiles.end());
+				neededTileReady(c.pos, false);
+			}
+		}
+	}
+	changes.clear();
+	clearNeededTiles(changes);
+	return tiles;
+}
+
+// all tiles requested, including prefetched, while flying along a straight line
+std::vector<TilePos> flightPath()
+{
+	playerPosition = vec3();
+	playerSpeed = vec3(0.4, 0.05, 0.25); // per control tick
+	std::vector<TileChange> changes;
+	std::vector<TilePos> tiles;
+	std::unordered_set<uint64> keys;
+	for (uint32 tick = 0; tick < 900; tick++)
+	{
+		changes.clear();
+		updateNeededTiles(changes);
+		for (const TileChange &c : changes)
+		{
+			if (c.change == TileChangeEnum::Add && keys.insert(c.pos.key()).second)
+				tiles.push_back(c.pos);
+			if ((c.change == TileChangeEnum::Add || c.change == TileChangeEnum::Priority) && !c.prefetch)
+				neededTileReady(c.pos, true); // all tiles are ready immediately
+			else if (c.change == TileChangeEnum::Remove)
+				neededTileReady(c.pos, false);
+		}
+		playerPosition += playerSpeed;
+	}
+	changes.clear();
+	clearNeededTiles(changes);
+	for (const TileChange &c : changes)
+		if (c.change == TileChangeEnum::Remove)
+			neededTileReady(c.pos, false);
+	playerPosition = playerSpeed = vec3();
+	return tiles;
+}
+
+std::vector<TerrainCollisionItem> generateCollisionItems(const std::vector<TilePos> &positions, uint32 maxTiles)
+{
+	std::atomic<bool> cancelled {false};
+	std::vector<TerrainCollisionItem> items;
+	for (const TilePos &p : positions)
+	{
+		if (items.size() >= maxTiles)
+			break;
+		TerrainCollisionItem it;
+		Holder<Mesh> mesh;
+		Holder<Image> albedo, special;
+		terrainGenerate(p, cancelled, mesh, it.collider, albedo, special);
+		if (!it.collider)
+			continue;
+		it.tr = p.getTransform();
+		it.box = it.collider->box() * it.tr;
+		it.name = numeric_cast<uint32>(items.size()) + 1;
+		items.push_back(std::move(it));
+	}
+	return items;
+}
+
+TerrainRayHit bruteForceHit(const std::vector<TerrainCollisionItem> &items, const Line &ln)
+{
+	TerrainRayHit best;
+	for (const TerrainCollisionItem &it : items)
+	{
+		const vec3 p = intersection(ln, +it.collider, it.tr);
+		if (!p.valid())
+			continue;
+		const real t = dot(p - ln.origin, ln.direction);
+		if (t < best.distance)
+		{
+			best.point = p;
+			best.distance = t;
+			best.name = it.name;
+		}
+	}
+	// the normal of the closest triangle of the hit tile
+	for (const TerrainCollisionItem &it : items)
+	{
+		if (it.name != best.name)
+			continue;
+		real closest = real::Infinity();
+		for (const Triangle &lt : it.collider->triangles())
+		{
+			const Triangle t = lt * it.tr;
+			const vec3 p = intersection(ln, t);
+			if (!p.valid() || abs(dot(p - ln.origin, ln.direction) - best.distance) >= closest)
+				continue;
+			closest = abs(dot(p - ln.origin, ln.direction) - best.distance);
+			best.normal = normalize(cross(t.vertices[1] - t.vertices[0], t.vertices[2] - t.vertices[0]));
+			if (dot(best.normal, ln.direction) > 0)
+				best.normal = -best.normal;
+		}
+	}
+	return best;
+}
+
+bool sameHit(const TerrainRayHit &a, const TerrainRayHit &b)
+{
+	if (!a || !b)
+		return !a && !b;
+	return abs(a.distance - b.distance) < 1e-3;
+}
+
+vec3 rayHit(CollisionQuery *query, const Line &ln)
+{
+	if (!query->query(ln))
+		return vec3::Nan();
+	Holder<const Collider> c;
+	transform tr;
+	query->collider(c, tr);
+	Triangle t = c->triangles()[query->collisionPairs()[0].b];
+	t *= tr;
+	return intersection(ln, t);
+}
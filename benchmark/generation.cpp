@@ -0,0 +1,291 @@
+#include "benchmark.h"
+
+#include <cage-core/config.h>
+#include <cage-core/threadPool.h>
+#include <cage-core/concurrent.h>
+#include <cage-core/timer.h>
+#include <cage-core/mesh.h>
+#include <cage-core/image.h>
+#include <cage-core/collider.h>
+#include <cage-core/random.h>
+
+#include <cmath>
+#include <atomic>
+
+namespace
+{
+	struct Result
+	{
+		std::string scenario = "sample";
+		TerrainGenerateStatistics stats;
+		uint64 duration = 0; // wall time, microseconds
+		uint32 threads = 0;
+		sint32 radius = 0; // 0 = all radii
+		bool batched = true; // batched densities and textures
+	};
+
+	struct Run
+	{
+		const std::vector<TilePos> *positions = nullptr;
+		std::vector<TerrainGenerateStatistics> perThread;
+		std::atomic<uint32> next {0};
+		std::atomic<bool> cancelled {false};
+
+		void work(uint32 thread, uint32)
+		{
+			while (true)
+			{
+				const uint32 i = next++;
+				if (i >= positions->size())
+					break;
+				Holder<Mesh> mesh;
+				Holder<Collider> collider;
+				Holder<Image> albedo, special;
+				terrainGenerate((*positions)[i], cancelled, mesh, collider, albedo, special, &perThread[thread]);
+			}
+		}
+	};
+
+	void accumulate(TerrainGenerateStatistics &a, const TerrainGenerateStatistics &b)
+	{
+		a.rejection += b.rejection;
+		a.densities += b.densities;
+		a.marchingCubes += b.marchingCubes;
+		a.clip += b.clip;
+		a.unwrap += b.unwrap;
+		a.collider += b.collider;
+		a.textures += b.textures;
+		a.dilation += b.dilation;
+		a.samples += b.samples;
+		a.faces += b.faces;
+		a.colliderFaces += b.colliderFaces;
+		a.texels += b.texels;
+		a.probes += b.probes;
+		a.sampleHits += b.sampleHits;
+		a.tiles += b.tiles;
+		a.nonEmptyTiles += b.nonEmptyTiles;
+		a.rejectedTiles += b.rejectedTiles;
+	}
+
+	Result measure(const std::vector<TilePos> &positions, uint32 threads, sint32 radius)
+	{
+		Run run;
+		run.positions = &positions;
+		run.perThread.resize(threads);
+		terrainDensityCacheClear(); // every run starts cold
+		Holder<ThreadPool> pool = newThreadPool("benchmark_", threads);
+		pool->function.bind<Run, &Run::work>(&run);
+		Holder<Timer> timer = newTimer();
+		pool->run();
+		Result r;
+		r.duration = timer->microsSinceStart();
+		r.threads = threads;
+		r.radius = radius;
+		r.batched = configGetBool("flittermouse/terrain/batchedDensities", true) && configGetBool("flittermouse/terrain/batchedTextures", true);
+		for (const auto &s : run.perThread)
+			accumulate(r.stats, s);
+		return r;
+	}
+
+	uint64 cpuTime(const TerrainGenerateStatistics &s)
+	{
+		return s.rejection + s.densities + s.marchingCubes + s.clip + s.unwrap + s.collider + s.textures + s.dilation;
+	}
+
+	uint64 textureBytes(const TerrainGenerateStatistics &s)
+	{
+		return s.texels * 5; // rgb albedo + two channels special
+	}
+
+	double sampleHitRate(const TerrainGenerateStatistics &s)
+	{
+		return s.samples ? double(s.sampleHits) / s.samples : 0;
+	}
+
+	double tilesPerSecond(const Result &r)
+	{
+		return r.duration ? r.stats.tiles * 1e6 / r.duration : 0;
+	}
+
+	void printHeader()
+	{
+		CAGE_LOG(SeverityEnum::Info, "benchmark", "scenario  radius  threads  batched  tiles  nonEmpty  rejected  rejection[ms]  densities[ms]  sampleHits[%]  marchingCubes[ms]  clip[ms]  unwrap[ms]  collider[ms]  textures[ms]  dilation[ms]  faces  avgResolution  wall[ms]  tiles/s");
+	}
+
+	void printRow(const Result &r)
+	{
+		const TerrainGenerateStatistics &s = r.stats;
+		const uint32 avgRes = s.nonEmptyTiles ? uint32(std::sqrt(double(s.texels) / s.nonEmptyTiles)) : 0;
+		const string radius = r.radius ? string(stringizer() + r.radius) : string("all");
+		CAGE_LOG(SeverityEnum::Info, "benchmark", stringizer() + r.scenario.c_str() + "  " + radius + "  " + r.threads + "  " + r.batched + "  " + s.tiles + "  " + s.nonEmptyTiles + "  " + s.rejectedTiles + "  " + ms(s.rejection) + "  " + ms(s.densities) + "  " + (sampleHitRate(s) * 100) + "  " + ms(s.marchingCubes) + "  " + ms(s.clip) + "  " + ms(s.unwrap) + "  " + ms(s.collider) + "  " + ms(s.textures) + "  " + ms(s.dilation) + "  " + s.faces + "  " + avgRes + "  " + ms(r.duration) + "  " + tilesPerSecond(r));
+	}
+
+	std::string jsonRow(const Result &r)
+	{
+		const TerrainGenerateStatistics &s = r.stats;
+		std::string j = "{";
+		j += "\"scenario\":\"" + r.scenario + "\"";
+		j += ",\"radius\":" + std::to_string(r.radius);
+		j += ",\"threads\":" + std::to_string(r.threads);
+		j += std::string(",\"batched\":") + (r.batched ? "true" : "false");
+		j += ",\"tiles\":" + std::to_string(s.tiles);
+		j += ",\"nonEmptyTiles\":" + std::to_string(s.nonEmptyTiles);
+		j += ",\"rejectedTiles\":" + std::to_string(s.rejectedTiles);
+		j += ",\"rejectionMs\":" + std::to_string(ms(s.rejection));
+		j += ",\"probes\":" + std::to_string(s.probes);
+		j += ",\"densitiesMs\":" + std::to_string(ms(s.densities));
+		j += ",\"marchingCubesMs\":" + std::to_string(ms(s.marchingCubes));
+		j += ",\"clipMs\":" + std::to_string(ms(s.clip));
+		j += ",\"unwrapMs\":" + std::to_string(ms(s.unwrap));
+		j += ",\"colliderMs\":" + std::to_string(ms(s.collider));
+		j += ",\"texturesMs\":" + std::to_string(ms(s.textures));
+		j += ",\"dilationMs\":" + std::to_string(ms(s.dilation));
+		j += ",\"samples\":" + std::to_string(s.samples);
+		j += ",\"sampleHits\":" + std::to_string(s.sampleHits);
+		j += ",\"faces\":" + std::to_string(s.faces);
+		j += ",\"colliderFaces\":" + std::to_string(s.colliderFaces);
+		j += ",\"texels\":" + std::to_string(s.texels);
+		j += ",\"wallMs\":" + std::to_string(ms(r.duration));
+		j += ",\"tilesPerSecond\":" + std::to_string(tilesPerSecond(r));
+		j += "}";
+		return j;
+	}
+}
+
+void benchmarkGeneration(const BenchmarkContext &context)
+{
+	const std::vector<TilePos> &all = context.all;
+	const uint32 threads = context.threads;
+	std::vector<Result> results;
+	for (sint32 radius = BenchmarkTileSize / 2; radius >= 4; radius /= 2)
+	{
+		std::vector<TilePos> subset;
+		for (const TilePos &p : all)
+			if (p.radius == radius)
+				subset.push_back(p);
+		results.push_back(measure(subset, 1, radius));
+	}
+	results.push_back(measure(all, 1, 0));
+	{
+		// reference scalar path
+		configSetBool("flittermouse/terrain/batchedDensities", false);
+		configSetBool("flittermouse/terrain/batchedTextures", false);
+		results.push_back(measure(all, 1, 0));
+		configSetBool("flittermouse/terrain/batchedDensities", true);
+		configSetBool("flittermouse/terrain/batchedTextures", true);
+	}
+	if (threads > 1)
+		results.push_back(measure(all, threads, 0));
+
+	// typical view generated with the same resolution for all tiles and with the adaptive level of detail
+	{
+		configSetBool("flittermouse/terrain/lod/adaptive", false);
+		results.push_back(measure(context.view, threads, 0));
+		results.back().scenario = "view-fixed";
+		configSetBool("flittermouse/terrain/lod/adaptive", true);
+		results.push_back(measure(context.view, threads, 0));
+		results.back().scenario = "view-adaptive";
+	}
+	const TerrainGenerateStatistics fixed = results[results.size() - 2].stats;
+	const TerrainGenerateStatistics adaptive = results[results.size() - 1].stats;
+
+	// tiles along a flight path generated with and without the empty tile rejection
+	{
+		configSetBool("flittermouse/terrain/emptyRejection", false);
+		results.push_back(measure(context.flight, threads, 0));
+		results.back().scenario = "flight-full";
+		configSetBool("flittermouse/terrain/emptyRejection", true);
+		results.push_back(measure(context.flight, threads, 0));
+		results.back().scenario = "flight-rejection";
+	}
+	const TerrainGenerateStatistics flightFull = results[results.size() - 2].stats;
+	const TerrainGenerateStatistics flightRejection = results[results.size() - 1].stats;
+	{
+		// the same comparison on tiles of all sizes scattered around, and on the typical view
+		configSetBool("flittermouse/terrain/emptyRejection", false);
+		results.push_back(measure(all, threads, 0));
+		results.back().scenario = "all-full";
+		results.push_back(measure(context.view, threads, 0));
+		results.back().scenario = "view-full";
+		configSetBool("flittermouse/terrain/emptyRejection", true);
+		results.push_back(measure(all, threads, 0));
+		results.back().scenario = "all-rejection";
+		results.push_back(measure(context.view, threads, 0));
+		results.back().scenario = "view-rejection";
+	}
+	const TerrainGenerateStatistics allFull = results[results.size() - 4].stats;
+	const TerrainGenerateStatistics viewFull = results[results.size() - 3].stats;
+	const TerrainGenerateStatistics allRejection = results[results.size() - 2].stats;
+	const TerrainGenerateStatistics viewRejection = results[results.size() - 1].stats;
+	{
+		// the same flight without the shared density cache
+		const uint32 budget = configGetUint32("flittermouse/terrain/densityCache/budget", 32);
+		configSetUint32("flittermouse/terrain/densityCache/budget", 0);
+		results.push_back(measure(context.flight, threads, 0));
+		results.back().scenario = "flight-nocache";
+		configSetUint32("flittermouse/terrain/densityCache/budget", budget);
+	}
+	const TerrainGenerateStatistics flightNoCache = results.back().stats;
+
+	printHeader();
+	for (const Result &r : results)
+		printRow(r);
+
+	{
+		std::string runs = "[\n";
+		for (uint32 i = 0; i < results.size(); i++)
+			runs += "\t" + jsonRow(results[i]) + (i + 1 < results.size() ? ",\n" : "\n");
+		runs += "]";
+		BenchmarkSection s("generation");
+		s.value("runs", numeric_cast<uint32>(results.size()));
+		s.json("results", runs);
+		benchmarkSubmit(std::move(s));
+	}
+	{
+		BenchmarkSection s("viewSavings");
+		s.value("cpuMs", ms(cpuTime(fixed)) - ms(cpuTime(adaptive)));
+		s.value("textureBytes", sint64(textureBytes(fixed)) - sint64(textureBytes(adaptive)));
+		benchmarkSubmit(std::move(s));
+	}
+	{
+		BenchmarkSection s("flightSavings");
+		s.value("rejectedTiles", flightRejection.rejectedTiles);
+		s.value("emptyTiles", flightRejection.tiles - flightRejection.nonEmptyTiles);
+		s.value("probes", flightRejection.probes);
+		s.value("cpuMs", ms(cpuTime(flightFull)) - ms(cpuTime(flightRejection)));
+		// the rejection must be conservative, it may only skip tiles that would be empty anyway
+		s.check(flightFull.nonEmptyTiles == flightRejection.nonEmptyTiles && flightFull.faces == flightRejection.faces, "some tiles with surface were rejected");
+		benchmarkSubmit(std::move(s));
+	}
+	{
+		BenchmarkSection s("rejection");
+		// no finite difference may exceed the bound the rejection relies on
+		const real bound = terrainDensityLipschitz();
+		RandomGenerator rng(37, 73);
+		const real eps = 0.01;
+		real sampled = 0;
+		for (uint32 i = 0; i < 20000; i++)
+		{
+			const vec3 p = vec3(rng.randomRange(real(-200), real(200)), rng.randomRange(real(-200), real(200)), rng.randomRange(real(-200), real(200)));
+			const real d = terrainDensity(p);
+			const vec3 grad = vec3(terrainDensity(p + vec3(eps, 0, 0)) - d, terrainDensity(p + vec3(0, eps, 0)) - d, terrainDensity(p + vec3(0, 0, eps)) - d) / eps;
+			sampled = max(sampled, length(grad));
+		}
+		s.value("lipschitz", bound);
+		s.value("sampledGradient", sampled);
+		s.value("rejectedTiles", allRejection.rejectedTiles + viewRejection.rejectedTiles + flightRejection.rejectedTiles);
+		s.check(sampled <= bound, "the density is steeper than its bound");
+		s.check(allFull.nonEmptyTiles == allRejection.nonEmptyTiles && allFull.faces == allRejection.faces, "some scattered tiles with surface were rejected");
+		s.check(viewFull.nonEmptyTiles == viewRejection.nonEmptyTiles && viewFull.faces == viewRejection.faces, "some tiles of the view with surface were rejected");
+		benchmarkSubmit(std::move(s));
+	}
+	{
+		BenchmarkSection s("densityCache");
+		s.value("hitRate", sampleHitRate(flightRejection));
+		s.value("densitiesMs", ms(flightRejection.densities));
+		s.value("densitiesWithoutCacheMs", ms(flightNoCache.densities));
+		s.check(flightNoCache.faces == flightRejection.faces && flightNoCache.sampleHits == 0, "the meshes differ");
+		s.check(terrainDensityCacheBytes() == terrainDensityCacheStatistics().bytes, "the running size of the cache drifted");
+		benchmarkSubmit(std::move(s));
+	}
+}
@@ -0,0 +1,195 @@
+#include "benchmark.h"
+#include "../sources/lightning/lightning.h"
+
+#include <cage-core/random.h>
+#include <cage-core/timer.h>
+#include <cage-core/entities.h>
+
+namespace
+{
+	// stand-ins of the engine components written by the lightning, of similar sizes
+	struct BenchTransform
+	{
+		transform t;
+	};
+
+	struct BenchRender
+	{
+		vec3 color = vec3::Nan();
+		real opacity = real::Nan();
+		uint32 object = 0;
+		uint32 sceneMask = 1;
+	};
+
+	struct BenchAnimation
+	{
+		uint64 startTime = 0;
+		real speed = 1;
+		real offset = 0;
+	};
+
+	struct BenchLight
+	{
+		vec3 color = vec3(1);
+		vec3 attenuation = vec3(1, 0, 0);
+		real intensity = 1;
+		uint32 lightType = 0;
+	};
+
+	struct BenchTimeout
+	{
+		uint32 ttl = 1;
+	};
+
+	// fills the stand-ins like the game fills the engine components
+	struct PooledWriter
+	{
+		EntityComponent *transformComponent = nullptr;
+		EntityComponent *renderComponent = nullptr;
+		EntityComponent *animationComponent = nullptr;
+		EntityComponent *lightComponent = nullptr;
+
+		void segment(Entity *e, const LightningSegment &s, const transform &tr)
+		{
+			e->value<BenchTransform>(transformComponent).t = tr;
+			BenchRender &rn = e->value<BenchRender>(renderComponent);
+			rn.object = 1;
+			rn.color = s.color;
+			e->value<BenchAnimation>(animationComponent).offset = s.animation;
+		}
+
+		void light(Entity *e, const LightningSegment &s, const transform &tr)
+		{
+			e->value<BenchTransform>(transformComponent).t = tr;
+			BenchLight &l = e->value<BenchLight>(lightComponent);
+			l.color = s.color;
+			l.intensity = 1.5;
+		}
+	};
+
+	struct LightningResult
+	{
+		uint64 entitiesTime = 0; // microseconds, an entity per segment destroyed by the timeout, like before
+		uint64 pooledTime = 0; // reused entities
+		uint64 entitiesCreated = 0;
+		uint64 pooledCreated = 0;
+		uint64 segments = 0;
+		uint32 ticks = 0;
+		uint32 pooledEntities = 0; // at the end
+		bool valid = true;
+
+		double tickMicros(uint64 time) const { return ticks ? double(time) / ticks : 0; }
+		double createdPerSecond(uint64 created) const { return ticks ? created * 30.0 / ticks : 0; } // at the control update rate
+	};
+
+	// discharges of several magnets, like in the game
+	void dischargeBolts(LightningBuffer &buffer, RandomGenerator &rng)
+	{
+		const vec3 camera = vec3(0, 0, 3);
+		for (uint32 i = 0; i < 6; i++)
+		{
+			const vec3 a = rng.randomDirection3() * 0.3;
+			const vec3 b = a + rng.randomDirection3() * rng.randomRange(real(0.3), real(1.5));
+			buffer.discharge(a, b, camera, vec3(0.2, 0.2, 0.6));
+		}
+	}
+
+	LightningResult measureLightning()
+	{
+		constexpr uint32 Ticks = 600;
+		constexpr uint32 Lights = 12;
+		LightningResult r;
+		r.ticks = Ticks;
+
+		{
+			Holder<EntityManager> man = newEntityManager();
+			EntityComponent *transformComponent = man->defineComponent(BenchTransform());
+			EntityComponent *renderComponent = man->defineComponent(BenchRender());
+			EntityComponent *animationComponent = man->defineComponent(BenchAnimation());
+			EntityComponent *lightComponent = man->defineComponent(BenchLight());
+			EntityComponent *timeoutComponent = man->defineComponent(BenchTimeout());
+			EntityGroup *toDestroy = man->defineGroup();
+			LightningBuffer buffer;
+			RandomGenerator rng(41, 43);
+			for (uint32 tick = 0; tick < Ticks; tick++)
+			{
+				Holder<Timer> timer = newTimer();
+				buffer.clear();
+				dischargeBolts(buffer, rng);
+				for (const LightningSegment &s : buffer.segments)
+				{
+					Entity *e = man->createUnique();
+					BenchTransform &t = e->value<BenchTransform>(transformComponent);
+					t.t.position = s.center;
+					t.t.orientation = s.orientation;
+					t.t.scale = s.length;
+					BenchRender &rn = e->value<BenchRender>(renderComponent);
+					rn.object = 1;
+					rn.color = s.color;
+					e->value<BenchAnimation>(animationComponent).offset = s.animation;
+					e->value<BenchTimeout>(timeoutComponent).ttl = 1;
+					if (s.light)
+					{
+						BenchLight &l = e->value<BenchLight>(lightComponent);
+						l.color = s.color;
+						l.intensity = 1.5;
+					}
+					r.entitiesCreated++;
+				}
+				for (Entity *e : timeoutComponent->entities())
+				{
+					if (e->value<BenchTimeout>(timeoutComponent).ttl-- == 0)
+						e->add(toDestroy);
+				}
+				toDestroy->destroy();
+				r.entitiesTime += timer->microsSinceStart();
+			}
+		}
+
+		{
+			Holder<EntityManager> man = newEntityManager();
+			EntityComponent *transformComponent = man->defineComponent(BenchTransform());
+			EntityComponent *renderComponent = man->defineComponent(BenchRender());
+			EntityComponent *animationComponent = man->defineComponent(BenchAnimation());
+			EntityComponent *lightComponent = man->defineComponent(BenchLight());
+			LightningBuffer current, previous;
+			LightningSlots segmentSlots, lightSlots;
+			PooledWriter writer;
+			writer.transformComponent = transformComponent;
+			writer.renderComponent = renderComponent;
+			writer.animationComponent = animationComponent;
+			writer.lightComponent = lightComponent;
+			RandomGenerator rng(41, 43);
+			for (uint32 tick = 0; tick < Ticks; tick++)
+			{
+				Holder<Timer> timer = newTimer();
+				dischargeBolts(current, rng);
+				r.segments += previous.segments.size() + current.segments.size();
+				lightningFillSlots(+man, renderComponent, lightComponent, previous, current, segmentSlots, lightSlots, Lights, writer);
+				std::swap(previous, current);
+				current.clear();
+				r.pooledTime += timer->microsSinceStart();
+			}
+			r.pooledCreated = segmentSlots.created() + lightSlots.created();
+			r.pooledEntities = segmentSlots.size() + lightSlots.size();
+		}
+
+		r.valid = r.segments > 0 && r.pooledCreated * 10 < r.entitiesCreated;
+		return r;
+	}
+}
+
+void benchmarkLightning(const BenchmarkContext &)
+{
+	const LightningResult lightning = measureLightning();
+	BenchmarkSection s("lightning");
+	s.value("ticks", lightning.ticks);
+	s.value("segments", lightning.segments);
+	s.value("tickUs", lightning.tickMicros(lightning.pooledTime));
+	s.value("entityPerSegmentTickUs", lightning.tickMicros(lightning.entitiesTime));
+	s.value("createdPerSecond", lightning.createdPerSecond(lightning.pooledCreated));
+	s.value("entityPerSegmentCreatedPerSecond", lightning.createdPerSecond(lightning.entitiesCreated));
+	s.value("pooledEntities", lightning.pooledEntities);
+	s.check(lightning.valid, "the pool does not save entities");
+	benchmarkSubmit(std::move(s));
+}
@@ -0,0 +1,54 @@
+#include "benchmark.h"
+
+#include <cage-core/logger.h>
+#include <cage-core/config.h>
+#include <cage-core/concurrent.h>
+
+#include <cstdlib>
+
+vec3 playerPosition;
+vec3 playerSpeed;
+real terrainGenerationProgress;
+
+int main(int argc, const char *args[])
+{
+	try
+	{
+		Holder<Logger> log1 = newLogger();
+		log1->format.bind<logFormatConsole>();
+		log1->output.bind<logOutputStdOut>();
+
+		// usage: flittermouse-benchmark [tiles per radius] [threads] [json output path]
+		const uint32 countPerRadius = argc > 1 ? numeric_cast<uint32>(std::atoi(args[1])) : 8;
+		const uint32 threads = argc > 2 ? numeric_cast<uint32>(std::atoi(args[2])) : processorsCount();
+		const string jsonPath = argc > 3 ? string(args[3]) : string("terrain-benchmark.json");
+
+		CAGE_LOG(SeverityEnum::Info, "benchmark", stringizer() + "terrain seed: " + terrainSeed() + ", generator version: " + TerrainGeneratorVersion);
+		BenchmarkContext context;
+		context.threads = threads;
+		context.all = generatePositions(countPerRadius);
+		context.view = typicalView();
+		CAGE_LOG(SeverityEnum::Info, "benchmark", stringizer() + "typical view tiles: " + context.view.size() + ", quality tier: " + configGetUint32("flittermouse/terrain/quality", 1));
+		context.flight = flightPath();
+		CAGE_LOG(SeverityEnum::Info, "benchmark", stringizer() + "flight path tiles: " + context.flight.size());
+
+		benchmarkScheduler(context);
+		benchmarkUpload(context);
+		benchmarkGeneration(context);
+		benchmarkCompression(context);
+		benchmarkAtlas(context);
+		benchmarkColliders(context);
+		benchmarkCollisionTree(context);
+		benchmarkRayBatches(context);
+		benchmarkSweeps(context);
+		benchmarkLightning(context);
+		benchmarkTimeouts(context);
+
+		return benchmarkWrite(jsonPath) ? 0 : 1;
+	}
+	catch (...)
+	{
+		detail::logCurrentCaughtException();
+	}
+	return 1;
+}
@@ -0,0 +1,62 @@
+#include "benchmark.h"
+
+#include <cage-core/files.h>
+
+namespace
+{
+	std::vector<BenchmarkSection> sections;
+}
+
+BenchmarkSection &BenchmarkSection::add(const std::string &key, const std::string &encoded, bool logged)
+{
+	Entry e;
+	e.key = key;
+	e.json = encoded;
+	e.logged = logged;
+	entries.push_back(std::move(e));
+	return *this;
+}
+
+BenchmarkSection &BenchmarkSection::check(bool condition, const std::string &failure)
+{
+	if (!condition)
+		failures.push_back(failure);
+	return *this;
+}
+
+void benchmarkSubmit(BenchmarkSection &&section)
+{
+	std::string line = section.name + ":";
+	bool first = true;
+	for (const BenchmarkSection::Entry &e : section.entries)
+	{
+		if (!e.logged)
+			continue;
+		line += std::string(first ? " " : ", ") + e.key + ": " + e.json;
+		first = false;
+	}
+	CAGE_LOG(SeverityEnum::Info, "benchmark", line.c_str());
+	for (const std::string &f : section.failures)
+		CAGE_LOG(SeverityEnum::Error, "benchmark", (section.name + " check failed: " + f).c_str());
+	sections.push_back(std::move(section));
+}
+
+bool benchmarkWrite(const string &path)
+{
+	bool ok = true;
+	std::string json = "{\n";
+	for (uint32 i = 0; i < sections.size(); i++)
+	{
+		const BenchmarkSection &s = sections[i];
+		json += "\"" + s.name + "\": {";
+		for (const BenchmarkSection::Entry &e : s.entries)
+			json += "\"" + e.key + "\":" + e.json + ",";
+		json += std::string("\"ok\":") + (s.failures.empty() ? "true" : "false");
+		json += i + 1 < sections.size() ? "},\n" : "}\n";
+		ok = ok && s.failures.empty();
+	}
+	json += "}\n";
+	writeFile(path)->write({ json.data(), json.data() + json.size() });
+	CAGE_LOG(SeverityEnum::Info, "benchmark", stringizer() + "results written to: " + path);
+	return ok;
+}
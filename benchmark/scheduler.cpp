@@ -0,0 +1,87 @@
+#include "benchmark.h"
+#include "../sources/terrain/scheduler.h"
+
+#include <cage-core/concurrent.h>
+#include <cage-core/timer.h>
+
+#include <atomic>
+#include <deque>
+
+namespace
+{
+	struct SchedulerTile
+	{
+		TilePos pos;
+		bool prefetch = false;
+		std::atomic<uint32> processed {0};
+	};
+
+	// the generator threads are simulated by slow workers, one more thread stops the scheduler while the queue is still full
+	struct SchedulerRun
+	{
+		TerrainScheduler<SchedulerTile> scheduler;
+		std::deque<SchedulerTile> tiles;
+		std::vector<SchedulerTile *> returned;
+		std::atomic<uint32> processed {0};
+		uint64 stopTime = 0; // microseconds from the stop until all workers exited
+		Holder<Timer> timer = newTimer();
+
+		void work(uint32 thread, uint32)
+		{
+			if (thread == 0)
+			{
+				while (processed < 50)
+					threadSleep(100);
+				returned = scheduler.stop();
+				timer->reset();
+				return;
+			}
+			while (SchedulerTile *t = scheduler.pop())
+			{
+				threadSleep(200);
+				t->processed++;
+				processed++;
+			}
+		}
+	};
+}
+
+void benchmarkScheduler(const BenchmarkContext &context)
+{
+	constexpr uint32 Tiles = 5000;
+	SchedulerRun run;
+	for (uint32 i = 0; i < Tiles; i++)
+	{
+		run.tiles.emplace_back();
+		SchedulerTile &t = run.tiles.back();
+		t.pos = context.all[i % context.all.size()];
+		t.prefetch = i % 3 == 0;
+		run.scheduler.push(&t, i % 5 == 0);
+	}
+	run.scheduler.updatePlayer(vec3(100, 20, -50));
+
+	{
+		Holder<ThreadPool> pool = newThreadPool("scheduler_", max(context.threads, 2u) + 1);
+		pool->function.bind<SchedulerRun, &SchedulerRun::work>(&run);
+		pool->run();
+		run.stopTime = run.timer->microsSinceStart();
+	}
+
+	uint32 duplicates = 0;
+	for (const SchedulerTile &t : run.tiles)
+		if (t.processed > 1)
+			duplicates++;
+	for (const SchedulerTile *t : run.returned)
+		if (t->processed)
+			duplicates++;
+
+	BenchmarkSection s("scheduler");
+	s.value("tiles", Tiles);
+	s.value("processed", run.processed.load());
+	s.value("returned", numeric_cast<uint32>(run.returned.size()));
+	s.value("exitMs", ms(run.stopTime));
+	s.check(!run.returned.empty(), "the stop did not return the queued tiles");
+	s.check(run.processed + run.returned.size() == Tiles && duplicates == 0, "some tiles were lost or handed out twice");
+	s.check(run.scheduler.pop() == nullptr && run.scheduler.size() == 0, "the scheduler hands out tiles after the stop");
+	benchmarkSubmit(std::move(s));
+}
@@ -0,0 +1,105 @@
+#include "benchmark.h"
+#include "../sources/terrain/atlas.h"
+
+#include <cage-core/random.h>
+
+namespace
+{
+	struct AtlasResult
+	{
+		TerrainAtlasStatistics peak; // at the highest number of pages
+		double averageUtilization = 0; // requested texels / page texels, over the churn
+		double averageFragmentation = 0;
+		uint32 samples = 0;
+		uint32 releasedPages = 0;
+		bool valid = true;
+	};
+
+	// no two live regions may overlap
+	bool atlasDisjoint(const std::vector<TerrainAtlasRegion> &regions, uint32 pages, uint32 pageSize, uint32 cell)
+	{
+		const uint32 cells = pageSize / cell;
+		std::vector<uint8> occupied(uint64(pages) * cells * cells, 0);
+		for (const TerrainAtlasRegion &r : regions)
+		{
+			if (r.page >= pages || r.x % r.size || r.y % r.size || r.x + r.size > pageSize || r.y + r.size > pageSize || r.width > r.size || r.height > r.size)
+				return false;
+			for (uint32 y = r.y / cell; y < (r.y + r.size) / cell; y++)
+			{
+				for (uint32 x = r.x / cell; x < (r.x + r.size) / cell; x++)
+				{
+					uint8 &o = occupied[(uint64(r.page) * cells + y) * cells + x];
+					if (o)
+						return false;
+					o = 1;
+				}
+			}
+		}
+		return true;
+	}
+
+	// allocator alone, tiles of random sizes are added and removed like when flying around
+	AtlasResult measureAtlas()
+	{
+		constexpr uint32 PageSize = 4096;
+		constexpr uint32 MinRegion = 64;
+		AtlasResult res;
+		TerrainAtlasAllocator atlas(PageSize, MinRegion);
+		RandomGenerator rng(7, 11);
+		std::vector<TerrainAtlasRegion> live;
+		for (uint32 step = 0; step < 20000; step++)
+		{
+			const uint32 target = step < 10000 ? 400 : 150; // shrinking working set
+			if (live.size() < target && rng.randomChance() < 0.6)
+			{
+				const uint32 resolution = numeric_cast<uint32>(32 << rng.randomRange(0, 6)); // 32 .. 1024
+				const uint32 w = numeric_cast<uint32>(resolution * (0.6 + 0.4 * rng.randomChance().value));
+				live.push_back(atlas.allocate(w, w));
+			}
+			else if (!live.empty())
+			{
+				const uint32 i = numeric_cast<uint32>(rng.randomRange(0u, numeric_cast<uint32>(live.size())));
+				atlas.deallocate(live[i]);
+				live[i] = live.back();
+				live.pop_back();
+			}
+			if (step % 500 == 0)
+			{
+				const TerrainAtlasStatistics st = atlas.statistics();
+				res.averageUtilization += st.pageTexels ? double(st.requestedTexels) / st.pageTexels : 0;
+				res.averageFragmentation += st.fragmentation().value;
+				res.samples++;
+				if (st.pages >= res.peak.pages)
+					res.peak = st;
+				res.valid = res.valid && atlasDisjoint(live, atlas.pagesCount(), PageSize, MinRegion);
+				for (const TerrainAtlasRegion &r : live)
+					res.valid = res.valid && atlas.pageLive(r.page);
+			}
+		}
+		if (res.samples)
+		{
+			res.averageUtilization /= res.samples;
+			res.averageFragmentation /= res.samples;
+		}
+		// all buddies must merge back into whole pages, a single empty page is kept
+		for (const TerrainAtlasRegion &r : live)
+			atlas.deallocate(r);
+		const TerrainAtlasStatistics end = atlas.statistics();
+		res.releasedPages = end.releasedPages;
+		res.valid = res.valid && end.pages == 1 && end.pageTexels == uint64(PageSize) * PageSize && end.regions == 0 && end.allocatedTexels == 0 && end.requestedTexels == 0 && end.largestFreeTexels == uint64(PageSize) * PageSize && end.fragmentation() == 0;
+		return res;
+	}
+}
+
+void benchmarkAtlas(const BenchmarkContext &)
+{
+	const AtlasResult atlas = measureAtlas();
+	BenchmarkSection s("atlas");
+	s.value("peakPages", atlas.peak.pages);
+	s.value("peakRegions", atlas.peak.regions);
+	s.value("averageUtilization", atlas.averageUtilization);
+	s.value("averageFragmentation", atlas.averageFragmentation);
+	s.value("releasedPages", atlas.releasedPages);
+	s.check(atlas.valid, "overlapping or unmerged regions");
+	benchmarkSubmit(std::move(s));
+}
@@ -0,0 +1,104 @@
+#include "benchmark.h"
+
+#include <cage-core/timer.h>
+#include <cage-core/mesh.h>
+#include <cage-core/image.h>
+#include <cage-core/collider.h>
+
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+
+namespace
+{
+	struct CompressionResult
+	{
+		uint64 encodeTime = 0; // microseconds, albedo and special together
+		uint64 rawBytes = 0; // uncompressed, including the mip chains
+		uint64 compressedBytes = 0;
+		uint64 pixels = 0; // level 0
+		double albedoSquaredError = 0;
+		double specialSquaredError = 0;
+		uint32 textures = 0;
+		bool valid = true;
+
+		double albedoRmse() const { return pixels ? std::sqrt(albedoSquaredError / (pixels * 3)) : 0; }
+		double specialRmse() const { return pixels ? std::sqrt(specialSquaredError / (pixels * 2)) : 0; }
+		double megapixelsPerSecond() const { return encodeTime ? pixels * 2.0 / encodeTime : 0; }
+	};
+
+	double squaredError(const Image *a, const Image *b)
+	{
+		PointerRange<const uint8> x = a->rawViewU8(), y = b->rawViewU8();
+		CAGE_ASSERT(x.size() == y.size());
+		double e = 0;
+		for (uint32 i = 0; i < x.size(); i++)
+		{
+			const double d = double(x[i]) - double(y[i]);
+			e += d * d;
+		}
+		return e;
+	}
+
+	uint64 expectedBytes(const TerrainCompressedTexture &t, uint32 blockBytes)
+	{
+		uint64 s = 0;
+		for (uint32 l = 0; l < t.levels.size(); l++)
+		{
+			const uint32 w = std::max(t.width >> l, 1u), h = std::max(t.height >> l, 1u);
+			s += ((w + 3) / 4) * ((h + 3) / 4) * blockBytes;
+		}
+		return s;
+	}
+
+	// the encoder alone, on textures of real tiles, validated by decoding level 0 back
+	CompressionResult measureCompression(const std::vector<TilePos> &positions, uint32 maxTiles)
+	{
+		CompressionResult r;
+		std::atomic<bool> cancelled {false};
+		for (const TilePos &p : positions)
+		{
+			if (r.textures >= maxTiles)
+				break;
+			Holder<Mesh> mesh;
+			Holder<Collider> collider;
+			Holder<Image> albedo, special;
+			terrainGenerate(p, cancelled, mesh, collider, albedo, special);
+			if (!mesh)
+				continue;
+			imageConvert(+albedo, ImageFormatEnum::Uint8);
+			imageConvert(+special, ImageFormatEnum::Uint8);
+			Holder<Timer> timer = newTimer();
+			const TerrainCompressedTexture a = terrainCompressTexture(+albedo);
+			const TerrainCompressedTexture b = terrainCompressTexture(+special);
+			r.encodeTime += timer->microsSinceStart();
+			const uint64 px = uint64(albedo->width()) * albedo->height();
+			r.pixels += px;
+			r.rawBytes += px * 5 * 4 / 3;
+			r.compressedBytes += a.bytes() + b.bytes();
+			r.albedoSquaredError += squaredError(+albedo, +terrainDecompressTexture(a, 0));
+			r.specialSquaredError += squaredError(+special, +terrainDecompressTexture(b, 0));
+			if (a.format != TerrainCompressionEnum::Bc1 || b.format != TerrainCompressionEnum::Bc5 || a.bytes() != expectedBytes(a, 8) || b.bytes() != expectedBytes(b, 16) || a.levels.size() != b.levels.size())
+				r.valid = false;
+			r.textures++;
+		}
+		return r;
+	}
+}
+
+void benchmarkCompression(const BenchmarkContext &context)
+{
+	const CompressionResult compression = measureCompression(context.all, 16);
+	BenchmarkSection s("compression");
+	s.value("tiles", compression.textures);
+	s.value("encodeMs", ms(compression.encodeTime));
+	s.value("megapixelsPerSecond", compression.megapixelsPerSecond());
+	s.value("rawBytes", compression.rawBytes);
+	s.value("compressedBytes", compression.compressedBytes);
+	s.value("albedoRmse", compression.albedoRmse());
+	s.value("specialRmse", compression.specialRmse());
+	s.check(compression.valid, "invalid formats or sizes");
+	// bc1 and bc5 of smooth procedural textures, the limits catch broken encoders, not small quality regressions
+	s.check(compression.albedoRmse() < 12 && compression.specialRmse() < 8, "the error is too large");
+	benchmarkSubmit(std::move(s));
+}
@@ -0,0 +1,96 @@
+#include "benchmark.h"
+#include "../sources/timingWheel.h"
+
+#include <cage-core/random.h>
+#include <cage-core/timer.h>
+
+namespace
+{
+	struct TimeoutsResult
+	{
+		uint64 scanTime = 0; // microseconds, decrementing the ttl of every item every tick, like before
+		uint64 wheelTime = 0;
+		uint64 expired = 0;
+		uint32 ticks = 0;
+		uint32 peakItems = 0;
+		uint32 mismatches = 0; // items expired at a different tick than by the scan
+		bool valid = true;
+	};
+
+	// transient items spawned every tick, mostly short lived effects, some long lived
+	TimeoutsResult measureTimeouts()
+	{
+		constexpr uint32 Ticks = 3000;
+		TimeoutsResult r;
+		r.ticks = Ticks;
+
+		struct Item
+		{
+			uint32 name = 0;
+			uint32 ttl = 0;
+		};
+		std::vector<Item> items;
+		std::vector<uint64> scanExpiry; // per name
+		std::vector<uint64> wheelExpiry;
+		TimingWheel wheel;
+		std::vector<uint32> expired;
+		RandomGenerator rng(47, 53);
+		uint32 names = 0;
+		for (uint32 tick = 1; tick <= Ticks; tick++)
+		{
+			for (uint32 i = 0; i < 40; i++)
+			{
+				const uint32 ttl = i % 8 == 0 ? numeric_cast<uint32>(rng.randomRange(300, 3000)) : numeric_cast<uint32>(rng.randomRange(0, 30));
+				items.push_back({ names, ttl });
+				wheel.insert(names, wheel.tick() + ttl + 1);
+				scanExpiry.push_back(0);
+				wheelExpiry.push_back(0);
+				names++;
+			}
+			r.peakItems = max(r.peakItems, numeric_cast<uint32>(items.size()));
+			{
+				Holder<Timer> timer = newTimer();
+				for (uint32 i = 0; i < items.size();)
+				{
+					if (items[i].ttl-- == 0)
+					{
+						scanExpiry[items[i].name] = tick;
+						items[i] = items.back();
+						items.pop_back();
+					}
+					else
+						i++;
+				}
+				r.scanTime += timer->microsSinceStart();
+			}
+			{
+				Holder<Timer> timer = newTimer();
+				expired.clear();
+				wheel.advance(expired);
+				r.wheelTime += timer->microsSinceStart();
+			}
+			for (uint32 n : expired)
+				wheelExpiry[n] = wheel.tick();
+			r.expired += expired.size();
+		}
+		for (uint32 n = 0; n < names; n++)
+			if (scanExpiry[n] != wheelExpiry[n])
+				r.mismatches++;
+		r.valid = r.mismatches == 0 && wheel.size() == items.size();
+		return r;
+	}
+}
+
+void benchmarkTimeouts(const BenchmarkContext &)
+{
+	const TimeoutsResult timeouts = measureTimeouts();
+	BenchmarkSection s("timeouts");
+	s.value("ticks", timeouts.ticks);
+	s.value("peakItems", timeouts.peakItems);
+	s.value("expired", timeouts.expired);
+	s.value("wheelMs", ms(timeouts.wheelTime));
+	s.value("scanMs", ms(timeouts.scanTime));
+	s.value("mismatches", timeouts.mismatches);
+	s.check(timeouts.valid, "the expiries differ");
+	benchmarkSubmit(std::move(s));
+}
@@ -0,0 +1,110 @@
+#include "benchmark.h"
+#include "../sources/terrain/upload.h"
+
+#include <cage-core/timer.h>
+
+#include <atomic>
+
+namespace
+{
+	// counts the live gpu objects instead of creating them
+	struct UploadTile
+	{
+		std::atomic<bool> cancelled {false};
+		uint32 pending = 3; // albedo, special, mesh
+		uint32 resources = 0;
+		uint32 finished = 0;
+		uint32 completed = 0;
+		bool leaked = false; // handed back with live gpu objects
+	};
+
+	struct UploadRun
+	{
+		uint32 live = 0;
+		uint32 released = 0;
+		uint32 steps = 0;
+
+		bool step(UploadTile *t)
+		{
+			CAGE_ASSERT(t->pending > 0);
+			t->pending--;
+			t->resources++;
+			live++;
+			steps++;
+			return t->pending == 0;
+		}
+
+		void finish(UploadTile *t)
+		{
+			t->finished++;
+		}
+
+		void release(UploadTile *t)
+		{
+			released += t->resources;
+			live -= t->resources;
+			t->resources = 0;
+		}
+
+		void complete(UploadTile *t)
+		{
+			t->completed++;
+			if (t->resources)
+				t->leaked = true;
+		}
+	};
+}
+
+// the control thread cancels tiles between frames, some of them with textures already uploaded
+void benchmarkUpload(const BenchmarkContext &)
+{
+	constexpr uint32 Tiles = 1000;
+	std::deque<UploadTile> tiles(Tiles);
+	std::deque<UploadTile *> queue;
+	for (UploadTile &t : tiles)
+		queue.push_back(&t);
+
+	UploadRun run;
+	Holder<Timer> timer = newTimer();
+	uint32 frames = 0;
+	uint32 cancelledPartial = 0;
+	while (!queue.empty())
+	{
+		timer->reset();
+		terrainUploadTiles(queue, run, 0, +timer); // no budget, a single step per frame, deterministic
+		frames++;
+		if (queue.empty())
+			break;
+		UploadTile *t = frames % 5 == 0 ? queue.front() : frames % 7 == 0 ? queue.back() : nullptr; // the front one is partially uploaded
+		if (t && !t->cancelled)
+		{
+			if (t->resources)
+				cancelledPartial++;
+			t->cancelled = true;
+		}
+	}
+
+	uint32 finished = 0, completed = 0, leaks = 0, twice = 0;
+	for (const UploadTile &t : tiles)
+	{
+		finished += t.finished;
+		completed += t.completed;
+		if (t.leaked)
+			leaks++;
+		if (t.finished + t.completed != 1)
+			twice++;
+	}
+
+	BenchmarkSection s("upload");
+	s.value("tiles", Tiles);
+	s.value("frames", frames);
+	s.value("steps", run.steps);
+	s.value("finished", finished);
+	s.value("cancelled", completed);
+	s.value("cancelledPartial", cancelledPartial);
+	s.value("released", run.released);
+	s.check(cancelledPartial > 0, "no tile was cancelled in the middle of its upload");
+	s.check(leaks == 0 && run.live == finished * 3, "cancelled tiles were handed back with live gpu objects");
+	s.check(twice == 0, "some tiles were handed back twice or never");
+	benchmarkSubmit(std::move(s));
+}
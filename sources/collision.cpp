@@ -1,43 +1,122 @@
 #include "common.h"
+#include "terrain/collisionTree.h"
 
 #include <cage-core/entities.h>
 #include <cage-core/hashString.h>
 #include <cage-core/geometry.h>
 #include <cage-core/collider.h>
-#include <cage-core/collisionStructure.h>
+#include <cage-core/concurrent.h>
+#include <cage-core/threadPool.h>
 
 #include <cage-engine/engine.h>
 
+#include <unordered_set>
+#include <atomic>
+
 using namespace cage;
 
 namespace
 {
-	Holder<CollisionStructure> collisionSearchData;
-	Holder<CollisionQuery> collisionSearchQuery;
-	bool collisionSearchNeedsRebuild;
+	// double buffered: the control thread updates and queries the front tree
+	// the back tree is rebuilt balanced on a persistent worker thread, then the changes made meanwhile are replayed on it and the trees are swapped
+	TerrainCollisionTree trees[2];
+	uint32 front = 0;
+	Holder<Thread> rebuildThread; // waits for the requests
+	Holder<Mutex> rebuildMutex = newMutex();
+	Holder<ConditionalVariableBase> rebuildSignal = newConditionalVariableBase();
+	bool rebuildRequested = false; // guarded by the mutex
+	bool rebuildStopping = false; // guarded by the mutex
+	std::atomic<bool> rebuildDone {false};
+	bool rebuilding = false; // control thread only
+	Holder<ThreadPool> raysPool; // large batches of segments
+	std::vector<TerrainCollisionItem> rebuildItems; // owned by the rebuild thread while it runs
+	std::unordered_set<uint32> changedDuringRebuild;
+	real builtCost; // per item, of the front tree right after it was built
+	bool changedSinceCheck = false;
+
+	const real RebuildDegradation = 1.3;
+	constexpr uint32 RebuildMinItems = 16;
+
+	void rebuildEntry()
+	{
+		while (true)
+		{
+			{
+				ScopeLock<Mutex> lock(rebuildMutex);
+				while (!rebuildRequested && !rebuildStopping)
+					rebuildSignal->wait(+rebuildMutex);
+				if (rebuildStopping)
+					return;
+				rebuildRequested = false;
+			}
+			{
+				OPTICK_EVENT("terrainCollidersRebuild");
+				trees[1 - front].build(std::move(rebuildItems));
+			}
+			rebuildDone = true;
+		}
+	}
+
+	void noteChange(uint32 name)
+	{
+		changedSinceCheck = true;
+		if (rebuilding)
+			changedDuringRebuild.insert(name);
+	}
+
+	void swapRebuiltTree()
+	{
+		CAGE_ASSERT(rebuilding && rebuildDone);
+		rebuilding = false;
+		rebuildDone = false;
+		TerrainCollisionTree &back = trees[1 - front];
+		for (uint32 name : changedDuringRebuild)
+		{
+			const TerrainCollisionItem *it = trees[front].find(name);
+			if (it)
+				back.insert(name, it->collider.share(), it->tr);
+			else
+				back.remove(name);
+		}
+		changedDuringRebuild.clear();
+		builtCost = back.count() ? back.cost() / back.count() : real(0);
+		trees[front].clear();
+		front = 1 - front;
+	}
 
 	void engineInitialize()
 	{
-		collisionSearchData = newCollisionStructure({});
-		collisionSearchQuery = newCollisionQuery(collisionSearchData.share());
+		raysPool = newThreadPool("terrain rays ", max(processorsCount() / 2, 2u));
+		rebuildThread = newThread(Delegate<void()>().bind<&rebuildEntry>(), "terrain colliders");
 	}
 
-	void engineUpdate()
+	void engineFinalize()
 	{
-		// nothing?
+		raysPool.clear();
+		{
+			ScopeLock<Mutex> lock(rebuildMutex);
+			rebuildStopping = true;
+			rebuildSignal->signal();
+		}
+		rebuildThread->wait(); // a running rebuild is finished first
+		rebuildThread.clear();
+		rebuilding = false;
+		rebuildDone = false;
+		trees[0].clear();
+		trees[1].clear();
 	}
 
 	class Callbacks
 	{
 		EventListener<void()> engineInitListener;
-		EventListener<void()> engineUpdateListener;
+		EventListener<void()> engineFinalizeListener;
 	public:
 		Callbacks()
 		{
 			engineInitListener.attach(controlThread().initialize);
 			engineInitListener.bind<&engineInitialize>();
-			engineUpdateListener.attach(controlThread().update);
-			engineUpdateListener.bind<&engineUpdate>();
+			engineFinalizeListener.attach(controlThread().finalize);
+			engineFinalizeListener.bind<&engineFinalize>();
 		}
 	} callbacksInstance;
 }
@@ -45,9 +124,8 @@ namespace
 void renderDebugRay(const Line &ln, const vec3 &color, uint32 duration)
 {
 	CAGE_ASSERT(ln.normalized());
-	Entity *e = engineEntities()->createAnonymous();
-	GAME_COMPONENT(Timeout, to, e);
-	to.ttl = duration;
+	Entity *e = entityRecycled();
+	entityTimeout(e, duration, true);
 	CAGE_COMPONENT_ENGINE(Render, r, e);
 	r.object = HashString("flittermouse/laser/laser.obj");
 	r.color = color;
@@ -60,17 +138,25 @@ void renderDebugRay(const Line &ln, const vec3 &color, uint32 duration)
 vec3 terrainIntersection(const Line &ln)
 {
 	CAGE_ASSERT(ln.isSegment());
-	if (!collisionSearchQuery->query(ln))
-		return vec3::Nan();
-	CAGE_ASSERT(collisionSearchQuery->collisionPairs().size() >= 1);
-	Holder<const Collider> c;
-	transform tr;
-	collisionSearchQuery->collider(c, tr);
-	Triangle t = c->triangles()[collisionSearchQuery->collisionPairs()[0].b];
-	t *= tr;
-	vec3 r = intersection(ln, t);
-	CAGE_ASSERT(r.valid());
-	//renderDebugRay(makeSegment(ln.origin, r));
+	const TerrainRayHit hit = trees[front].intersection(ln);
+	//if (hit)
+	//	renderDebugRay(makeSegment(ln.origin, hit.point));
+	return hit.point;
+}
+
+void terrainIntersections(PointerRange<const Line> segments, PointerRange<TerrainRayHit> hits)
+{
+	OPTICK_EVENT("terrainIntersections");
+	OPTICK_TAG("segments", segments.size());
+	trees[front].intersections(segments, hits, +raysPool);
+}
+
+TerrainSlideResult terrainSlideSphere(const vec3 &center, real radius, const vec3 &motion)
+{
+	OPTICK_EVENT("terrainSlideSphere");
+	const TerrainSlideResult r = trees[front].slide(center, radius, motion);
+	OPTICK_TAG("tiles", r.tiles);
+	OPTICK_TAG("triangles", r.triangles);
 	return r;
 }
 
@@ -79,21 +165,34 @@ void terrainAddCollider(uint32 name, Holder<Collider> c, const transform &tr)
 	CAGE_ASSERT(tr.valid());
 	CAGE_ASSERT(c);
 	CAGE_ASSERT(c->box().valid());
-	collisionSearchData->update(name, std::move(c), tr);
-	collisionSearchNeedsRebuild = true;
+	trees[front].insert(name, std::move(c), tr);
+	noteChange(name);
 }
 
 void terrainRemoveCollider(uint32 name)
 {
-	collisionSearchData->remove(name);
-	collisionSearchNeedsRebuild = true;
+	trees[front].remove(name);
+	noteChange(name);
 }
 
 void terrainRebuildColliders()
 {
-	if (!collisionSearchNeedsRebuild)
+	if (rebuilding)
+	{
+		if (rebuildDone)
+			swapRebuiltTree();
 		return;
-	collisionSearchNeedsRebuild = false;
+	}
+	if (!changedSinceCheck)
+		return;
+	changedSinceCheck = false;
 	OPTICK_EVENT("terrainRebuildColliders");
-	collisionSearchData->rebuild();
+	const TerrainCollisionTree &t = trees[front];
+	if (t.count() < RebuildMinItems || t.cost() / t.count() < builtCost * RebuildDegradation)
+		return;
+	rebuildItems = t.items();
+	rebuilding = true;
+	ScopeLock<Mutex> lock(rebuildMutex);
+	rebuildRequested = true;
+	rebuildSignal->signal();
 }
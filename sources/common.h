@@ -8,22 +8,53 @@
 using namespace cage;
 
 void renderDebugRay(const Line &ln, const vec3 &color = vec3(), uint32 duration = 1);
+void lightningDischarge(const vec3 &a, const vec3 &b, const vec3 &color); // the bolt is displayed for two updates
+
+struct TerrainRayHit
+{
+	vec3 point = vec3::Nan();
+	vec3 normal = vec3::Nan(); // facing against the segment
+	real distance = real::Infinity(); // along the segment
+	uint32 name = m; // of the tile collider
+
+	explicit operator bool () const { return name != m; }
+};
+
+struct TerrainSlideResult
+{
+	vec3 position; // where the sphere ended
+	vec3 normal = vec3::Nan(); // of the last contact
+	uint32 contacts = 0;
+	uint32 tiles = 0; // tested, for statistics
+	uint32 triangles = 0; // candidates from the grids of the tiles
+};
 
 vec3 terrainIntersection(const Line &ln);
+void terrainIntersections(PointerRange<const Line> segments, PointerRange<TerrainRayHit> hits); // closest hits of many segments at once
+TerrainSlideResult terrainSlideSphere(const vec3 &center, real radius, const vec3 &motion); // moves the sphere, sliding along the terrain instead of passing through it
 void terrainAddCollider(uint32 name, Holder<Collider> c, const transform &tr);
 void terrainRemoveCollider(uint32 name);
-void terrainRebuildColliders();
+void terrainRebuildColliders(); // called every tick, rebalances the collision structure in the background when it degrades
 
 struct TimeoutComponent
 {
 	static EntityComponent *component;
-	uint32 ttl = 10;
+	uint64 expiry = 0; // update tick, set by entityTimeout
+	bool recycle = false;
 };
 
+// destroys the entity after the given number of updates, or returns it to the pool of recycled entities
+// the entity must have a name, the timeouts are tracked by names in a timing wheel
+void entityTimeout(Entity *e, uint32 ttl, bool recycle = false);
+Entity *entityRecycled(); // a named entity from the pool, without any components, or a new one
+
 #define GAME_COMPONENT(T, C, E) T##Component &C = E->value<T##Component>(T##Component::component);
 
 extern EntityGroup *entitiesToDestroy;
 extern vec3 playerPosition;
+extern vec3 playerSpeed; // per control tick
 extern real terrainGenerationProgress;
+extern uint64 terrainMemoryUsage; // bytes, cpu and gpu
+extern uint64 terrainMemoryBudget; // bytes, 0 = unlimited
 
 #endif
@@ -8,6 +8,7 @@
 #include <cage-engine/engine.h>
 
 #include <cstring> // std::strlen
+#include <vector>
 
 namespace
 {
@@ -200,95 +201,280 @@ namespace
 		}
 	}
 
-	void aimAtClosestWallTarget(const vec3 &origin, const vec3 &initialDirection, vec3 &target, const rads maxDeviation, const uint32 maxAttempts, const real maxReach)
+	struct AimRequest
 	{
-		const real maxDeviDot = cos(maxDeviation);
+		vec3 origin;
+		vec3 direction; // initial
+		vec3 target;
+		real maxDeviDot;
+		real maxReach;
+		uint32 maxAttempts = 0;
+	};
+
+	AimRequest aimRequest(const transform &t, const vec3 &target, const rads maxDeviation, const uint32 maxAttempts, const real maxReach)
+	{
+		AimRequest r;
+		r.origin = t.position;
+		r.direction = t.orientation * vec3(0, 0, -1);
+		r.target = target;
+		r.maxDeviDot = cos(maxDeviation);
+		r.maxReach = maxReach;
+		r.maxAttempts = maxAttempts;
+		return r;
+	}
+
+	std::vector<AimRequest> aimRequests;
+	std::vector<Line> aimSegments;
+	std::vector<TerrainRayHit> aimHits;
+	std::vector<uint32> aimOwners; // request of each segment
 
-		const auto &check = [&](const vec3 &p) -> bool
+	// all doodads are aimed together, the segments are cast in batches, the first one and then one per attempt
+	void aimAtClosestWallTargets(std::vector<AimRequest> &requests)
+	{
+		const auto &check = [](const AimRequest &r, const vec3 &p) -> bool
 		{
-			real c = dot(normalize(p - origin), initialDirection);
-			return c > maxDeviDot;
+			real c = dot(normalize(p - r.origin), r.direction);
+			return c > r.maxDeviDot;
 		};
 
-		const auto &reposition = [&](const vec3 &p) -> vec3
+		const auto &add = [](const AimRequest &r, const vec3 &p, uint32 owner)
 		{
-			vec3 t = origin + normalize(p - origin) * maxReach;
-			vec3 q = terrainIntersection(makeSegment(origin, t));
-			return q.valid() ? q : t;
+			aimSegments.push_back(makeSegment(r.origin, r.origin + normalize(p - r.origin) * r.maxReach));
+			aimOwners.push_back(owner);
 		};
 
-		CAGE_ASSERT(check(target));
-		target = reposition(target);
+		// moves the targets to the closer walls
+		const auto &cast = [&]()
+		{
+			aimHits.resize(aimSegments.size());
+			terrainIntersections(aimSegments, aimHits);
+			for (uint32 i = 0; i < aimSegments.size(); i++)
+			{
+				AimRequest &r = requests[aimOwners[i]];
+				const Line &ln = aimSegments[i];
+				const vec3 p = aimHits[i] ? aimHits[i].point : ln.origin + ln.direction * ln.maximum;
+				if (distanceSquared(r.origin, p) < distanceSquared(r.origin, r.target))
+					r.target = p;
+			}
+			aimSegments.clear();
+			aimOwners.clear();
+		};
 
+		// the previous target and the initial direction
+		for (uint32 i = 0; i < requests.size(); i++)
 		{
-			vec3 p = origin + initialDirection;
-			p = reposition(p);
-			if (distanceSquared(origin, p) < distanceSquared(origin, target))
-				target = p;
+			AimRequest &r = requests[i];
+			CAGE_ASSERT(check(r, r.target));
+			add(r, r.target, i);
+			add(r, r.origin + r.direction, i);
+			r.target = r.origin + normalize(r.target - r.origin) * r.maxReach;
 		}
+		cast();
 
-		for (uint32 attempt = 0; attempt < maxAttempts; attempt++)
+		// random attempts, each around the target refined by the previous one, one attempt of every request per batch
+		uint32 rounds = 0;
+		for (const AimRequest &r : requests)
+			rounds = max(rounds, r.maxAttempts);
+		for (uint32 attempt = 0; attempt < rounds; attempt++)
 		{
-			vec3 p = target + randomDirection3() * 0.1;
-			if (!check(p))
-				continue;
-			p = reposition(p);
-			if (distanceSquared(origin, p) < distanceSquared(origin, target))
-				target = p;
+			for (uint32 i = 0; i < requests.size(); i++)
+			{
+				const AimRequest &r = requests[i];
+				if (attempt >= r.maxAttempts)
+					continue;
+				vec3 p = r.target + randomDirection3() * 0.1;
+				if (check(r, p))
+					add(r, p, i);
+			}
+			if (!aimSegments.empty())
+				cast();
 		}
-		CAGE_ASSERT(target.valid() && check(target) && distance(origin, target) < maxReach + 1e-5);
+
+		for (const AimRequest &r : requests)
+			CAGE_ASSERT(r.target.valid() && check(r, r.target) && distance(r.origin, r.target) < r.maxReach + 1e-5);
 	}
 
-	void magnetDischargeImpl(const vec3 &a, const vec3 &b, const vec3 &cam, const vec3 &color, real lightProb)
+	struct MagnetPrevious
 	{
-		real d = distance(a, b);
-		vec3 v = normalize(b - a);
-		vec3 c = (a + b) * 0.5;
-		vec3 up = normalize(cam - c);
-#ifdef CAGE_DEBUG
-		constexpr real threshold = 0.15;
-#else
-		constexpr real threshold = 0.03;
-#endif // CAGE_DEBUG
-		if (d > threshold)
-		{
-			vec3 side = normalize(cross(v, up));
-			c += side * (d * randomRange(-0.2, 0.2));
-			magnetDischargeImpl(a, c, cam, color, lightProb * 0.5);
-			magnetDischargeImpl(c, b, cam, color, lightProb * 0.5);
-			return;
-		}
-		Entity *e = engineEntities()->createUnique();
-		CAGE_COMPONENT_ENGINE(Transform, t, e);
-		t.position = c;
-		t.orientation = quat(v, up, true);
-		t.scale = d;
-		CAGE_COMPONENT_ENGINE(Render, r, e);
-		r.object = HashString("flittermouse/lightning/lightning.obj");
-		r.color = color;
-		CAGE_COMPONENT_ENGINE(TextureAnimation, anim, e);
-		anim.offset = randomChance() * 100;
-		GAME_COMPONENT(Timeout, ttl, e);
-		ttl.ttl = 1;
-		if (randomChance() < lightProb)
-		{
-			CAGE_COMPONENT_ENGINE(Light, light, e);
-			light.color = color;
-			light.intensity = 1.5;
-			light.lightType = LightTypeEnum::Point;
-			light.attenuation = vec3(0.5, 0, 0.4);
-		}
-	}
+		transform tr;
+		vec3 target;
+	};
 
 	void magnetDischarge(const transform &tp, const transform &tc, const vec3 &pp, const vec3 &pc)
 	{
 		if (randomChance() > 0.3 / (1 + sqr(distanceSquared(pc, tc.position))))
 			return;
 		vec3 color = randomChance3() * 0.4 + vec3(0, 0, 0.4);
-		CAGE_COMPONENT_ENGINE(Transform, cam, engineEntities()->get(1));
 		vec3 start = tc.position + tc.orientation * vec3(0, 0, -0.005);
 		vec3 end = pc + (randomChance3() - 0.5) * 0.01;
-		magnetDischargeImpl(start, end, cam.position, color, 2);
+		lightningDischarge(start, end, color);
+	}
+
+	// structure of arrays snapshot of transforms, the loops over it are simple enough for the compiler to vectorize
+	struct Transforms
+	{
+		std::vector<float> px, py, pz; // position
+		std::vector<float> qx, qy, qz, qw; // orientation
+		std::vector<float> s; // scale
+
+		uint32 size() const { return numeric_cast<uint32>(s.size()); }
+
+		void resize(uint32 n)
+		{
+			for (std::vector<float> *v : { &px, &py, &pz, &qx, &qy, &qz, &qw, &s })
+				v->resize(n);
+		}
+
+		void clear()
+		{
+			resize(0);
+		}
+
+		void push(const transform &t)
+		{
+			px.push_back(t.position[0].value);
+			py.push_back(t.position[1].value);
+			pz.push_back(t.position[2].value);
+			qx.push_back(t.orientation[0].value);
+			qy.push_back(t.orientation[1].value);
+			qz.push_back(t.orientation[2].value);
+			qw.push_back(t.orientation[3].value);
+			s.push_back(t.scale.value);
+		}
+
+		transform get(uint32 i) const
+		{
+			transform t;
+			t.position = vec3(px[i], py[i], pz[i]);
+			t.orientation = quat(qx[i], qy[i], qz[i], qw[i]);
+			t.scale = s[i];
+			return t;
+		}
+	};
+
+	struct Points
+	{
+		std::vector<float> x, y, z;
+
+		void clear()
+		{
+			x.clear();
+			y.clear();
+			z.clear();
+		}
+
+		void push(const vec3 &p)
+		{
+			x.push_back(p[0].value);
+			y.push_back(p[1].value);
+			z.push_back(p[2].value);
+		}
+
+		vec3 get(uint32 i) const
+		{
+			return vec3(x[i], y[i], z[i]);
+		}
+	};
+
+	// world = parent * local, for all of them
+	void combine(const transform &parent, const Transforms &local, Transforms &world)
+	{
+		const uint32 n = local.size();
+		world.resize(n);
+		const float ax = parent.position[0].value, ay = parent.position[1].value, az = parent.position[2].value;
+		const float x = parent.orientation[0].value, y = parent.orientation[1].value, z = parent.orientation[2].value, w = parent.orientation[3].value;
+		const float ps = parent.scale.value;
+		const float *lx = local.px.data(), *ly = local.py.data(), *lz = local.pz.data();
+		const float *lqx = local.qx.data(), *lqy = local.qy.data(), *lqz = local.qz.data(), *lqw = local.qw.data();
+		const float *ls = local.s.data();
+		float *wx = world.px.data(), *wy = world.py.data(), *wz = world.pz.data();
+		float *wqx = world.qx.data(), *wqy = world.qy.data(), *wqz = world.qz.data(), *wqw = world.qw.data();
+		float *ws = world.s.data();
+		for (uint32 i = 0; i < n; i++)
+		{
+			// position = parent.position + parent.orientation * (local.position * parent.scale)
+			const float vx = lx[i] * ps, vy = ly[i] * ps, vz = lz[i] * ps;
+			const float tx = 2 * (y * vz - z * vy), ty = 2 * (z * vx - x * vz), tz = 2 * (x * vy - y * vx);
+			wx[i] = ax + vx + w * tx + (y * tz - z * ty);
+			wy[i] = ay + vy + w * ty + (z * tx - x * tz);
+			wz[i] = az + vz + w * tz + (x * ty - y * tx);
+			// orientation = parent.orientation * local.orientation
+			const float bx = lqx[i], by = lqy[i], bz = lqz[i], bw = lqw[i];
+			wqx[i] = w * bx + x * bw + y * bz - z * by;
+			wqy[i] = w * by - x * bz + y * bw + z * bx;
+			wqz[i] = w * bz + x * by - y * bx + z * bw;
+			wqw[i] = w * bw - x * bx - y * by - z * bz;
+			ws[i] = ps * ls[i];
+		}
+	}
+
+	// points = t * points
+	void transformPoints(const transform &t, Points &points)
+	{
+		const uint32 n = numeric_cast<uint32>(points.x.size());
+		const float ax = t.position[0].value, ay = t.position[1].value, az = t.position[2].value;
+		const float x = t.orientation[0].value, y = t.orientation[1].value, z = t.orientation[2].value, w = t.orientation[3].value;
+		const float ts = t.scale.value;
+		float *px = points.x.data(), *py = points.y.data(), *pz = points.z.data();
+		for (uint32 i = 0; i < n; i++)
+		{
+			const float vx = px[i] * ts, vy = py[i] * ts, vz = pz[i] * ts;
+			const float tx = 2 * (y * vz - z * vy), ty = 2 * (z * vx - x * vz), tz = 2 * (x * vy - y * vx);
+			px[i] = ax + vx + w * tx + (y * tz - z * ty);
+			py[i] = ay + vy + w * ty + (z * tx - x * tz);
+			pz[i] = az + vz + w * tz + (x * ty - y * tx);
+		}
+	}
+
+	// snapshot of all doodads taken at the beginning of the update, written back to the entities at the end
+	struct Frame
+	{
+		std::vector<Entity *> aimed; // magnets first, then lights
+		std::vector<Entity *> muzzles;
+		std::vector<MagnetPrevious> magnetsPrevious;
+		Transforms aimedModels, aimedWorld;
+		Transforms muzzlesModels, muzzlesWorld;
+		Points targets; // of the aimed doodads
+		uint32 magnets = 0;
+
+		void clear()
+		{
+			aimed.clear();
+			muzzles.clear();
+			magnetsPrevious.clear();
+			aimedModels.clear();
+			muzzlesModels.clear();
+			targets.clear();
+			magnets = 0;
+		}
+	} frame;
+
+	void gatherDoodads()
+	{
+		frame.clear();
+		for (Entity *e : MagnetComponent::component->entities())
+		{
+			GAME_COMPONENT(Magnet, m, e);
+			CAGE_COMPONENT_ENGINE(Transform, t, e);
+			frame.magnetsPrevious.push_back({ t, m.target });
+			frame.aimed.push_back(e);
+			frame.aimedModels.push(m.model);
+			frame.targets.push(m.target);
+		}
+		frame.magnets = numeric_cast<uint32>(frame.aimed.size());
+		for (Entity *e : LightComponent::component->entities())
+		{
+			GAME_COMPONENT(Light, l, e);
+			frame.aimed.push_back(e);
+			frame.aimedModels.push(l.model);
+			frame.targets.push(l.target);
+		}
+		for (Entity *e : GunMuzzleComponent::component->entities())
+		{
+			GAME_COMPONENT(GunMuzzle, gm, e);
+			frame.muzzles.push_back(e);
+			frame.muzzlesModels.push(gm.model);
+		}
 	}
 
 	void engineUpdate()
@@ -303,40 +489,60 @@ namespace
 		CAGE_COMPONENT_ENGINE(Transform, cameraTransform, engineEntities()->get(1));
 		CAGE_COMPONENT_ENGINE(Camera, cameraProperties, engineEntities()->get(1));
 
-		for (Entity *e : MagnetComponent::component->entities())
+		gatherDoodads();
+
 		{
-			GAME_COMPONENT(Magnet, m, e);
-			const vec3 prevTarget = m.target;
-			CAGE_COMPONENT_ENGINE(Transform, t, e);
-			const transform prevTrans = t;
-			t = p * m.model;
-			m.target = p * inverse(pp) * m.target;
-			aimAtClosestWallTarget(t.position, t.orientation * vec3(0, 0, -1), m.target, degs(40), 1, 3);
-			t.orientation = quat(normalize(m.target - t.position), t.orientation * vec3(0, 1, 0));
-			magnetDischarge(prevTrans, t, prevTarget, m.target);
+			OPTICK_EVENT("transforms");
+			combine(p, frame.aimedModels, frame.aimedWorld);
+			combine(p, frame.muzzlesModels, frame.muzzlesWorld);
+			transformPoints(p * inverse(pp), frame.targets);
 		}
 
-		for (Entity *e : LightComponent::component->entities())
 		{
-			GAME_COMPONENT(Light, l, e);
+			OPTICK_EVENT("aiming");
+			aimRequests.clear();
+			for (uint32 i = 0; i < frame.aimed.size(); i++)
+			{
+				if (i < frame.magnets)
+					aimRequests.push_back(aimRequest(frame.aimedWorld.get(i), frame.targets.get(i), degs(40), 1, 3));
+				else
+					aimRequests.push_back(aimRequest(frame.aimedWorld.get(i), frame.targets.get(i), degs(15), 5, 12));
+			}
+			aimAtClosestWallTargets(aimRequests);
+		}
+
+		// write back
+		for (uint32 i = 0; i < frame.aimed.size(); i++)
+		{
+			Entity *e = frame.aimed[i];
+			const vec3 target = aimRequests[i].target;
 			CAGE_COMPONENT_ENGINE(Transform, t, e);
-			t = p * l.model;
-			l.target = p * inverse(pp) * l.target;
-			aimAtClosestWallTarget(t.position, t.orientation * vec3(0, 0, -1), l.target, degs(15), 5, 12);
-			t.orientation = quat(normalize(l.target - t.position), t.orientation * vec3(0, 1, 0));
-			CAGE_COMPONENT_ENGINE(Light, ll, e);
-			ll.intensity = interpolate(ll.intensity, sqr(distance(l.target, t.position) + 1), 0.02);
-			const real focus = distance(cameraTransform.position, l.target);
-			cameraProperties.depthOfField.focusDistance = interpolate(cameraProperties.depthOfField.focusDistance, focus, 0.05);
+			t = frame.aimedWorld.get(i);
+			t.orientation = quat(normalize(target - t.position), t.orientation * vec3(0, 1, 0));
+			if (i < frame.magnets)
+			{
+				GAME_COMPONENT(Magnet, m, e);
+				m.target = target;
+				const MagnetPrevious &prev = frame.magnetsPrevious[i];
+				magnetDischarge(prev.tr, t, prev.target, m.target);
+			}
+			else
+			{
+				GAME_COMPONENT(Light, l, e);
+				l.target = target;
+				CAGE_COMPONENT_ENGINE(Light, ll, e);
+				ll.intensity = interpolate(ll.intensity, sqr(distance(l.target, t.position) + 1), 0.02);
+				const real focus = distance(cameraTransform.position, l.target);
+				cameraProperties.depthOfField.focusDistance = interpolate(cameraProperties.depthOfField.focusDistance, focus, 0.05);
+			}
 		}
 		cameraProperties.depthOfField.focusRadius = 1;
 		cameraProperties.depthOfField.blendRadius = cameraProperties.depthOfField.focusDistance * 1.2;
 
-		for (Entity *e : GunMuzzleComponent::component->entities())
+		for (uint32 i = 0; i < frame.muzzles.size(); i++)
 		{
-			GAME_COMPONENT(GunMuzzle, gm, e);
-			CAGE_COMPONENT_ENGINE(Transform, t, e);
-			t = p * gm.model;
+			CAGE_COMPONENT_ENGINE(Transform, t, frame.muzzles[i]);
+			t = frame.muzzlesWorld.get(i);
 		}
 
 		for (Entity *e : GunTowerComponent::component->entities())
@@ -10,6 +10,7 @@ namespace
 {
 	uint32 playerPositionLabel;
 	uint32 terrainGenerationProgressLabel;
+	uint32 terrainMemoryLabel;
 
 	void engineUpdate()
 	{
@@ -24,6 +25,14 @@ namespace
 			CAGE_COMPONENT_GUI(Text, t, ents->get(terrainGenerationProgressLabel));
 			t.value = stringizer() + terrainGenerationProgress * 100 + " %";
 		}
+
+		{ // terrain memory
+			CAGE_COMPONENT_GUI(Text, t, ents->get(terrainMemoryLabel));
+			if (terrainMemoryBudget)
+				t.value = stringizer() + (terrainMemoryUsage / 1024 / 1024) + " / " + (terrainMemoryBudget / 1024 / 1024) + " MB";
+			else
+				t.value = stringizer() + (terrainMemoryUsage / 1024 / 1024) + " MB";
+		}
 	}
 
 	void engineInitialize()
@@ -82,6 +91,27 @@ namespace
 				terrainGenerationProgressLabel = e->name();
 			}
 		}
+
+		{ // terrain memory
+			{ // label
+				Entity *e = ents->createUnique();
+				CAGE_COMPONENT_GUI(Parent, p, e);
+				p.parent = panel->name();
+				p.order = 5;
+				CAGE_COMPONENT_GUI(Label, l, e);
+				CAGE_COMPONENT_GUI(Text, t, e);
+				t.value = "Terrain memory: ";
+			}
+			{ // value
+				Entity *e = ents->createUnique();
+				CAGE_COMPONENT_GUI(Parent, p, e);
+				p.parent = panel->name();
+				p.order = 6;
+				CAGE_COMPONENT_GUI(Label, l, e);
+				CAGE_COMPONENT_GUI(Text, t, e);
+				terrainMemoryLabel = e->name();
+			}
+		}
 	}
 
 	class Callbacks
@@ -0,0 +1,91 @@
+#include "lightning.h"
+
+#include <cage-core/entities.h>
+
+namespace
+{
+#ifdef CAGE_DEBUG
+	const real SegmentLength = 0.15;
+#else
+	const real SegmentLength = 0.03;
+#endif // CAGE_DEBUG
+
+	constexpr uint32 TrimFrames = 150; // the surplus entities are destroyed after being unused this long
+}
+
+void LightningBuffer::clear()
+{
+	segments.clear();
+}
+
+void LightningBuffer::subdivide(const vec3 &a, const vec3 &b, const vec3 &camera, real lightProbability)
+{
+	const real d = distance(a, b);
+	if (d > SegmentLength)
+	{
+		const vec3 v = (b - a) / d;
+		vec3 c = (a + b) * 0.5;
+		const vec3 side = normalize(cross(v, normalize(camera - c)));
+		c += side * (d * randomRange(-0.2, 0.2));
+		subdivide(a, c, camera, lightProbability * 0.5);
+		subdivide(c, b, camera, lightProbability * 0.5);
+		return;
+	}
+	points.push_back({ b, lightProbability });
+}
+
+void LightningBuffer::discharge(const vec3 &a, const vec3 &b, const vec3 &camera, const vec3 &color)
+{
+	points.clear();
+	points.push_back({ a, 0 });
+	subdivide(a, b, camera, 2);
+	const uint32 count = numeric_cast<uint32>(points.size());
+	for (uint32 i = 1; i < count; i++)
+	{
+		const vec3 &p = points[i - 1].position;
+		const vec3 &q = points[i].position;
+		LightningSegment s;
+		s.center = (p + q) * 0.5;
+		s.length = distance(p, q);
+		s.orientation = quat(normalize(q - p), normalize(camera - s.center), true);
+		s.color = color;
+		s.animation = randomChance() * 100;
+		s.light = randomChance() < points[i].lightProbability;
+		segments.push_back(s);
+	}
+}
+
+Entity *LightningSlots::acquire(EntityManager *manager)
+{
+	if (usedCount == entities.size())
+	{
+		entities.push_back(manager->createUnique());
+		createdCount++;
+	}
+	return entities[usedCount++];
+}
+
+PointerRange<Entity *const> LightningSlots::unused()
+{
+	if (usedCount >= shownCount)
+		return {};
+	return { entities.data() + usedCount, entities.data() + shownCount };
+}
+
+void LightningSlots::finish()
+{
+	// the entities past the used ones are hidden by now
+	if (entities.size() > max(usedCount * 2, 16u))
+		surplusFrames++;
+	else
+		surplusFrames = 0;
+	if (surplusFrames > TrimFrames)
+	{
+		for (uint32 i = usedCount; i < entities.size(); i++)
+			entities[i]->destroy();
+		entities.resize(usedCount);
+		surplusFrames = 0;
+	}
+	shownCount = usedCount;
+	usedCount = 0;
+}
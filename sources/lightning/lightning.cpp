@@ -0,0 +1,71 @@
+#include "lightning.h"
+
+#include <cage-core/entities.h>
+#include <cage-core/hashString.h>
+#include <cage-core/config.h>
+
+#include <cage-engine/engine.h>
+
+namespace
+{
+	ConfigUint32 confLights("flittermouse/lightning/lights", 12); // point lights shared by all bolts
+
+	// the bolts are displayed for two updates
+	LightningBuffer current;
+	LightningBuffer previous;
+	LightningSlots segmentSlots;
+	LightningSlots lightSlots;
+
+	struct EngineWriter
+	{
+		void segment(Entity *e, const LightningSegment &s, const transform &tr)
+		{
+			CAGE_COMPONENT_ENGINE(Transform, t, e);
+			t = tr;
+			e->value<TransformComponent>(TransformComponent::componentHistory) = tr; // no interpolation from the previous segment of the entity
+			CAGE_COMPONENT_ENGINE(Render, r, e);
+			r.object = HashString("flittermouse/lightning/lightning.obj");
+			r.color = s.color;
+			CAGE_COMPONENT_ENGINE(TextureAnimation, anim, e);
+			anim.offset = s.animation;
+		}
+
+		void light(Entity *e, const LightningSegment &s, const transform &tr)
+		{
+			CAGE_COMPONENT_ENGINE(Transform, t, e);
+			t = tr;
+			e->value<TransformComponent>(TransformComponent::componentHistory) = tr;
+			CAGE_COMPONENT_ENGINE(Light, light, e);
+			light.color = s.color;
+			light.intensity = 1.5;
+			light.lightType = LightTypeEnum::Point;
+			light.attenuation = vec3(0.5, 0, 0.4);
+		}
+	};
+
+	void engineUpdate()
+	{
+		OPTICK_EVENT("lightning");
+		EngineWriter writer;
+		lightningFillSlots(engineEntities(), RenderComponent::component, LightComponent::component, previous, current, segmentSlots, lightSlots, confLights, writer);
+		std::swap(previous, current);
+		current.clear();
+	}
+
+	class Callbacks
+	{
+		EventListener<void()> engineUpdateListener;
+	public:
+		Callbacks()
+		{
+			engineUpdateListener.attach(controlThread().update);
+			engineUpdateListener.bind<&engineUpdate>();
+		}
+	} callbacksInstance;
+}
+
+void lightningDischarge(const vec3 &a, const vec3 &b, const vec3 &color)
+{
+	CAGE_COMPONENT_ENGINE(Transform, camera, engineEntities()->get(1));
+	current.discharge(a, b, camera.position, color);
+}
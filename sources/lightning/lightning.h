@@ -0,0 +1,93 @@
+#ifndef lightning_h_f8d7s6a5
+#define lightning_h_f8d7s6a5
+
+#include "../common.h"
+
+#include <cage-core/entities.h>
+
+#include <vector>
+
+// lightning bolts generated into buffers reused between frames, no engine involved
+// each bolt is a polyline, its segments are drawn as camera facing quads
+
+struct LightningSegment
+{
+	quat orientation; // forward along the segment, up facing the camera
+	vec3 center;
+	vec3 color;
+	real length;
+	real animation; // texture animation offset
+	bool light = false;
+};
+
+struct LightningBuffer
+{
+	std::vector<LightningSegment> segments;
+
+	void clear();
+	// splits the bolt down to short segments, each randomly displaced sideways
+	void discharge(const vec3 &a, const vec3 &b, const vec3 &camera, const vec3 &color);
+
+private:
+	struct Point
+	{
+		vec3 position;
+		real lightProbability; // of the segment ending at the point
+	};
+
+	std::vector<Point> points; // polyline of the current bolt
+
+	void subdivide(const vec3 &a, const vec3 &b, const vec3 &camera, real lightProbability);
+};
+
+// entities reused across the frames instead of creating and destroying them for each segment
+// the engine draws entities sharing an object as one instanced batch
+class LightningSlots
+{
+public:
+	Entity *acquire(EntityManager *manager); // next entity for this frame, a new one is created only when all are in use
+	PointerRange<Entity *const> unused(); // used in the previous frame but not in this one, the caller hides them
+	void finish(); // ends the frame, destroys the entities that were not needed for a while
+
+	uint32 used() const { return usedCount; }
+	uint32 size() const { return numeric_cast<uint32>(entities.size()); }
+	uint64 created() const { return createdCount; } // cumulative
+
+private:
+	std::vector<Entity *> entities;
+	uint64 createdCount = 0;
+	uint32 usedCount = 0;
+	uint32 shownCount = 0; // in the previous frame
+	uint32 surplusFrames = 0;
+};
+
+// moves the segments of the previous and the current bolts into the slots, at most lightsLimit of them also get a light
+// the writer fills the components of the entities:
+//   void segment(Entity *, const LightningSegment &, const transform &)
+//   void light(Entity *, const LightningSegment &, const transform &)
+// the entities no longer needed are hidden by removing the segment or the light component
+template<class Writer>
+void lightningFillSlots(EntityManager *manager, EntityComponent *segmentComponent, EntityComponent *lightComponent, const LightningBuffer &previous, const LightningBuffer &current, LightningSlots &segmentSlots, LightningSlots &lightSlots, uint32 lightsLimit, Writer &writer)
+{
+	for (const LightningBuffer *b : { &previous, &current })
+	{
+		for (const LightningSegment &s : b->segments)
+		{
+			transform tr;
+			tr.position = s.center;
+			tr.orientation = s.orientation;
+			tr.scale = s.length;
+			writer.segment(segmentSlots.acquire(manager), s, tr);
+			if (s.light && lightSlots.used() < lightsLimit)
+				writer.light(lightSlots.acquire(manager), s, tr);
+		}
+	}
+	for (Entity *e : segmentSlots.unused())
+		e->remove(segmentComponent);
+	for (Entity *e : lightSlots.unused())
+		e->remove(lightComponent);
+	segmentSlots.finish();
+	lightSlots.finish();
+}
+
+#endif
@@ -13,6 +13,7 @@
 #include <cage-engine/window.h>
 
 vec3 playerPosition;
+vec3 playerSpeed;
 real terrainGenerationProgress;
 
 namespace
@@ -21,7 +22,8 @@ namespace
 	vec3 mouseMoved; // x, y, wheel
 
 	VariableSmoothingBuffer<quat, 3> cameraSmoothing;
-	vec3 playerSpeed;
+
+	constexpr float ShipRadius = 0.08;
 
 	void engineUpdate()
 	{
@@ -48,7 +50,10 @@ namespace
 				a = normalize(a);
 			a = pt.orientation * a;
 			playerSpeed = playerSpeed * 0.93 + a * 0.006;
-			pt.position += playerSpeed;
+			const TerrainSlideResult s = terrainSlideSphere(pt.position, ShipRadius, playerSpeed);
+			pt.position = s.position;
+			if (s.contacts)
+				playerSpeed -= s.normal * min(dot(playerSpeed, s.normal), real(0)); // the speed into the wall is lost
 		}
 
 		{ // update camera position
@@ -0,0 +1,176 @@
+#include "atlas.h"
+
+namespace
+{
+	constexpr uint32 CoordinateBits = 20;
+
+	uint64 makeKey(uint32 page, uint32 x, uint32 y)
+	{
+		return (uint64(page) << (2 * CoordinateBits)) | (uint64(y) << CoordinateBits) | x;
+	}
+
+	void splitKey(uint64 key, uint32 &page, uint32 &x, uint32 &y)
+	{
+		constexpr uint64 mask = (uint64(1) << CoordinateBits) - 1;
+		page = uint32(key >> (2 * CoordinateBits));
+		y = uint32((key >> CoordinateBits) & mask);
+		x = uint32(key & mask);
+	}
+
+	bool isPowerOfTwo(uint32 v)
+	{
+		return v && (v & (v - 1)) == 0;
+	}
+}
+
+real TerrainAtlasStatistics::fragmentation() const
+{
+	const uint64 freeTexels = pageTexels - allocatedTexels;
+	if (freeTexels == 0)
+		return 0;
+	return 1 - real(double(usableFreeTexels) / double(freeTexels));
+}
+
+TerrainAtlasAllocator::TerrainAtlasAllocator(uint32 pageSize, uint32 minRegion) : size(pageSize)
+{
+	CAGE_ASSERT(isPowerOfTwo(pageSize) && isPowerOfTwo(minRegion));
+	CAGE_ASSERT(minRegion <= pageSize && pageSize < (1u << CoordinateBits));
+	while ((pageSize >> levels) >= minRegion)
+		levels++;
+	freeRegions.resize(levels);
+}
+
+uint32 TerrainAtlasAllocator::level(uint32 regionSize) const
+{
+	uint32 l = 0;
+	while ((size >> l) > regionSize)
+		l++;
+	CAGE_ASSERT((size >> l) == regionSize);
+	return l;
+}
+
+uint32 TerrainAtlasAllocator::regionSize(uint32 width, uint32 height) const
+{
+	CAGE_ASSERT(width > 0 && height > 0);
+	const uint32 needed = max(width, height);
+	if (needed > size)
+		CAGE_THROW_ERROR(Exception, "texture is larger than the atlas page");
+	uint32 s = size >> (levels - 1); // smallest region
+	while (s < needed)
+		s *= 2;
+	return s;
+}
+
+TerrainAtlasRegion TerrainAtlasAllocator::allocate(uint32 width, uint32 height)
+{
+	const uint32 s = regionSize(width, height);
+	const uint32 target = level(s);
+
+	// the smallest free region that is large enough
+	sint32 source = target;
+	while (source >= 0 && freeRegions[source].empty())
+		source--;
+	if (source < 0)
+	{
+		uint32 page = pages;
+		if (released.empty())
+			pages++;
+		else
+		{
+			page = *released.begin();
+			released.erase(released.begin());
+		}
+		freeRegions[0].insert(makeKey(page, 0, 0));
+		stats.pages++;
+		stats.pageTexels += uint64(size) * size;
+		stats.newPages++;
+		source = 0;
+	}
+
+	uint64 key = *freeRegions[source].begin();
+	freeRegions[source].erase(freeRegions[source].begin());
+	uint32 page, x, y;
+	splitKey(key, page, x, y);
+
+	// split down to the requested size, the first quarter is kept and the other three are freed
+	for (uint32 l = source + 1; l <= target; l++)
+	{
+		const uint32 half = size >> l;
+		freeRegions[l].insert(makeKey(page, x + half, y));
+		freeRegions[l].insert(makeKey(page, x, y + half));
+		freeRegions[l].insert(makeKey(page, x + half, y + half));
+	}
+
+	TerrainAtlasRegion r;
+	r.page = page;
+	r.x = x;
+	r.y = y;
+	r.size = s;
+	r.width = width;
+	r.height = height;
+
+	stats.allocatedTexels += uint64(s) * s;
+	stats.requestedTexels += uint64(width) * height;
+	stats.regions++;
+	stats.allocations++;
+	stats.largestRegion = max(stats.largestRegion, s);
+	return r;
+}
+
+void TerrainAtlasAllocator::deallocate(const TerrainAtlasRegion &region)
+{
+	CAGE_ASSERT(region && region.page < pages);
+	uint32 l = level(region.size);
+	uint32 x = region.x, y = region.y;
+	CAGE_ASSERT(x % region.size == 0 && y % region.size == 0);
+	CAGE_ASSERT(freeRegions[l].count(makeKey(region.page, x, y)) == 0);
+
+	// merge with the buddies while all four are free
+	while (l > 0)
+	{
+		const uint32 s = size >> l;
+		const uint32 px = x & ~(2 * s - 1), py = y & ~(2 * s - 1);
+		const uint64 quads[4] = { makeKey(region.page, px, py), makeKey(region.page, px + s, py), makeKey(region.page, px, py + s), makeKey(region.page, px + s, py + s) };
+		const uint64 self = makeKey(region.page, x, y);
+		bool all = true;
+		for (uint64 q : quads)
+			all = all && (q == self || freeRegions[l].count(q) > 0);
+		if (!all)
+			break;
+		for (uint64 q : quads)
+			if (q != self)
+				freeRegions[l].erase(q);
+		x = px;
+		y = py;
+		l--;
+	}
+	if (l == 0 && !freeRegions[0].empty())
+	{
+		// another empty page is already kept
+		released.insert(region.page);
+		stats.pages--;
+		stats.pageTexels -= uint64(size) * size;
+		stats.releasedPages++;
+	}
+	else
+		freeRegions[l].insert(makeKey(region.page, x, y));
+
+	stats.allocatedTexels -= uint64(region.size) * region.size;
+	stats.requestedTexels -= uint64(region.width) * region.height;
+	stats.regions--;
+}
+
+TerrainAtlasStatistics TerrainAtlasAllocator::statistics() const
+{
+	TerrainAtlasStatistics s = stats;
+	s.largestFreeTexels = s.usableFreeTexels = 0;
+	for (uint32 l = 0; l < levels; l++)
+	{
+		const uint64 texels = uint64(size >> l) * (size >> l);
+		if (!s.largestFreeTexels && !freeRegions[l].empty())
+			s.largestFreeTexels = texels;
+		if ((size >> l) >= s.largestRegion)
+			s.usableFreeTexels += texels * freeRegions[l].size();
+	}
+	return s;
+}
@@ -0,0 +1,72 @@
+#ifndef atlas_h_k4j5h6g7f
+#define atlas_h_k4j5h6g7f
+
+#include "../common.h"
+
+#include <vector>
+#include <set>
+
+// allocator of square regions in the pages of a texture atlas, no gpu involved
+// regions have power of two sizes and are aligned to their size (buddy allocator, four buddies per parent)
+// this keeps the mip levels of each region separate from its neighbors, down to the smallest region size
+// free buddies are merged back immediately, one fully free page is kept for reuse and the others are released
+// released page indices are reused by later pages, the owner of the page textures destroys them when the page is not live
+
+struct TerrainAtlasRegion
+{
+	uint32 page = m;
+	uint32 x = 0; // texels in level 0
+	uint32 y = 0;
+	uint32 size = 0;
+	uint32 width = 0; // requested
+	uint32 height = 0;
+
+	explicit operator bool () const { return page != m; }
+};
+
+struct TerrainAtlasStatistics
+{
+	uint64 pageTexels = 0;
+	uint64 allocatedTexels = 0; // whole regions
+	uint64 requestedTexels = 0; // parts of the regions actually used by the tiles
+	uint64 largestFreeTexels = 0; // largest region that can be allocated without a new page
+	uint64 usableFreeTexels = 0; // free texels in regions at least as large as the largest region ever requested
+	uint32 pages = 0; // live
+	uint32 regions = 0;
+	uint32 allocations = 0; // cumulative
+	uint32 newPages = 0; // allocations that needed a new page
+	uint32 releasedPages = 0; // cumulative
+	uint32 largestRegion = 0;
+
+	// share of the free space that is too scattered to hold the largest region, 0 = none
+	real fragmentation() const;
+};
+
+class TerrainAtlasAllocator
+{
+public:
+	explicit TerrainAtlasAllocator(uint32 pageSize = 4096, uint32 minRegion = 64);
+
+	uint32 regionSize(uint32 width, uint32 height) const;
+	TerrainAtlasRegion allocate(uint32 width, uint32 height); // adds a page when no free region is large enough
+	void deallocate(const TerrainAtlasRegion &region);
+
+	uint32 pageSize() const { return size; }
+	uint32 pagesCount() const { return pages; } // including the released pages
+	bool pageLive(uint32 page) const { return page < pages && released.count(page) == 0; }
+	TerrainAtlasStatistics statistics() const;
+
+private:
+	// free regions for each level, level 0 is a whole page
+	// ordered keys make the allocations deterministic and prefer lower pages and addresses
+	std::vector<std::set<uint64>> freeRegions;
+	std::set<uint32> released; // page indices available for new pages
+	TerrainAtlasStatistics stats;
+	uint32 size = 0;
+	uint32 levels = 0;
+	uint32 pages = 0;
+
+	uint32 level(uint32 regionSize) const;
+};
+
+#endif
@@ -0,0 +1,507 @@
+#include "terrain.h"
+
+#include <cage-core/files.h>
+#include <cage-core/config.h>
+#include <cage-core/image.h>
+#include <cage-core/mesh.h>
+#include <cage-core/collider.h>
+#include <cage-core/pointerRangeHolder.h>
+#include <cage-core/memoryBuffer.h>
+#include <cage-core/concurrent.h>
+
+#include <list>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+
+namespace
+{
+	ConfigBool confCacheEnabled("flittermouse/terrain/cache/enabled", true);
+	ConfigString confCachePath("flittermouse/terrain/cache/path", "cache/terrain");
+	ConfigUint32 confCacheLimit("flittermouse/terrain/cache/limit", 4096); // MB for the caches of all seeds and settings, 0 = unlimited
+	ConfigUint32 confMemoryCacheBudget("flittermouse/terrain/memoryCache/budget", 256); // MB
+	ConfigBool confMemoryCacheCompress("flittermouse/terrain/memoryCache/compress", false);
+
+	constexpr uint32 Alignment = 16;
+
+	enum class SectionEnum
+	{
+		Mesh,
+		Collider,
+		Albedo,
+		Special,
+		Count,
+	};
+
+	// the file consists of this header followed by the sections, each section starts at aligned offset
+	// the layout allows to map the whole file into memory and import the sections in place
+	struct CacheHeader
+	{
+		char magic[8] = "fmtile";
+		uint32 generatorVersion = TerrainGeneratorVersion;
+		uint32 seed = 0;
+		uint32 lodPolicy = 0;
+		uint32 colliderPolicy = 0;
+		uint32 texturePolicy = 0;
+		ivec3 pos;
+		sint32 radius = 0;
+		uint32 empty = 0;
+		uint32 textureResolution = 0;
+		uint32 albedoChannels = 0;
+		uint32 specialChannels = 0;
+		uint32 albedoGamma = 0;
+		uint32 specialGamma = 0;
+		uint64 offsets[(uint32)SectionEnum::Count] = {};
+		uint64 sizes[(uint32)SectionEnum::Count] = {};
+	};
+
+	// prefix of compressed payloads in the memory cache
+	struct PackedHeader
+	{
+		char magic[8] = "fmpack";
+		uint64 originalSize = 0;
+	};
+
+	struct MemoryEntry
+	{
+		Holder<PointerRange<char>> payload;
+		uint64 key = 0;
+	};
+
+	// used by the control thread only
+	struct MemoryCache
+	{
+		std::list<MemoryEntry> entries; // most recently used first
+		std::unordered_map<uint64, std::list<MemoryEntry>::iterator> index;
+		TerrainMemoryCacheStatistics statistics;
+
+		void evict()
+		{
+			CAGE_ASSERT(!entries.empty());
+			MemoryEntry &e = entries.back();
+			statistics.bytes -= e.payload->size();
+			statistics.entries--;
+			statistics.evictions++;
+			index.erase(e.key);
+			entries.pop_back();
+		}
+	} memoryCache;
+
+	string cacheDirectory()
+	{
+		return pathJoin(confCachePath, stringizer() + terrainSeed() + "_" + TerrainGeneratorVersion + "_" + terrainLodPolicy() + "_" + terrainColliderPolicy() + "_" + terrainTexturePolicy());
+	}
+
+	// the name follows the scheme of cacheDirectory, returns false for any other directory
+	bool cacheDirectoryVersion(const string &name, uint32 &version)
+	{
+		uint32 fields = 0, digits = 0, value = 0;
+		for (uint32 i = 0; i < name.size(); i++)
+		{
+			const char c = name[i];
+			if (c == '_')
+			{
+				if (digits == 0)
+					return false;
+				if (fields++ == 1)
+					version = value;
+				digits = value = 0;
+			}
+			else if (c >= '0' && c <= '9' && digits < 9)
+			{
+				value = value * 10 + (c - '0');
+				digits++;
+			}
+			else
+				return false;
+		}
+		return digits > 0 && fields == 4;
+	}
+
+	uint64 directorySize(const string &path)
+	{
+		uint64 bytes = 0;
+		Holder<DirectoryList> list = newDirectoryList(path);
+		for (; list->valid(); list->next())
+			if (!list->isDirectory())
+				bytes += readFile(list->fullPath())->size();
+		return bytes;
+	}
+
+	// usage of the terrain caches, shared by the generator threads
+	struct DiskCache
+	{
+		struct Other
+		{
+			string path;
+			uint64 bytes = 0;
+		};
+
+		Holder<Mutex> mutex = newMutex();
+		string directory; // the current cache directory
+		std::vector<Other> others; // caches of other seeds and settings, evicted when the limit is reached
+		uint64 bytes = 0; // all caches together, overwritten files are counted twice, the estimate errs on the safe side
+		bool full = false;
+		std::atomic<uint32> writes {0}; // makes the names of the temporary files unique
+	} diskCache;
+
+	// only directories named by cacheDirectory are ever touched, the cache path may be shared with other files
+	void diskCacheOpen(const string &directory)
+	{
+		OPTICK_EVENT("terrainCacheOpen");
+		DiskCache &c = diskCache;
+		c.directory = directory;
+		c.others.clear();
+		c.bytes = 0;
+		c.full = false;
+		try
+		{
+			if (!pathIsDirectory(confCachePath))
+				return;
+			const string current = pathExtractFilename(directory);
+			std::vector<string> outdated;
+			{
+				Holder<DirectoryList> list = newDirectoryList(confCachePath);
+				for (; list->valid(); list->next())
+				{
+					uint32 version = 0;
+					if (!list->isDirectory() || list->name() == current || !cacheDirectoryVersion(list->name(), version))
+						continue;
+					if (version != TerrainGeneratorVersion)
+						outdated.push_back(list->fullPath()); // can never be loaded again
+					else
+					{
+						c.others.push_back({ list->fullPath(), directorySize(list->fullPath()) });
+						c.bytes += c.others.back().bytes;
+					}
+				}
+			}
+			for (const string &path : outdated)
+			{
+				CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "removing outdated terrain cache: " + path);
+				pathRemove(path);
+			}
+			if (!pathIsDirectory(directory))
+				return;
+			Holder<DirectoryList> list = newDirectoryList(directory);
+			for (; list->valid(); list->next())
+			{
+				if (list->isDirectory())
+					continue;
+				if (isPattern(list->name(), "", "", ".tmp"))
+					pathRemove(list->fullPath()); // left over by an interrupted write
+				else
+					c.bytes += readFile(list->fullPath())->size();
+			}
+		}
+		catch (...)
+		{
+			detail::logCurrentCaughtException();
+		}
+	}
+
+	// evicts the caches of other seeds and settings, largest first, returns false when the file would still exceed the limit
+	bool diskCacheReserve(const string &directory, uint64 size)
+	{
+		DiskCache &c = diskCache;
+		ScopeLock<Mutex> lock(c.mutex);
+		if (c.directory != directory)
+			diskCacheOpen(directory);
+		const uint64 limit = uint64(confCacheLimit) * 1024 * 1024;
+		while (limit > 0 && c.bytes + size > limit && !c.others.empty())
+		{
+			auto it = std::max_element(c.others.begin(), c.others.end(), [](const DiskCache::Other &a, const DiskCache::Other &b) { return a.bytes < b.bytes; });
+			CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "evicting terrain cache: " + it->path);
+			try
+			{
+				pathRemove(it->path);
+			}
+			catch (...)
+			{
+				detail::logCurrentCaughtException();
+			}
+			c.bytes -= it->bytes;
+			c.others.erase(it);
+		}
+		if (limit > 0 && c.bytes + size > limit)
+		{
+			if (!c.full)
+				CAGE_LOG(SeverityEnum::Warning, "terrain", stringizer() + "terrain cache reached its limit: " + (uint32)confCacheLimit + " MB, new tiles are not stored");
+			c.full = true;
+			return false;
+		}
+		c.bytes += size;
+		return true;
+	}
+
+	string cacheFileName(const TilePos &tilePos)
+	{
+		return pathJoin(cacheDirectory(), stringizer() + tilePos + ".tile");
+	}
+
+	bool validHeader(const CacheHeader &h, const TilePos &tilePos)
+	{
+		return detail::memcmp(h.magic, CacheHeader().magic, sizeof(h.magic)) == 0
+			&& h.generatorVersion == TerrainGeneratorVersion
+			&& h.seed == terrainSeed()
+			&& h.lodPolicy == terrainLodPolicy()
+			&& h.colliderPolicy == terrainColliderPolicy()
+			&& h.texturePolicy == terrainTexturePolicy()
+			&& h.pos == tilePos.pos
+			&& h.radius == tilePos.radius;
+	}
+
+	PointerRange<const char> section(PointerRange<const char> buffer, const CacheHeader &h, SectionEnum s)
+	{
+		const uint64 off = h.offsets[(uint32)s];
+		const uint64 size = h.sizes[(uint32)s];
+		if (off + size > buffer.size())
+			CAGE_THROW_ERROR(Exception, "truncated terrain tile data");
+		return { buffer.data() + off, buffer.data() + off + size };
+	}
+
+	uint64 alignOffset(uint64 offset)
+	{
+		return (offset + Alignment - 1) / Alignment * Alignment;
+	}
+
+	PointerRange<const char> imageData(const Holder<Image> &img)
+	{
+		PointerRange<const uint8> v = img->rawViewU8();
+		return { (const char *)v.data(), (const char *)(v.data() + v.size()) };
+	}
+
+	Holder<Image> makeImage(PointerRange<const char> data, uint32 resolution, uint32 channels, uint32 gamma)
+	{
+		Holder<Image> img = newImage();
+		img->importRaw(data, resolution, resolution, channels, ImageFormatEnum::Uint8);
+		img->colorConfig.gammaSpace = (GammaSpaceEnum)gamma;
+		return img;
+	}
+}
+
+Holder<PointerRange<char>> terrainTileSerialize(const TilePos &tilePos, const Holder<Mesh> &mesh, const Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special)
+{
+	OPTICK_EVENT("terrainTileSerialize");
+
+	CacheHeader h;
+	h.seed = terrainSeed();
+	h.lodPolicy = terrainLodPolicy();
+	h.colliderPolicy = terrainColliderPolicy();
+	h.texturePolicy = terrainTexturePolicy();
+	h.pos = tilePos.pos;
+	h.radius = tilePos.radius;
+
+	Holder<PointerRange<char>> sections[(uint32)SectionEnum::Count];
+	PointerRange<const char> views[(uint32)SectionEnum::Count];
+	if (mesh)
+	{
+		CAGE_ASSERT(collider && albedo && special);
+		imageConvert(+albedo, ImageFormatEnum::Uint8);
+		imageConvert(+special, ImageFormatEnum::Uint8);
+		sections[(uint32)SectionEnum::Mesh] = mesh->serialize();
+		sections[(uint32)SectionEnum::Collider] = collider->serialize();
+		views[(uint32)SectionEnum::Mesh] = *sections[(uint32)SectionEnum::Mesh];
+		views[(uint32)SectionEnum::Collider] = *sections[(uint32)SectionEnum::Collider];
+		views[(uint32)SectionEnum::Albedo] = imageData(albedo);
+		views[(uint32)SectionEnum::Special] = imageData(special);
+		h.textureResolution = albedo->width();
+		h.albedoChannels = albedo->channels();
+		h.specialChannels = special->channels();
+		h.albedoGamma = (uint32)albedo->colorConfig.gammaSpace;
+		h.specialGamma = (uint32)special->colorConfig.gammaSpace;
+	}
+	else
+		h.empty = 1;
+
+	uint64 offset = alignOffset(sizeof(CacheHeader));
+	for (uint32 i = 0; i < (uint32)SectionEnum::Count; i++)
+	{
+		h.offsets[i] = offset;
+		h.sizes[i] = views[i].size();
+		offset += alignOffset(h.sizes[i]);
+	}
+
+	PointerRangeHolder<char> buffer;
+	buffer.resize(numeric_cast<uintPtr>(offset), 0);
+	detail::memcpy(buffer.data(), &h, sizeof(h));
+	for (uint32 i = 0; i < (uint32)SectionEnum::Count; i++)
+		detail::memcpy(buffer.data() + h.offsets[i], views[i].data(), views[i].size());
+	return buffer;
+}
+
+bool terrainTileDeserialize(PointerRange<const char> buffer, const TilePos &tilePos, Holder<Mesh> &mesh, Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special)
+{
+	OPTICK_EVENT("terrainTileDeserialize");
+	try
+	{
+		if (buffer.size() < sizeof(CacheHeader))
+			CAGE_THROW_ERROR(Exception, "truncated terrain tile data");
+		CacheHeader h;
+		detail::memcpy(&h, buffer.data(), sizeof(h));
+		if (!validHeader(h, tilePos))
+			return false;
+		if (h.empty)
+			return true;
+
+		mesh = newMesh();
+		mesh->deserialize(section(buffer, h, SectionEnum::Mesh));
+		collider = newCollider();
+		collider->deserialize(section(buffer, h, SectionEnum::Collider));
+		albedo = makeImage(section(buffer, h, SectionEnum::Albedo), h.textureResolution, h.albedoChannels, h.albedoGamma);
+		special = makeImage(section(buffer, h, SectionEnum::Special), h.textureResolution, h.specialChannels, h.specialGamma);
+		return true;
+	}
+	catch (...)
+	{
+		detail::logCurrentCaughtException();
+		mesh.clear();
+		collider.clear();
+		albedo.clear();
+		special.clear();
+		return false;
+	}
+}
+
+Holder<PointerRange<char>> terrainCacheLoad(const TilePos &tilePos)
+{
+	if (!confCacheEnabled)
+		return {};
+	const string name = cacheFileName(tilePos);
+	if (!pathIsFile(name))
+		return {};
+	OPTICK_EVENT("terrainCacheLoad");
+	try
+	{
+		Holder<File> f = readFile(name);
+		PointerRangeHolder<char> buffer;
+		buffer.resize(f->size());
+		f->read(buffer);
+		f->close();
+		return buffer;
+	}
+	catch (...)
+	{
+		detail::logCurrentCaughtException();
+		return {};
+	}
+}
+
+void terrainCacheStore(const TilePos &tilePos, PointerRange<const char> buffer)
+{
+	if (!confCacheEnabled)
+		return;
+	OPTICK_EVENT("terrainCacheStore");
+	const string directory = cacheDirectory();
+	if (!diskCacheReserve(directory, buffer.size()))
+		return;
+	const string name = pathJoin(directory, stringizer() + tilePos + ".tile");
+	const string tmpName = stringizer() + name + "." + diskCache.writes++ + ".tmp"; // other threads may write the same tile
+	try
+	{
+		{
+			Holder<File> f = writeFile(tmpName);
+			f->write(buffer);
+			f->close();
+		}
+		pathMove(tmpName, name);
+	}
+	catch (...)
+	{
+		detail::logCurrentCaughtException();
+		pathRemove(tmpName);
+	}
+}
+
+Holder<PointerRange<char>> terrainMemoryCachePack(Holder<PointerRange<char>> &&buffer)
+{
+	if (confMemoryCacheBudget == 0 || !buffer)
+		return {};
+	if (!confMemoryCacheCompress)
+		return std::move(buffer);
+	OPTICK_EVENT("terrainMemoryCachePack");
+	Holder<PointerRange<char>> compressed = compress(*buffer);
+	PackedHeader h;
+	h.originalSize = buffer->size();
+	PointerRangeHolder<char> result;
+	result.resize(sizeof(h) + compressed->size());
+	detail::memcpy(result.data(), &h, sizeof(h));
+	detail::memcpy(result.data() + sizeof(h), compressed->data(), compressed->size());
+	return result;
+}
+
+Holder<PointerRange<char>> terrainMemoryCacheUnpack(const Holder<PointerRange<char>> &payload)
+{
+	PackedHeader h;
+	if (payload->size() < sizeof(h) || detail::memcmp(payload->data(), h.magic, sizeof(h.magic)) != 0)
+		return payload.share(); // not compressed
+	OPTICK_EVENT("terrainMemoryCacheUnpack");
+	detail::memcpy(&h, payload->data(), sizeof(h));
+	return decompress({ payload->data() + sizeof(h), payload->data() + payload->size() }, numeric_cast<uintPtr>(h.originalSize));
+}
+
+void terrainMemoryCacheStore(const TilePos &tilePos, Holder<PointerRange<char>> &&payload)
+{
+	if (!payload)
+		return;
+	const uint64 budget = uint64(confMemoryCacheBudget) * 1024 * 1024;
+	if (payload->size() > budget)
+		return;
+	const uint64 key = tilePos.key();
+	MemoryCache &c = memoryCache;
+	{
+		auto it = c.index.find(key);
+		if (it != c.index.end())
+		{
+			// both payloads are equivalent, but their sizes may differ
+			c.entries.splice(c.entries.begin(), c.entries, it->second);
+			MemoryEntry &e = c.entries.front();
+			c.statistics.bytes -= e.payload->size();
+			c.statistics.bytes += payload->size();
+			e.payload = std::move(payload);
+			while (c.statistics.bytes > budget)
+				c.evict(); // never the refreshed entry, it fits the budget alone
+			return;
+		}
+	}
+	while (!c.entries.empty() && c.statistics.bytes + payload->size() > budget)
+		c.evict();
+	c.statistics.bytes += payload->size();
+	c.statistics.entries++;
+	MemoryEntry e;
+	e.payload = std::move(payload);
+	e.key = key;
+	c.entries.push_front(std::move(e));
+	c.index[key] = c.entries.begin();
+}
+
+Holder<PointerRange<char>> terrainMemoryCacheTake(const TilePos &tilePos)
+{
+	MemoryCache &c = memoryCache;
+	auto it = c.index.find(tilePos.key());
+	if (it == c.index.end())
+	{
+		c.statistics.misses++;
+		return {};
+	}
+	c.statistics.hits++;
+	Holder<PointerRange<char>> payload = std::move(it->second->payload);
+	c.statistics.bytes -= payload->size();
+	c.statistics.entries--;
+	c.entries.erase(it->second);
+	c.index.erase(it);
+	return payload;
+}
+
+void terrainMemoryCacheTrim(uint64 bytes)
+{
+	MemoryCache &c = memoryCache;
+	while (!c.entries.empty() && c.statistics.bytes > bytes)
+		c.evict();
+}
+
+TerrainMemoryCacheStatistics terrainMemoryCacheStatistics()
+{
+	return memoryCache.statistics;
+}
@@ -0,0 +1,706 @@
+#include "collisionTree.h"
+
+#include <cage-core/threadPool.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	constexpr uint32 PacketSize = 8; // at most 32, the segments of a packet are tracked in bit masks
+	constexpr uint32 ParallelMinimum = 32; // smaller batches are not worth waking the threads
+
+	real surface(const Aabb &box)
+	{
+		const vec3 s = box.b - box.a;
+		return 2 * (s[0] * s[1] + s[1] * s[2] + s[2] * s[0]);
+	}
+
+	vec3 center(const Aabb &box)
+	{
+		return (box.a + box.b) * 0.5;
+	}
+
+	// parameter at which the segment enters the box, false if it misses the box
+	bool entry(const Line &ln, const Aabb &box, real &result)
+	{
+		real a = ln.minimum, b = ln.maximum;
+		for (uint32 i = 0; i < 3; i++)
+		{
+			const real d = ln.direction[i];
+			if (abs(d) < 1e-7)
+			{
+				if (ln.origin[i] < box.a[i] || ln.origin[i] > box.b[i])
+					return false;
+				continue;
+			}
+			real t1 = (box.a[i] - ln.origin[i]) / d;
+			real t2 = (box.b[i] - ln.origin[i]) / d;
+			if (t1 > t2)
+				std::swap(t1, t2);
+			a = max(a, t1);
+			b = min(b, t2);
+			if (a > b)
+				return false;
+		}
+		result = a;
+		return true;
+	}
+
+	constexpr uint32 MaxGridResolution = 256;
+
+	// cell coordinates of a point in the grid space, clamped to the grid
+	ivec3 gridCell(const vec3 &p, uint32 resolution)
+	{
+		ivec3 r;
+		for (uint32 i = 0; i < 3; i++)
+			r[i] = sint32(clamp(p[i], real(0), real(resolution - 1)).value);
+		return r;
+	}
+
+	// the lowest root of a x^2 + b x + c in (0, limit)
+	bool lowestRoot(real a, real b, real c, real limit, real &root)
+	{
+		if (abs(a) < 1e-12)
+			return false;
+		const real det = b * b - 4 * a * c;
+		if (det < 0)
+			return false;
+		const real s = sqrt(det);
+		real r1 = (-b - s) / (2 * a);
+		real r2 = (-b + s) / (2 * a);
+		if (r1 > r2)
+			std::swap(r1, r2);
+		if (r1 > 0 && r1 < limit)
+		{
+			root = r1;
+			return true;
+		}
+		if (r1 <= 0 && r2 > 0)
+			return false; // already touching, the contact with the face handles it
+		if (r2 > 0 && r2 < limit)
+		{
+			root = r2;
+			return true;
+		}
+		return false;
+	}
+
+	// n must follow the winding of the triangle
+	bool insideTriangle(const vec3 &p, const Triangle &t, const vec3 &n)
+	{
+		for (uint32 i = 0; i < 3; i++)
+		{
+			const vec3 &a = t.vertices[i];
+			const vec3 &b = t.vertices[(i + 1) % 3];
+			if (dot(cross(b - a, p - a), n) < 0)
+				return false;
+		}
+		return true;
+	}
+
+	// earliest fraction of the motion at which a sphere touches the triangle, both sides of the triangle collide
+	// improved collision detection and response, Kasper Fauerby
+	bool sweepTriangle(const vec3 &c, real r, const vec3 &v, const Triangle &tri, real &fraction, vec3 &point)
+	{
+		const vec3 cr = cross(tri.vertices[1] - tri.vertices[0], tri.vertices[2] - tri.vertices[0]);
+		if (lengthSquared(cr) < 1e-20)
+			return false; // degenerated
+		vec3 n = normalize(cr);
+		real dist = dot(c - tri.vertices[0], n);
+		if (dist < 0)
+		{
+			n = -n;
+			dist = -dist;
+		}
+		const real speed = dot(v, n);
+
+		// the face
+		if (speed < -1e-9)
+		{
+			real t0 = (r - dist) / speed;
+			const real t1 = (-r - dist) / speed;
+			if (t0 > fraction || t1 < 0)
+				return false; // the sphere does not reach the plane
+			t0 = max(t0, real(0));
+			const vec3 p = c + v * t0 - n * r;
+			if (insideTriangle(p, tri, cr))
+			{
+				fraction = t0;
+				point = p;
+				return true;
+			}
+		}
+		else if (dist >= r)
+			return false; // moving away from the plane or along it
+
+		// the vertices and the edges
+		bool found = false;
+		const real vv = lengthSquared(v);
+		for (uint32 i = 0; i < 3; i++)
+		{
+			const vec3 &p = tri.vertices[i];
+			real x;
+			if (lowestRoot(vv, 2 * dot(v, c - p), lengthSquared(p - c) - r * r, fraction, x))
+			{
+				fraction = x;
+				point = p;
+				found = true;
+			}
+		}
+		for (uint32 i = 0; i < 3; i++)
+		{
+			const vec3 &p = tri.vertices[i];
+			const vec3 e = tri.vertices[(i + 1) % 3] - p;
+			const vec3 bp = p - c;
+			const real ee = lengthSquared(e);
+			const real ev = dot(e, v);
+			const real ebp = dot(e, bp);
+			real x;
+			if (lowestRoot(ee * -vv + ev * ev, ee * 2 * dot(v, bp) - 2 * ev * ebp, ee * (r * r - lengthSquared(bp)) + ebp * ebp, fraction, x))
+			{
+				const real f = (ev * x - ebp) / ee;
+				if (f >= 0 && f <= 1)
+				{
+					fraction = x;
+					point = p + e * f;
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+
+	bool overlaps(const Aabb &box, const Triangle &t)
+	{
+		for (uint32 i = 0; i < 3; i++)
+		{
+			const real a = t.vertices[0][i], b = t.vertices[1][i], c = t.vertices[2][i];
+			if (max(max(a, b), c) < box.a[i] || min(min(a, b), c) > box.b[i])
+				return false;
+		}
+		return true;
+	}
+
+	constexpr float SlideSkin = 0.002; // distance kept from the surfaces
+	constexpr uint32 SlideIterations = 4;
+}
+
+uint32 TerrainCollisionTree::allocate()
+{
+	if (freeNodes.empty())
+	{
+		nodes.emplace_back();
+		return numeric_cast<uint32>(nodes.size() - 1);
+	}
+	const uint32 i = freeNodes.back();
+	freeNodes.pop_back();
+	return i;
+}
+
+void TerrainCollisionTree::release(uint32 index)
+{
+	nodes[index] = Node();
+	freeNodes.push_back(index);
+}
+
+void TerrainCollisionTree::refit(uint32 index)
+{
+	while (index != m)
+	{
+		Node &n = nodes[index];
+		if (!n.leaf())
+			n.box = nodes[n.children[0]].box + nodes[n.children[1]].box;
+		index = n.parent;
+	}
+}
+
+void TerrainCollisionTree::TriangleGrid::build(const Collider *collider)
+{
+	*this = TriangleGrid();
+	const auto tris = collider->triangles();
+	if (tris.empty())
+		return;
+	box = collider->box();
+	resolution = clamp(numeric_cast<uint32>(std::sqrt(double(tris.size()))), 1u, MaxGridResolution); // the surface covers about one cell per triangle
+	scale = real(resolution) / max(box.b - box.a, vec3(1e-5));
+	entries.reserve(tris.size() * 4);
+	for (uint32 i = 0; i < tris.size(); i++)
+	{
+		// all cells the box of the triangle overlaps, enlarged to catch points on the edges
+		const Aabb b = Aabb(tris[i]);
+		const ivec3 lo = gridCell((b.a - 1e-4 - box.a) * scale, resolution);
+		const ivec3 hi = gridCell((b.b + 1e-4 - box.a) * scale, resolution);
+		for (sint32 z = lo[2]; z <= hi[2]; z++)
+			for (sint32 y = lo[1]; y <= hi[1]; y++)
+				for (sint32 x = lo[0]; x <= hi[0]; x++)
+					entries.push_back((uint64((z * resolution + y) * resolution + x) << 32) | i);
+	}
+	std::sort(entries.begin(), entries.end());
+	entries.shrink_to_fit();
+}
+
+uint32 TerrainCollisionTree::TriangleGrid::cell(const vec3 &local) const
+{
+	const ivec3 c = gridCell((local - box.a) * scale, resolution);
+	return (c[2] * resolution + c[1]) * resolution + c[0];
+}
+
+void TerrainCollisionTree::insert(uint32 name, Holder<Collider> collider, const transform &tr)
+{
+	CAGE_ASSERT(collider && tr.valid());
+	remove(name);
+	const uint32 leaf = allocate();
+	{
+		Node &n = nodes[leaf];
+		n.item.box = n.box = collider->box() * tr;
+		n.grid.build(+collider);
+		n.item.collider = std::move(collider);
+		n.item.tr = tr;
+		n.item.name = name;
+	}
+	leaves[name] = leaf;
+	if (root == m)
+	{
+		root = leaf;
+		return;
+	}
+
+	// descend towards the sibling that enlarges the tree the least
+	const Aabb box = nodes[leaf].box;
+	uint32 sibling = root;
+	while (!nodes[sibling].leaf())
+	{
+		const Node &n = nodes[sibling];
+		const real combined = surface(n.box + box);
+		const real here = 2 * combined; // cost of a new parent of this node
+		const real inheritance = 2 * (combined - surface(n.box)); // cost of enlarging this node when descending
+		real costs[2];
+		for (uint32 c = 0; c < 2; c++)
+		{
+			const Node &ch = nodes[n.children[c]];
+			const real enlarged = surface(ch.box + box);
+			costs[c] = (ch.leaf() ? enlarged : enlarged - surface(ch.box)) + inheritance;
+		}
+		if (here < costs[0] && here < costs[1])
+			break;
+		sibling = n.children[costs[0] < costs[1] ? 0 : 1];
+	}
+
+	const uint32 parent = allocate();
+	const uint32 grand = nodes[sibling].parent;
+	{
+		Node &p = nodes[parent];
+		p.parent = grand;
+		p.children[0] = sibling;
+		p.children[1] = leaf;
+	}
+	nodes[sibling].parent = parent;
+	nodes[leaf].parent = parent;
+	if (grand == m)
+		root = parent;
+	else
+	{
+		Node &g = nodes[grand];
+		g.children[g.children[0] == sibling ? 0 : 1] = parent;
+	}
+	refit(parent);
+}
+
+void TerrainCollisionTree::remove(uint32 name)
+{
+	auto it = leaves.find(name);
+	if (it == leaves.end())
+		return;
+	const uint32 leaf = it->second;
+	leaves.erase(it);
+	const uint32 parent = nodes[leaf].parent;
+	release(leaf);
+	if (parent == m)
+	{
+		CAGE_ASSERT(root == leaf);
+		root = m;
+		return;
+	}
+
+	// the sibling takes the place of the parent
+	const Node &p = nodes[parent];
+	const uint32 sibling = p.children[p.children[0] == leaf ? 1 : 0];
+	const uint32 grand = p.parent;
+	nodes[sibling].parent = grand;
+	if (grand == m)
+		root = sibling;
+	else
+	{
+		Node &g = nodes[grand];
+		g.children[g.children[0] == parent ? 0 : 1] = sibling;
+	}
+	release(parent);
+	refit(grand);
+}
+
+void TerrainCollisionTree::clear()
+{
+	nodes.clear();
+	freeNodes.clear();
+	leaves.clear();
+	root = m;
+}
+
+uint32 TerrainCollisionTree::buildRange(std::vector<uint32> &leafNodes, uint32 begin, uint32 end)
+{
+	CAGE_ASSERT(begin < end);
+	if (end - begin == 1)
+		return leafNodes[begin];
+
+	// median split along the longest axis of the centers
+	Aabb centers;
+	for (uint32 i = begin; i < end; i++)
+		centers += Aabb(center(nodes[leafNodes[i]].box));
+	const vec3 extent = centers.b - centers.a;
+	const uint32 axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+	const uint32 mid = (begin + end) / 2;
+	std::nth_element(leafNodes.begin() + begin, leafNodes.begin() + mid, leafNodes.begin() + end, [&](uint32 a, uint32 b) {
+		return center(nodes[a].box)[axis] < center(nodes[b].box)[axis];
+	});
+
+	const uint32 left = buildRange(leafNodes, begin, mid);
+	const uint32 right = buildRange(leafNodes, mid, end);
+	const uint32 index = allocate();
+	Node &n = nodes[index];
+	n.children[0] = left;
+	n.children[1] = right;
+	n.box = nodes[left].box + nodes[right].box;
+	nodes[left].parent = index;
+	nodes[right].parent = index;
+	return index;
+}
+
+void TerrainCollisionTree::build(std::vector<TerrainCollisionItem> &&items)
+{
+	clear();
+	if (items.empty())
+		return;
+	nodes.reserve(items.size() * 2);
+	std::vector<uint32> leafNodes;
+	leafNodes.reserve(items.size());
+	for (TerrainCollisionItem &it : items)
+	{
+		CAGE_ASSERT(leaves.count(it.name) == 0);
+		const uint32 index = allocate();
+		Node &n = nodes[index];
+		n.item = std::move(it);
+		n.grid.build(+n.item.collider);
+		n.box = n.item.box;
+		leaves[n.item.name] = index;
+		leafNodes.push_back(index);
+	}
+	items.clear();
+	root = buildRange(leafNodes, 0, numeric_cast<uint32>(leafNodes.size()));
+}
+
+std::vector<TerrainCollisionItem> TerrainCollisionTree::items() const
+{
+	std::vector<TerrainCollisionItem> r;
+	r.reserve(leaves.size());
+	for (const auto &it : leaves)
+	{
+		const TerrainCollisionItem &s = nodes[it.second].item;
+		TerrainCollisionItem c;
+		c.collider = s.collider.share();
+		c.tr = s.tr;
+		c.box = s.box;
+		c.name = s.name;
+		r.push_back(std::move(c));
+	}
+	return r;
+}
+
+const TerrainCollisionItem *TerrainCollisionTree::find(uint32 name) const
+{
+	auto it = leaves.find(name);
+	if (it == leaves.end())
+		return nullptr;
+	return &nodes[it->second].item;
+}
+
+void TerrainCollisionTree::packet(const Line *segments, TerrainRayHit *hits, uint32 count) const
+{
+	CAGE_ASSERT(count <= PacketSize);
+	if (root == m || count == 0)
+		return;
+	struct Entry
+	{
+		uint32 node;
+		uint32 mask; // segments of the packet that may hit something in the node
+	};
+	std::vector<Entry> stack;
+	stack.reserve(32);
+	stack.push_back({ root, (uint32(1) << count) - 1 });
+	const Node *hitLeaves[PacketSize] = {};
+	while (!stack.empty())
+	{
+		const Entry e = stack.back();
+		stack.pop_back();
+		const Node &n = nodes[e.node];
+
+		// the segments that still hit the node closer than their best hit so far
+		uint32 mask = 0;
+		for (uint32 i = 0; i < count; i++)
+		{
+			real d;
+			if ((e.mask & (1u << i)) && entry(segments[i], n.box, d) && d < hits[i].distance)
+				mask |= 1u << i;
+		}
+		if (!mask)
+			continue;
+
+		if (n.leaf())
+		{
+			for (uint32 i = 0; i < count; i++)
+			{
+				if (!(mask & (1u << i)))
+					continue;
+				const Line &ln = segments[i];
+				const vec3 p = cage::intersection(ln, +n.item.collider, n.item.tr);
+				if (!p.valid())
+					continue;
+				const real t = dot(p - ln.origin, ln.direction);
+				if (t < hits[i].distance)
+				{
+					hits[i].point = p;
+					hits[i].distance = t;
+					hits[i].name = n.item.name;
+					hitLeaves[i] = &n;
+				}
+			}
+			continue;
+		}
+
+		// the child closer to the packet is pushed last to be visited first
+		real d0 = real::Infinity(), d1 = real::Infinity();
+		for (uint32 i = 0; i < count; i++)
+		{
+			if (!(mask & (1u << i)))
+				continue;
+			real d;
+			if (entry(segments[i], nodes[n.children[0]].box, d))
+				d0 = min(d0, d);
+			if (entry(segments[i], nodes[n.children[1]].box, d))
+				d1 = min(d1, d);
+		}
+		const uint32 closer = d0 <= d1 ? 0 : 1;
+		stack.push_back({ n.children[1 - closer], mask });
+		stack.push_back({ n.children[closer], mask });
+	}
+
+	for (uint32 i = 0; i < count; i++)
+		if (hitLeaves[i])
+			hits[i].normal = hitNormal(*hitLeaves[i], segments[i], hits[i]);
+}
+
+// the normal of the triangle under the hit point, facing against the segment
+vec3 TerrainCollisionTree::hitNormal(const Node &leaf, const Line &ln, const TerrainRayHit &hit)
+{
+	const TriangleGrid &g = leaf.grid;
+	const auto tris = leaf.item.collider->triangles();
+	const uint64 c = g.cell(hit.point * inverse(leaf.item.tr));
+	real best = real::Infinity();
+	vec3 normal = -ln.direction; // when the hit lies exactly on an edge missed by both triangles
+	for (auto it = std::lower_bound(g.entries.begin(), g.entries.end(), c << 32); it != g.entries.end() && (*it >> 32) == c; it++)
+	{
+		const Triangle t = tris[uint32(*it)] * leaf.item.tr;
+		const vec3 p = cage::intersection(ln, t);
+		if (!p.valid())
+			continue;
+		const real d = abs(dot(p - ln.origin, ln.direction) - hit.distance);
+		if (d >= best)
+			continue;
+		const vec3 cr = cross(t.vertices[1] - t.vertices[0], t.vertices[2] - t.vertices[0]);
+		if (lengthSquared(cr) < 1e-20)
+			continue; // degenerated
+		best = d;
+		normal = normalize(cr);
+		if (dot(normal, ln.direction) > 0)
+			normal = -normal;
+	}
+	return normal;
+}
+
+TerrainRayHit TerrainCollisionTree::intersection(const Line &segment) const
+{
+	CAGE_ASSERT(segment.isSegment());
+	TerrainRayHit hit;
+	packet(&segment, &hit, 1);
+	return hit;
+}
+
+namespace
+{
+	struct RaysJob
+	{
+		const TerrainCollisionTree *tree = nullptr;
+		PointerRange<const Line> segments;
+		PointerRange<TerrainRayHit> hits;
+
+		void run(uint32 thread, uint32 threads)
+		{
+			const uint32 count = numeric_cast<uint32>(segments.size());
+			// whole packets for each thread
+			const uint32 packets = (count + PacketSize - 1) / PacketSize;
+			const uint32 begin = packets * thread / threads * PacketSize;
+			const uint32 end = min(packets * (thread + 1) / threads * PacketSize, count);
+			if (begin < end)
+				tree->intersections({ segments.begin() + begin, segments.begin() + end }, { hits.begin() + begin, hits.begin() + end });
+		}
+	};
+}
+
+void TerrainCollisionTree::intersections(PointerRange<const Line> segments, PointerRange<TerrainRayHit> hits, ThreadPool *pool) const
+{
+	CAGE_ASSERT(segments.size() == hits.size());
+	const uint32 count = numeric_cast<uint32>(segments.size());
+	for (TerrainRayHit &h : hits)
+		h = TerrainRayHit();
+	if (pool && count >= ParallelMinimum)
+	{
+		RaysJob job;
+		job.tree = this;
+		job.segments = segments;
+		job.hits = hits;
+		pool->function.bind<RaysJob, &RaysJob::run>(&job);
+		pool->run();
+		return;
+	}
+	for (uint32 begin = 0; begin < count; begin += PacketSize)
+		packet(segments.begin() + begin, hits.begin() + begin, min(count - begin, PacketSize));
+}
+
+uint32 TerrainCollisionTree::depth() const
+{
+	if (root == m)
+		return 0;
+	uint32 result = 0;
+	std::vector<std::pair<uint32, uint32>> stack;
+	stack.push_back({ root, 1 });
+	while (!stack.empty())
+	{
+		const auto e = stack.back();
+		stack.pop_back();
+		result = max(result, e.second);
+		const Node &n = nodes[e.first];
+		if (!n.leaf())
+		{
+			stack.push_back({ n.children[0], e.second + 1 });
+			stack.push_back({ n.children[1], e.second + 1 });
+		}
+	}
+	return result;
+}
+
+real TerrainCollisionTree::cost() const
+{
+	if (root == m)
+		return 0;
+	real result = 0;
+	std::vector<uint32> stack;
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		const Node &n = nodes[stack.back()];
+		stack.pop_back();
+		if (n.leaf())
+			continue;
+		result += surface(n.box);
+		stack.push_back(n.children[0]);
+		stack.push_back(n.children[1]);
+	}
+	return result;
+}
+
+TerrainSweepHit TerrainCollisionTree::sweep(const vec3 &center, real radius, const vec3 &motion, TerrainSlideResult *statistics) const
+{
+	CAGE_ASSERT(radius > 0);
+	TerrainSweepHit best;
+	const Aabb swept = Aabb(center - radius, center + radius) + Aabb(center + motion - radius, center + motion + radius);
+	const Sphere bounding = Sphere(center + motion * 0.5, radius + length(motion) * 0.5);
+	std::vector<uint32> candidates;
+	traverseLeaves(swept, [&](const Node &n) {
+		const TerrainCollisionItem &item = n.item;
+		if (!intersects(bounding, +item.collider, item.tr))
+			return; // the collider bvh
+		if (statistics)
+			statistics->tiles++;
+		const Aabb local = swept * inverse(item.tr);
+		const auto tris = item.collider->triangles();
+		const TriangleGrid &g = n.grid;
+		if (g.resolution == 0 || !intersects(local, g.box))
+			return;
+		// triangles bucketed in the grid cells the swept box overlaps, the cells of a row are consecutive in the sorted entries
+		const ivec3 lo = gridCell((local.a - g.box.a) * g.scale, g.resolution);
+		const ivec3 hi = gridCell((local.b - g.box.a) * g.scale, g.resolution);
+		candidates.clear();
+		for (sint32 z = lo[2]; z <= hi[2]; z++)
+		{
+			for (sint32 y = lo[1]; y <= hi[1]; y++)
+			{
+				const uint64 row = (z * g.resolution + y) * g.resolution;
+				for (auto it = std::lower_bound(g.entries.begin(), g.entries.end(), (row + lo[0]) << 32); it != g.entries.end() && (*it >> 32) <= row + hi[0]; it++)
+					candidates.push_back(uint32(*it));
+			}
+		}
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end()); // triangles spanning multiple cells
+		if (statistics)
+			statistics->triangles += numeric_cast<uint32>(candidates.size());
+		for (uint32 i : candidates)
+		{
+			const Triangle &lt = tris[i];
+			if (!overlaps(local, lt))
+				continue;
+			const Triangle t = lt * item.tr;
+			real fraction = best.fraction;
+			vec3 point;
+			if (sweepTriangle(center, radius, motion, t, fraction, point))
+			{
+				best.fraction = fraction;
+				best.point = point;
+				best.name = item.name;
+			}
+		}
+	});
+	if (best)
+	{
+		const vec3 c = center + motion * best.fraction;
+		best.normal = distanceSquared(c, best.point) > 1e-12 ? normalize(c - best.point) : -normalize(motion);
+	}
+	return best;
+}
+
+TerrainSlideResult TerrainCollisionTree::slide(const vec3 &center, real radius, const vec3 &motion) const
+{
+	TerrainSlideResult r;
+	r.position = center;
+	vec3 remaining = motion;
+	for (uint32 iteration = 0; iteration < SlideIterations; iteration++)
+	{
+		const real len = length(remaining);
+		if (len < 1e-6)
+			break;
+		const TerrainSweepHit h = sweep(r.position, radius, remaining, &r);
+		if (!h)
+		{
+			r.position += remaining;
+			break;
+		}
+		// stop just before the contact and continue along the surface with the rest of the motion
+		const vec3 dir = remaining / len;
+		const real travel = max(h.fraction * len - SlideSkin, real(0));
+		r.position += dir * travel;
+		remaining -= dir * travel;
+		remaining -= h.normal * dot(remaining, h.normal);
+		r.normal = h.normal;
+		r.contacts++;
+	}
+	return r;
+}
@@ -0,0 +1,130 @@
+#ifndef collisionTree_h_h5j4k3l2
+#define collisionTree_h_h5j4k3l2
+
+#include "../common.h"
+
+#include <cage-core/geometry.h>
+#include <cage-core/collider.h>
+
+#include <vector>
+#include <unordered_map>
+
+// two-level collision structure of the terrain, no engine involved
+// the top level is a dynamic bounding volume tree over the tiles, the bottom level are the bvhs of the tile colliders
+// tiles are inserted and removed in O(log n), the top level degrades with the updates and is rebuilt balanced occasionally
+// not thread safe, except that concurrent queries are allowed while the tree is not modified
+
+struct TerrainCollisionItem
+{
+	Holder<Collider> collider;
+	transform tr;
+	Aabb box; // world space
+	uint32 name = m;
+};
+
+struct TerrainSweepHit
+{
+	vec3 point = vec3::Nan(); // of the contact
+	vec3 normal = vec3::Nan(); // facing the sphere
+	real fraction = 1; // of the motion before the contact
+	uint32 name = m;
+
+	explicit operator bool () const { return name != m; }
+};
+
+class TerrainCollisionTree
+{
+public:
+	void insert(uint32 name, Holder<Collider> collider, const transform &tr); // replaces the previous collider with the same name
+	void remove(uint32 name);
+	void clear();
+	void build(std::vector<TerrainCollisionItem> &&items); // balanced tree from scratch, O(n log n)
+	std::vector<TerrainCollisionItem> items() const; // shares the colliders
+	const TerrainCollisionItem *find(uint32 name) const;
+
+	TerrainRayHit intersection(const Line &segment) const; // closest hit
+	// closest hits of many segments, consecutive segments are traversed together in packets, so keep similar segments next to each other
+	// large batches are split between the threads of the pool
+	void intersections(PointerRange<const Line> segments, PointerRange<TerrainRayHit> hits, ThreadPool *pool = nullptr) const;
+	// continuous collision of a sphere moving along the motion, the earliest contact
+	// the colliders are rejected with their bvhs first, the remaining ones test the triangles in the grid cells the motion overlaps
+	TerrainSweepHit sweep(const vec3 &center, real radius, const vec3 &motion, TerrainSlideResult *statistics = nullptr) const;
+	TerrainSlideResult slide(const vec3 &center, real radius, const vec3 &motion) const; // moves the sphere, sliding along the surfaces it touches
+	template<class Callback>
+	void traverse(const Aabb &box, Callback &&callback) const; // calls the callback with each item whose box intersects the box
+
+	uint32 count() const { return numeric_cast<uint32>(leaves.size()); }
+	uint32 depth() const;
+	real cost() const; // sum of the surfaces of the inner nodes, lower is better
+
+private:
+	// triangles of a collider bucketed in a sparse uniform grid in its local space
+	// the collider reports the hit point only, the grid finds the triangle under it for the normal
+	struct TriangleGrid
+	{
+		std::vector<uint64> entries; // cell << 32 | triangle, sorted
+		Aabb box;
+		vec3 scale; // cells per unit
+		uint32 resolution = 0;
+
+		void build(const Collider *collider);
+		uint32 cell(const vec3 &local) const;
+	};
+
+	struct Node
+	{
+		TerrainCollisionItem item; // leaves only
+		TriangleGrid grid; // leaves only
+		Aabb box;
+		uint32 parent = m;
+		uint32 children[2] = { m, m };
+
+		bool leaf() const { return children[0] == m; }
+	};
+
+	std::vector<Node> nodes;
+	std::vector<uint32> freeNodes;
+	std::unordered_map<uint32, uint32> leaves; // name -> node
+	uint32 root = m;
+
+	uint32 allocate();
+	void release(uint32 index);
+	void refit(uint32 index); // from the node up to the root
+	uint32 buildRange(std::vector<uint32> &leafNodes, uint32 begin, uint32 end);
+	void packet(const Line *segments, TerrainRayHit *hits, uint32 count) const;
+	static vec3 hitNormal(const Node &leaf, const Line &ln, const TerrainRayHit &hit);
+	template<class Callback>
+	void traverseLeaves(const Aabb &box, Callback &&callback) const; // calls the callback with each leaf node whose box intersects the box
+};
+
+template<class Callback>
+void TerrainCollisionTree::traverse(const Aabb &box, Callback &&callback) const
+{
+	traverseLeaves(box, [&](const Node &n) { callback(n.item); });
+}
+
+template<class Callback>
+void TerrainCollisionTree::traverseLeaves(const Aabb &box, Callback &&callback) const
+{
+	if (root == m)
+		return;
+	std::vector<uint32> stack;
+	stack.reserve(32);
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		const Node &n = nodes[stack.back()];
+		stack.pop_back();
+		if (!intersects(n.box, box))
+			continue;
+		if (n.leaf())
+			callback(n);
+		else
+		{
+			stack.push_back(n.children[0]);
+			stack.push_back(n.children[1]);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include "terrain.h"
+
+#include <cage-core/image.h>
+
+namespace
+{
+	constexpr uint32 BlockSize = 4;
+
+	// color (or channel) values of one 4x4 block, pixels outside of the image are clamped to the edge
+	template<uint32 Channels>
+	void loadBlock(const uint8 *data, uint32 width, uint32 height, uint32 bx, uint32 by, uint8 block[16][Channels])
+	{
+		for (uint32 y = 0; y < BlockSize; y++)
+		{
+			const uint32 sy = min(by * BlockSize + y, height - 1);
+			for (uint32 x = 0; x < BlockSize; x++)
+			{
+				const uint32 sx = min(bx * BlockSize + x, width - 1);
+				const uint8 *p = data + (sy * width + sx) * Channels;
+				for (uint32 c = 0; c < Channels; c++)
+					block[y * BlockSize + x][c] = p[c];
+			}
+		}
+	}
+
+	uint16 to565(const uint8 c[3])
+	{
+		return uint16(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+	}
+
+	void from565(uint16 v, uint8 c[3])
+	{
+		const uint32 r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+		c[0] = uint8((r << 3) | (r >> 2));
+		c[1] = uint8((g << 2) | (g >> 4));
+		c[2] = uint8((b << 3) | (b >> 2));
+	}
+
+	void bc1Palette(uint16 c0, uint16 c1, uint8 palette[4][3])
+	{
+		from565(c0, palette[0]);
+		from565(c1, palette[1]);
+		for (uint32 c = 0; c < 3; c++)
+		{
+			if (c0 > c1)
+			{
+				palette[2][c] = uint8((2 * palette[0][c] + palette[1][c]) / 3);
+				palette[3][c] = uint8((palette[0][c] + 2 * palette[1][c]) / 3);
+			}
+			else
+			{
+				palette[2][c] = uint8((palette[0][c] + palette[1][c]) / 2);
+				palette[3][c] = 0;
+			}
+		}
+	}
+
+	// endpoints from the bounding box of the colors, inset to reduce the error of the extremes
+	void encodeBc1Block(const uint8 block[16][3], uint8 *output)
+	{
+		uint8 mn[3] = { 255, 255, 255 }, mx[3] = { 0, 0, 0 };
+		for (uint32 i = 0; i < 16; i++)
+		{
+			for (uint32 c = 0; c < 3; c++)
+			{
+				mn[c] = min(mn[c], block[i][c]);
+				mx[c] = max(mx[c], block[i][c]);
+			}
+		}
+		for (uint32 c = 0; c < 3; c++)
+		{
+			const uint8 inset = uint8((mx[c] - mn[c]) >> 4);
+			mn[c] += inset;
+			mx[c] -= inset;
+		}
+		uint16 c0 = to565(mx), c1 = to565(mn);
+		if (c0 < c1)
+			std::swap(c0, c1);
+		uint32 indices = 0;
+		if (c0 != c1)
+		{
+			uint8 palette[4][3];
+			bc1Palette(c0, c1, palette);
+			for (uint32 i = 0; i < 16; i++)
+			{
+				uint32 best = 0, bestDist = m;
+				for (uint32 p = 0; p < 4; p++)
+				{
+					uint32 d = 0;
+					for (uint32 c = 0; c < 3; c++)
+					{
+						const sint32 e = sint32(block[i][c]) - palette[p][c];
+						d += e * e;
+					}
+					if (d < bestDist)
+					{
+						bestDist = d;
+						best = p;
+					}
+				}
+				indices |= best << (i * 2);
+			}
+		}
+		output[0] = uint8(c0 & 0xff);
+		output[1] = uint8(c0 >> 8);
+		output[2] = uint8(c1 & 0xff);
+		output[3] = uint8(c1 >> 8);
+		for (uint32 i = 0; i < 4; i++)
+			output[4 + i] = uint8(indices >> (i * 8));
+	}
+
+	void bc4Palette(uint8 e0, uint8 e1, uint8 palette[8])
+	{
+		palette[0] = e0;
+		palette[1] = e1;
+		if (e0 > e1)
+		{
+			for (uint32 i = 1; i < 7; i++)
+				palette[i + 1] = uint8(((7 - i) * e0 + i * e1) / 7);
+		}
+		else
+		{
+			for (uint32 i = 1; i < 5; i++)
+				palette[i + 1] = uint8(((5 - i) * e0 + i * e1) / 5);
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+	}
+
+	void encodeBc4Block(const uint8 values[16], uint8 *output)
+	{
+		uint8 mn = 255, mx = 0;
+		for (uint32 i = 0; i < 16; i++)
+		{
+			mn = min(mn, values[i]);
+			mx = max(mx, values[i]);
+		}
+		uint64 indices = 0;
+		if (mx != mn)
+		{
+			uint8 palette[8];
+			bc4Palette(mx, mn, palette);
+			for (uint32 i = 0; i < 16; i++)
+			{
+				uint32 best = 0, bestDist = m;
+				for (uint32 p = 0; p < 8; p++)
+				{
+					const uint32 d = abs(sint32(values[i]) - sint32(palette[p]));
+					if (d < bestDist)
+					{
+						bestDist = d;
+						best = p;
+					}
+				}
+				indices |= uint64(best) << (i * 3);
+			}
+		}
+		output[0] = mx;
+		output[1] = mn;
+		for (uint32 i = 0; i < 6; i++)
+			output[2 + i] = uint8(indices >> (i * 8));
+	}
+
+	void encodeBc5Block(const uint8 block[16][2], uint8 *output)
+	{
+		uint8 r[16], g[16];
+		for (uint32 i = 0; i < 16; i++)
+		{
+			r[i] = block[i][0];
+			g[i] = block[i][1];
+		}
+		encodeBc4Block(r, output);
+		encodeBc4Block(g, output + 8);
+	}
+
+	void decodeBc1Block(const uint8 *input, uint8 block[16][3])
+	{
+		const uint16 c0 = uint16(input[0] | (input[1] << 8));
+		const uint16 c1 = uint16(input[2] | (input[3] << 8));
+		const uint32 indices = input[4] | (input[5] << 8) | (input[6] << 16) | (uint32(input[7]) << 24);
+		uint8 palette[4][3];
+		bc1Palette(c0, c1, palette);
+		for (uint32 i = 0; i < 16; i++)
+			for (uint32 c = 0; c < 3; c++)
+				block[i][c] = palette[(indices >> (i * 2)) & 3][c];
+	}
+
+	void decodeBc4Block(const uint8 *input, uint8 values[16])
+	{
+		uint8 palette[8];
+		bc4Palette(input[0], input[1], palette);
+		uint64 indices = 0;
+		for (uint32 i = 0; i < 6; i++)
+			indices |= uint64(input[2 + i]) << (i * 8);
+		for (uint32 i = 0; i < 16; i++)
+			values[i] = palette[(indices >> (i * 3)) & 7];
+	}
+
+	template<uint32 Channels>
+	void encodeLevel(const uint8 *data, uint32 width, uint32 height, std::vector<char> &output)
+	{
+		const uint32 bw = (width + BlockSize - 1) / BlockSize;
+		const uint32 bh = (height + BlockSize - 1) / BlockSize;
+		const uint32 blockBytes = Channels == 3 ? 8 : 16;
+		output.resize(bw * bh * blockBytes);
+		uint8 *out = (uint8 *)output.data();
+		for (uint32 by = 0; by < bh; by++)
+		{
+			for (uint32 bx = 0; bx < bw; bx++)
+			{
+				uint8 block[16][Channels];
+				loadBlock<Channels>(data, width, height, bx, by, block);
+				if constexpr (Channels == 3)
+					encodeBc1Block(block, out);
+				else
+					encodeBc5Block(block, out);
+				out += blockBytes;
+			}
+		}
+	}
+
+	// 2x2 box filter, odd edges are clamped
+	std::vector<uint8> downsample(const std::vector<uint8> &src, uint32 width, uint32 height, uint32 channels)
+	{
+		const uint32 w = max(width / 2, 1u), h = max(height / 2, 1u);
+		std::vector<uint8> dst(w * h * channels);
+		for (uint32 y = 0; y < h; y++)
+		{
+			const uint32 y0 = min(y * 2, height - 1), y1 = min(y * 2 + 1, height - 1);
+			for (uint32 x = 0; x < w; x++)
+			{
+				const uint32 x0 = min(x * 2, width - 1), x1 = min(x * 2 + 1, width - 1);
+				for (uint32 c = 0; c < channels; c++)
+				{
+					const uint32 sum = src[(y0 * width + x0) * channels + c] + src[(y0 * width + x1) * channels + c] + src[(y1 * width + x0) * channels + c] + src[(y1 * width + x1) * channels + c];
+					dst[(y * w + x) * channels + c] = uint8((sum + 2) / 4);
+				}
+			}
+		}
+		return dst;
+	}
+}
+
+TerrainCompressedTexture terrainCompressTexture(Image *image)
+{
+	OPTICK_EVENT("terrainCompressTexture");
+	const uint32 channels = image->channels();
+	CAGE_ASSERT(channels == 3 || channels == 2);
+	imageConvert(image, ImageFormatEnum::Uint8);
+
+	TerrainCompressedTexture result;
+	result.format = channels == 3 ? TerrainCompressionEnum::Bc1 : TerrainCompressionEnum::Bc5;
+	result.gamma = image->colorConfig.gammaSpace == GammaSpaceEnum::Gamma;
+	result.width = image->width();
+	result.height = image->height();
+
+	PointerRange<const uint8> raw = image->rawViewU8();
+	std::vector<uint8> level(raw.begin(), raw.end());
+	uint32 w = result.width, h = result.height;
+	while (true)
+	{
+		result.levels.emplace_back();
+		if (channels == 3)
+			encodeLevel<3>(level.data(), w, h, result.levels.back());
+		else
+			encodeLevel<2>(level.data(), w, h, result.levels.back());
+		if (w == 1 && h == 1)
+			break;
+		level = downsample(level, w, h, channels);
+		w = max(w / 2, 1u);
+		h = max(h / 2, 1u);
+	}
+	return result;
+}
+
+Holder<Image> terrainDecompressTexture(const TerrainCompressedTexture &texture, uint32 levelIndex)
+{
+	CAGE_ASSERT(levelIndex < texture.levels.size());
+	const uint32 w = max(texture.width >> levelIndex, 1u);
+	const uint32 h = max(texture.height >> levelIndex, 1u);
+	const uint32 channels = texture.format == TerrainCompressionEnum::Bc1 ? 3 : 2;
+	const uint32 blockBytes = channels == 3 ? 8 : 16;
+	const uint32 bw = (w + BlockSize - 1) / BlockSize;
+	const uint8 *in = (const uint8 *)texture.levels[levelIndex].data();
+	Holder<Image> img = newImage();
+	img->initialize(w, h, channels, ImageFormatEnum::Uint8);
+	img->colorConfig.gammaSpace = texture.gamma ? GammaSpaceEnum::Gamma : GammaSpaceEnum::Linear;
+	uint8 *data = (uint8 *)img->rawViewU8().data();
+	for (uint32 by = 0; by < (h + BlockSize - 1) / BlockSize; by++)
+	{
+		for (uint32 bx = 0; bx < bw; bx++)
+		{
+			const uint8 *block = in + (by * bw + bx) * blockBytes;
+			uint8 pixels[16][3];
+			if (channels == 3)
+				decodeBc1Block(block, pixels);
+			else
+			{
+				uint8 r[16], g[16];
+				decodeBc4Block(block, r);
+				decodeBc4Block(block + 8, g);
+				for (uint32 i = 0; i < 16; i++)
+				{
+					pixels[i][0] = r[i];
+					pixels[i][1] = g[i];
+				}
+			}
+			for (uint32 y = 0; y < BlockSize; y++)
+			{
+				for (uint32 x = 0; x < BlockSize; x++)
+				{
+					const uint32 px = bx * BlockSize + x, py = by * BlockSize + y;
+					if (px >= w || py >= h)
+						continue;
+					for (uint32 c = 0; c < channels; c++)
+						data[(py * w + px) * channels + c] = pixels[y * BlockSize + x][c];
+				}
+			}
+		}
+	}
+	return img;
+}
+
+uint64 TerrainCompressedTexture::bytes() const
+{
+	uint64 s = 0;
+	for (const auto &l : levels)
+		s += l.size();
+	return s;
+}
@@ -0,0 +1,211 @@
+#include "terrain.h"
+
+#include <cage-core/concurrent.h>
+#include <cage-core/config.h>
+
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+namespace
+{
+	ConfigUint32 confDensityCacheBudget("flittermouse/terrain/densityCache/budget", 32); // MB, 0 = disabled
+
+	constexpr uint32 ShardsCount = 64;
+	constexpr uint32 EntryBytes = 64; // estimate including the hash table overhead
+
+	struct Key
+	{
+		ivec3 position;
+		uint32 denominator = 0;
+
+		bool operator == (const Key &other) const { return position == other.position && denominator == other.denominator; }
+	};
+
+	struct KeyHash
+	{
+		std::size_t operator () (const Key &k) const
+		{
+			uint32 h = hash(k.denominator);
+			for (uint32 i = 0; i < 3; i++)
+				h = hash(h ^ (uint32)k.position[i]);
+			return h;
+		}
+	};
+
+	uint32 shardOf(const Key &k)
+	{
+		return KeyHash()(k) % ShardsCount;
+	}
+
+	typedef std::unordered_map<Key, real, KeyHash> Map;
+
+	// bounded by two generations: when the current generation is full, the previous one is dropped
+	// entries found in the previous generation are moved to the current one
+	struct Shard
+	{
+		Holder<Mutex> mutex = newMutex();
+		Map current;
+		Map previous;
+		uint64 hits = 0;
+		uint64 misses = 0;
+		uint64 evictions = 0;
+
+		bool find(const Key &k, real &value)
+		{
+			auto it = current.find(k);
+			if (it != current.end())
+			{
+				value = it->second;
+				hits++;
+				return true;
+			}
+			it = previous.find(k);
+			if (it != previous.end())
+			{
+				value = it->second;
+				previous.erase(it);
+				current[k] = value;
+				hits++;
+				return true;
+			}
+			misses++;
+			return false;
+		}
+
+		void insert(const Key &k, real value, uint64 capacity)
+		{
+			if (current.size() * 2 >= capacity)
+			{
+				evictions += previous.size();
+				std::swap(previous, current);
+				current.clear();
+			}
+			current[k] = value;
+		}
+	};
+
+	std::array<Shard, ShardsCount> shards;
+	std::atomic<uint64> totalEntries {0}; // read every tick without locking the shards
+
+	uint64 shardCapacity()
+	{
+		return uint64(confDensityCacheBudget) * 1024 * 1024 / EntryBytes / ShardsCount;
+	}
+
+	// samples grouped by shards, so that each shard is locked once per batch
+	struct Batch
+	{
+		std::vector<Key> keys;
+		std::vector<uint32> order;
+		std::array<uint32, ShardsCount + 1> offsets = {};
+
+		void prepare(uint32 denominator, PointerRange<const ivec3> positions)
+		{
+			const uint32 count = numeric_cast<uint32>(positions.size());
+			keys.resize(count);
+			order.resize(count);
+			offsets.fill(0);
+			for (uint32 i = 0; i < count; i++)
+			{
+				keys[i].position = positions[i];
+				keys[i].denominator = denominator;
+				offsets[shardOf(keys[i]) + 1]++;
+			}
+			for (uint32 s = 0; s < ShardsCount; s++)
+				offsets[s + 1] += offsets[s];
+			std::array<uint32, ShardsCount> fill;
+			for (uint32 s = 0; s < ShardsCount; s++)
+				fill[s] = offsets[s];
+			for (uint32 i = 0; i < count; i++)
+				order[fill[shardOf(keys[i])]++] = i;
+		}
+	};
+
+	Batch &batch()
+	{
+		thread_local Batch b;
+		return b;
+	}
+}
+
+bool terrainDensityCacheEnabled()
+{
+	return confDensityCacheBudget > 0;
+}
+
+void terrainDensityCacheLookup(uint32 denominator, PointerRange<const ivec3> positions, PointerRange<real> values, PointerRange<bool> found)
+{
+	CAGE_ASSERT(positions.size() == values.size() && positions.size() == found.size());
+	Batch &b = batch();
+	b.prepare(denominator, positions);
+	for (uint32 s = 0; s < ShardsCount; s++)
+	{
+		if (b.offsets[s] == b.offsets[s + 1])
+			continue;
+		Shard &sh = shards[s];
+		ScopeLock<Mutex> lock(sh.mutex);
+		for (uint32 j = b.offsets[s]; j < b.offsets[s + 1]; j++)
+		{
+			const uint32 i = b.order[j];
+			found[i] = sh.find(b.keys[i], values[i]);
+		}
+	}
+}
+
+void terrainDensityCacheStore(uint32 denominator, PointerRange<const ivec3> positions, PointerRange<const real> values)
+{
+	CAGE_ASSERT(positions.size() == values.size());
+	const uint64 capacity = shardCapacity();
+	if (capacity == 0)
+		return;
+	Batch &b = batch();
+	b.prepare(denominator, positions);
+	for (uint32 s = 0; s < ShardsCount; s++)
+	{
+		if (b.offsets[s] == b.offsets[s + 1])
+			continue;
+		Shard &sh = shards[s];
+		ScopeLock<Mutex> lock(sh.mutex);
+		const uint64 before = sh.current.size() + sh.previous.size();
+		for (uint32 j = b.offsets[s]; j < b.offsets[s + 1]; j++)
+		{
+			const uint32 i = b.order[j];
+			sh.insert(b.keys[i], values[i], capacity);
+		}
+		totalEntries += sh.current.size() + sh.previous.size() - before; // wraps around when the generation swap dropped more than was inserted
+	}
+}
+
+void terrainDensityCacheClear()
+{
+	for (Shard &sh : shards)
+	{
+		ScopeLock<Mutex> lock(sh.mutex);
+		totalEntries -= sh.current.size() + sh.previous.size();
+		sh.current.clear();
+		sh.previous.clear();
+		sh.hits = sh.misses = sh.evictions = 0;
+	}
+}
+
+TerrainDensityCacheStatistics terrainDensityCacheStatistics()
+{
+	TerrainDensityCacheStatistics r;
+	for (Shard &sh : shards)
+	{
+		ScopeLock<Mutex> lock(sh.mutex);
+		r.entries += sh.current.size() + sh.previous.size();
+		r.hits += sh.hits;
+		r.misses += sh.misses;
+		r.evictions += sh.evictions;
+	}
+	r.bytes = r.entries * EntryBytes;
+	return r;
+}
+
+uint64 terrainDensityCacheBytes()
+{
+	return totalEntries * EntryBytes;
+}
@@ -1,9 +1,25 @@
 #include "terrain.h"
 
+#include <cage-core/config.h>
+
 #include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace
 {
+	constexpr sint32 TileSize = 32;
+	constexpr sint32 Range = 2;
+	constexpr sint32 MinRadius = TerrainMinTileRadius;
+
+	ConfigBool confPrefetchEnabled("flittermouse/terrain/prefetch/enabled", true);
+	ConfigUint32 confPrefetchHorizon("flittermouse/terrain/prefetch/horizon", 60); // control ticks
+	ConfigUint32 confPrefetchSamples("flittermouse/terrain/prefetch/samples", 8);
+
 	std::array<TilePos, 8> children(const TilePos &pos)
 	{
 		std::array<TilePos, 8> res;
@@ -18,69 +34,378 @@ namespace
 		return res;
 	}
 
-	bool coarsenessTest(const TilePos &pos)
+	enum class NodeStateEnum
+	{
+		Placeholder, // requested (invisible) while the parent is waiting for all its children, not evaluated
+		Leaf, // visible, without children
+		Pending, // visible, its children are placeholders
+		Refined, // invisible, its children are evaluated
+	};
+
+	struct Node
+	{
+		TilePos pos;
+		uint64 parent = 0;
+		uint32 generation = 0; // invalidates scheduled evaluations
+		NodeStateEnum state = NodeStateEnum::Placeholder;
+	};
+
+	// the node is re-evaluated once the player has traveled far enough to possibly change the coarseness test
+	struct Evaluation
+	{
+		double due = 0; // total traveled distance
+		uint64 key = 0;
+		uint32 generation = 0;
+
+		bool operator < (const Evaluation &other) const
+		{
+			return due > other.due; // earliest first
+		}
+	};
+
+	std::unordered_map<uint64, Node> nodes; // the tree, each node is a requested tile
+	std::unordered_set<uint64> readyTiles;
+	std::unordered_set<uint64> dirtyNodes; // parents of tiles whose readiness has changed
+	std::vector<Evaluation> evaluations; // heap
+	std::vector<uint64> roots;
+	ivec3 rootsCenter;
+	bool rootsValid = false;
+	vec3 lastPlayerPosition;
+	double traveled = 0; // double keeps small per-tick distances accumulating over long flights
+	std::unordered_map<uint64, TilePos> prefetched; // tiles requested along the predicted flight path
+	real refineScale = 1; // lowered by the memory budget
+	bool refineScaleChanged = false;
+	std::vector<TileChange> *changes = nullptr;
+
+	struct Statistics
+	{
+		uint64 ticks = 0;
+		uint64 coarseTicks = 0; // ticks with at least one parent tile shown in place of its children
+		uint64 pendingNodeTicks = 0;
+	} statistics;
+	uint32 pendingNodes = 0;
+
+	void emit(const TilePos &pos, TileChangeEnum change, bool prefetch = false)
+	{
+		TileChange c;
+		c.pos = pos;
+		c.change = change;
+		c.prefetch = prefetch;
+		changes->push_back(c);
+	}
+
+	void setState(Node &n, NodeStateEnum state)
+	{
+		if (n.state == NodeStateEnum::Pending)
+			pendingNodes--;
+		if (state == NodeStateEnum::Pending)
+			pendingNodes++;
+		n.state = state;
+	}
+
+	void setVisible(Node &n, bool visible)
+	{
+		if (n.pos.visible == visible)
+			return;
+		n.pos.visible = visible;
+		emit(n.pos, TileChangeEnum::Visibility);
+	}
+
+	Node &addNode(const TilePos &pos, uint64 parent)
+	{
+		const uint64 key = pos.key();
+		CAGE_ASSERT(nodes.count(key) == 0);
+		Node &n = nodes[key];
+		n.pos = pos;
+		n.pos.visible = false;
+		n.parent = parent;
+		if (prefetched.count(key))
+			emit(n.pos, TileChangeEnum::Priority, false);
+		else
+			emit(n.pos, TileChangeEnum::Add);
+		return n;
+	}
+
+	void removeChildren(Node &n);
+
+	void removeNode(uint64 key)
+	{
+		auto it = nodes.find(key);
+		CAGE_ASSERT(it != nodes.end());
+		Node &n = it->second;
+		removeChildren(n);
+		if (prefetched.count(key))
+		{
+			setVisible(n, false);
+			emit(n.pos, TileChangeEnum::Priority, true);
+		}
+		else
+			emit(n.pos, TileChangeEnum::Remove);
+		nodes.erase(it);
+	}
+
+	void removeChildren(Node &n)
+	{
+		if (n.state != NodeStateEnum::Pending && n.state != NodeStateEnum::Refined)
+			return;
+		for (const TilePos &c : children(n.pos))
+			removeNode(c.key());
+		setState(n, NodeStateEnum::Leaf);
+	}
+
+	void schedule(Node &n, uint64 key, real slack)
 	{
-		real d = pos.distanceToPlayer();
-		return d > pos.radius * 4;
+		Evaluation e;
+		e.due = std::max(traveled + slack.value, std::nextafter(traveled, std::numeric_limits<double>::infinity())); // strictly in the future
+		e.key = key;
+		e.generation = n.generation;
+		evaluations.push_back(e);
+		std::push_heap(evaluations.begin(), evaluations.end());
 	}
 
-	void traverse(TilePos pos, std::set<TilePos> &tilesRequests, const std::set<TilePos> &tilesReady)
+	void evaluate(uint64 key)
 	{
-		if (pos.radius <= 4 || coarsenessTest(pos))
+		Node &n = nodes[key];
+		n.generation++;
+
+		bool refine = false;
+		if (n.pos.radius > MinRadius)
+		{
+			const real d = n.pos.distanceToPlayer();
+			const real threshold = n.pos.radius * TerrainRefineFactor * refineScale;
+			refine = d <= threshold;
+			schedule(n, key, max(abs(d - threshold), real(1e-3)));
+		}
+
+		if (!refine)
 		{
-			pos.visible = true;
-			tilesRequests.insert(pos);
+			removeChildren(n);
+			setState(n, NodeStateEnum::Leaf);
+			setVisible(n, true);
 			return;
 		}
 
-		auto cs = children(pos);
+		const auto cs = children(n.pos);
+		if (n.state == NodeStateEnum::Placeholder || n.state == NodeStateEnum::Leaf)
+		{
+			for (const TilePos &c : cs)
+				addNode(c, key);
+			setState(n, NodeStateEnum::Pending);
+		}
+
 		bool ok = true;
-		for (const auto &p : cs)
-			ok = ok && tilesReady.count(p) > 0;
+		for (const TilePos &c : cs)
+			ok = ok && readyTiles.count(c.key()) > 0;
+
 		if (ok)
 		{
-			for (const auto &p : cs)
-				traverse(p, tilesRequests, tilesReady);
+			setVisible(n, false);
+			if (n.state == NodeStateEnum::Pending)
+			{
+				setState(n, NodeStateEnum::Refined);
+				for (const TilePos &c : cs)
+					evaluate(c.key());
+			}
 		}
 		else
 		{
-			for (auto &p : cs)
+			if (n.state == NodeStateEnum::Refined)
 			{
-				p.visible = false;
-				tilesRequests.insert(p);
+				for (const TilePos &c : cs)
+				{
+					Node &cn = nodes[c.key()];
+					removeChildren(cn);
+					cn.generation++;
+					setState(cn, NodeStateEnum::Placeholder);
+					setVisible(cn, false);
+				}
+				setState(n, NodeStateEnum::Pending);
 			}
+			setVisible(n, true);
 		}
-		pos.visible = !ok;
-		tilesRequests.insert(pos);
 	}
-}
 
-std::set<TilePos> findNeededTiles(const std::set<TilePos> &tilesReady)
-{
-	OPTICK_EVENT("findNeededTiles");
-	std::set<TilePos> tilesRequests;
-	TilePos pt;
-	constexpr sint32 TileSize = 32;
-	pt.pos[0] = numeric_cast<sint32>(playerPosition[0] / TileSize) * TileSize;
-	pt.pos[1] = numeric_cast<sint32>(playerPosition[1] / TileSize) * TileSize;
-	pt.pos[2] = numeric_cast<sint32>(playerPosition[2] / TileSize) * TileSize;
-	constexpr sint32 Range = 2;
-	for (sint32 z = -Range; z <= Range; z += 1)
+	void updateRoots()
 	{
-		for (sint32 y = -Range; y <= Range; y += 1)
+		ivec3 center;
+		for (uint32 i = 0; i < 3; i++)
+			center[i] = numeric_cast<sint32>(playerPosition[i] / TileSize) * TileSize;
+		if (rootsValid && center == rootsCenter)
+			return;
+		rootsCenter = center;
+		rootsValid = true;
+
+		std::vector<uint64> newRoots;
+		newRoots.reserve((2 * Range + 1) * (2 * Range + 1) * (2 * Range + 1));
+		for (sint32 z = -Range; z <= Range; z += 1)
 		{
-			for (sint32 x = -Range; x <= Range; x += 1)
+			for (sint32 y = -Range; y <= Range; y += 1)
 			{
-				TilePos r(pt);
-				r.radius = TileSize / 2;
-				r.pos[0] += TileSize * x;
-				r.pos[1] += TileSize * y;
-				r.pos[2] += TileSize * z;
-				traverse(r, tilesRequests, tilesReady);
+				for (sint32 x = -Range; x <= Range; x += 1)
+				{
+					TilePos r;
+					r.radius = TileSize / 2;
+					r.pos = center + ivec3(x, y, z) * TileSize;
+					const uint64 key = r.key();
+					newRoots.push_back(key);
+					if (nodes.count(key) == 0)
+					{
+						addNode(r, 0);
+						evaluate(key);
+					}
+				}
 			}
 		}
+
+		std::sort(newRoots.begin(), newRoots.end());
+		for (uint64 key : roots)
+			if (!std::binary_search(newRoots.begin(), newRoots.end(), key))
+				removeNode(key);
+		std::swap(roots, newRoots);
+	}
+
+	// requests the tiles that the tree would need if the player was at the given position
+	// only the chain of tiles containing the position, and their siblings, is considered
+	void prefetchPosition(const vec3 &position, std::unordered_map<uint64, TilePos> &result)
+	{
+		TilePos n;
+		n.radius = TileSize / 2;
+		n.visible = false;
+		for (uint32 i = 0; i < 3; i++)
+			n.pos[i] = numeric_cast<sint32>(round(position[i] / TileSize)) * TileSize;
+		result[n.key()] = n;
+		while (n.radius > MinRadius && n.distance(position) <= n.radius * TerrainRefineFactor * refineScale)
+		{
+			const auto cs = children(n);
+			for (const TilePos &c : cs)
+				result[c.key()] = c;
+			uint32 index = 0;
+			for (uint32 i = 0; i < 3; i++)
+				if (position[i] >= n.pos[i])
+					index += 1 << i;
+			n = cs[index];
+		}
+	}
+
+	void updatePrefetch()
+	{
+		std::unordered_map<uint64, TilePos> next;
+		if (confPrefetchEnabled && lengthSquared(playerSpeed) > 1e-8)
+		{
+			const uint32 samples = max((uint32)confPrefetchSamples, 1u);
+			const real step = real(confPrefetchHorizon) / samples;
+			for (uint32 i = 1; i <= samples; i++)
+				prefetchPosition(playerPosition + playerSpeed * (step * real(i)), next);
+		}
+		if (next.empty() && prefetched.empty())
+			return;
+
+		for (const auto &it : prefetched)
+			if (next.count(it.first) == 0 && nodes.count(it.first) == 0)
+				emit(it.second, TileChangeEnum::Remove, true);
+		for (const auto &it : next)
+			if (prefetched.count(it.first) == 0 && nodes.count(it.first) == 0)
+				emit(it.second, TileChangeEnum::Add, true);
+		std::swap(prefetched, next);
+	}
+}
+
+void neededTileReady(const TilePos &pos, bool ready)
+{
+	const uint64 key = pos.key();
+	if (ready)
+		readyTiles.insert(key);
+	else
+		readyTiles.erase(key);
+	auto it = nodes.find(key);
+	if (it != nodes.end() && it->second.parent)
+		dirtyNodes.insert(it->second.parent);
+}
+
+void updateNeededTiles(std::vector<TileChange> &changesOutput)
+{
+	OPTICK_EVENT("updateNeededTiles");
+	changes = &changesOutput;
+
+	traveled += distance(lastPlayerPosition, playerPosition).value;
+	lastPlayerPosition = playerPosition;
+
+	updateRoots();
+
+	if (refineScaleChanged)
+	{
+		// all evaluated nodes need to test their distance again
+		for (const auto &it : nodes)
+			if (it.second.state != NodeStateEnum::Placeholder)
+				dirtyNodes.insert(it.first);
+		refineScaleChanged = false;
+	}
+
+	for (uint64 key : dirtyNodes)
+	{
+		auto it = nodes.find(key);
+		if (it != nodes.end() && it->second.state != NodeStateEnum::Placeholder) // placeholders are evaluated by their parents
+			evaluate(key);
+	}
+	dirtyNodes.clear();
+
+	while (!evaluations.empty() && evaluations.front().due <= traveled)
+	{
+		const Evaluation e = evaluations.front();
+		std::pop_heap(evaluations.begin(), evaluations.end());
+		evaluations.pop_back();
+		auto it = nodes.find(e.key);
+		if (it != nodes.end() && it->second.generation == e.generation)
+			evaluate(e.key);
+	}
+
+	updatePrefetch();
+
+	statistics.ticks++;
+	if (pendingNodes > 0)
+		statistics.coarseTicks++;
+	statistics.pendingNodeTicks += pendingNodes;
+
+	changes = nullptr;
+	//CAGE_LOG_DEBUG(SeverityEnum::Info, "terrain", stringizer() + "ready: " + readyTiles.size() + ", requested: " + nodes.size() + ", changes: " + changesOutput.size());
+	terrainGenerationProgress = nodes.empty() ? real() : real(readyTiles.size()) / nodes.size();
+}
+
+void terrainRefineScale(real scale)
+{
+	CAGE_ASSERT(scale > 0 && scale <= 1);
+	if (scale == refineScale)
+		return;
+	refineScale = scale;
+	refineScaleChanged = true;
+}
+
+real terrainRefineScale()
+{
+	return refineScale;
+}
+
+void clearNeededTiles(std::vector<TileChange> &changesOutput)
+{
+	changes = &changesOutput;
+	std::unordered_map<uint64, TilePos> pf;
+	std::swap(pf, prefetched);
+	for (const auto &it : pf)
+		if (nodes.count(it.first) == 0)
+			emit(it.second, TileChangeEnum::Remove, true);
+	for (uint64 key : roots)
+		removeNode(key);
+	changes = nullptr;
+	CAGE_ASSERT(nodes.empty());
+	CAGE_ASSERT(pendingNodes == 0);
+
+	if (statistics.ticks > 0)
+	{
+		CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "ticks with coarse tiles: " + (100.0 * statistics.coarseTicks / statistics.ticks) + " %, average coarse tiles: " + (double(statistics.pendingNodeTicks) / statistics.ticks) + ", prefetch: " + (bool)confPrefetchEnabled);
+		statistics = Statistics();
 	}
-	//CAGE_LOG_DEBUG(SeverityEnum::Info, "terrain", stringizer() + "ready: " + tilesReady.size() + ", requested: " + tilesRequests.size());
-	terrainGenerationProgress = tilesRequests.empty() ? real() : real(tilesReady.size()) / tilesRequests.size();
-	return tilesRequests;
+	roots.clear();
+	evaluations.clear();
+	dirtyNodes.clear();
+	rootsValid = false;
 }
@@ -0,0 +1,64 @@
+#include "terrain.h"
+
+#include <cage-core/config.h>
+
+namespace
+{
+	ConfigUint32 confQuality("flittermouse/terrain/quality", 1); // 0 = low, 1 = medium, 2 = high
+	ConfigBool confAdaptive("flittermouse/terrain/lod/adaptive", true); // false = same resolution for all tiles
+	ConfigUint32 confScreenHeight("flittermouse/terrain/lod/screenHeight", 1080);
+
+	const rads CameraFov = degs(60); // default perspective of the camera
+
+	struct QualityTier
+	{
+		real pixelsPerVoxel;
+		real texelsPerPixel;
+		uint32 minGrid;
+		uint32 maxGrid;
+		real minTexelsPerUnit;
+		real maxTexelsPerUnit;
+		uint32 maxTextureResolution;
+	};
+
+	const QualityTier Tiers[3] = {
+		{ 48, 0.10, 8, 24, 8, 32, 1024 }, // low
+		{ 32, 0.15, 12, 32, 8, 50, 2048 }, // medium
+		{ 20, 0.25, 16, 40, 12, 64, 2048 }, // high
+	};
+
+	constexpr uint32 FixedPolicy = 3;
+}
+
+uint32 terrainLodPolicy()
+{
+	if (!confAdaptive)
+		return FixedPolicy;
+	return min((uint32)confQuality, 2u);
+}
+
+real terrainProjectedSize(const TilePos &tilePos)
+{
+	// coarser tiles are replaced by their children when the player comes closer than RefineFactor * radius
+	// that distance scales with the radius, therefore all the coarser levels cover the same pixels and get the same resolution, only the finest level differs
+	// the finest tiles are never replaced, they are assumed to be seen from a distance of their own diameter
+	// that is twice the pixels of the coarser levels, at medium and high quality their grid is denser than the fixed policy (29 and 40 samples against 24 at 1080p)
+	const real r = tilePos.radius;
+	const real dist = tilePos.radius > TerrainMinTileRadius ? r * TerrainRefineFactor : r * 2;
+	const real focal = real(confScreenHeight) * 0.5 / tan(CameraFov * 0.5);
+	return 2 * r / dist * focal;
+}
+
+TerrainLod terrainLod(const TilePos &tilePos)
+{
+	const uint32 policy = terrainLodPolicy();
+	if (policy == FixedPolicy)
+		return TerrainLod();
+	const QualityTier &q = Tiers[policy];
+	const real px = terrainProjectedSize(tilePos);
+	TerrainLod lod;
+	lod.gridResolution = clamp(numeric_cast<uint32>(px / q.pixelsPerVoxel), q.minGrid, q.maxGrid);
+	lod.texelsPerUnit = clamp(px * q.texelsPerPixel * 0.5, q.minTexelsPerUnit, q.maxTexelsPerUnit).value; // the tile spans 2 local units
+	lod.maxTextureResolution = q.maxTextureResolution;
+	return lod;
+}
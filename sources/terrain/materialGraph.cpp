@@ -0,0 +1,754 @@
+#include "materialGraph.h"
+
+#include <cage-core/noiseFunction.h>
+#include <cage-core/color.h>
+
+#include <algorithm>
+#include <queue>
+
+bool MaterialNode::operator == (const MaterialNode &other) const
+{
+	return op == other.op && width == other.width && param == other.param && noise == other.noise && function == other.function && constant == other.constant && inputs == other.inputs && table == other.table;
+}
+
+namespace
+{
+	struct Literal
+	{
+		uint32 node = m;
+		bool positive = true;
+
+		bool operator == (const Literal &other) const
+		{
+			return node == other.node && positive == other.positive;
+		}
+	};
+
+	typedef std::vector<Literal> Term;
+	typedef std::vector<Term> Guard;
+
+	constexpr uint32 MaxTerms = 8; // larger guards are relaxed to always
+
+	// the condition under which the input of the node is needed
+	bool edgeLiteral(const MaterialNode &n, uint32 slot, Literal &l)
+	{
+		switch (n.op)
+		{
+		case MaterialOpEnum::Select:
+			if (slot == 0)
+				return false;
+			l.node = n.inputs[0];
+			l.positive = slot == 1;
+			return true;
+		case MaterialOpEnum::Mix:
+			if (slot >= 2)
+				return false;
+			l.node = n.inputs[3 + slot]; // f == 1 for a, f == 0 for b
+			l.positive = false;
+			return true;
+		case MaterialOpEnum::Choose:
+			if (slot == 0 || slot > n.param)
+				return false;
+			l.node = n.inputs[n.param + slot];
+			l.positive = true;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool contains(const Term &t, const Literal &l)
+	{
+		return std::find(t.begin(), t.end(), l) != t.end();
+	}
+
+	bool subset(const Term &a, const Term &b)
+	{
+		for (const Literal &l : a)
+			if (!contains(b, l))
+				return false;
+		return true;
+	}
+
+	bool contradictory(const Term &t)
+	{
+		for (const Literal &l : t)
+			if (contains(t, Literal{ l.node, !l.positive }))
+				return true;
+		return false;
+	}
+
+	bool dependsOn(const std::vector<MaterialNode> &nodes, uint32 node, uint32 target, std::vector<bool> &visited)
+	{
+		if (node == target)
+			return true;
+		if (node < target || visited[node])
+			return false; // inputs always precede their consumers
+		visited[node] = true;
+		for (uint32 i : nodes[node].inputs)
+			if (dependsOn(nodes, i, target, visited))
+				return true;
+		return false;
+	}
+
+	void simplify(const std::vector<MaterialNode> &nodes, uint32 node, Guard &g)
+	{
+		for (Term &t : g)
+		{
+			// a condition computed from this node cannot gate it, cut the term there (which relaxes it)
+			for (uint32 i = 0; i < t.size(); i++)
+			{
+				std::vector<bool> visited(nodes.size());
+				if (dependsOn(nodes, t[i].node, node, visited))
+				{
+					t.resize(i);
+					break;
+				}
+			}
+		}
+		g.erase(std::remove_if(g.begin(), g.end(), &contradictory), g.end());
+		std::sort(g.begin(), g.end(), [](const Term &a, const Term &b) { return a.size() < b.size(); });
+		Guard r;
+		for (const Term &t : g)
+		{
+			bool absorbed = false;
+			for (const Term &k : r)
+				absorbed = absorbed || subset(k, t);
+			if (!absorbed)
+				r.push_back(t);
+		}
+		if (r.size() > MaxTerms)
+			r = Guard(1);
+		std::swap(g, r);
+	}
+
+	struct Mask
+	{
+		uint32 lanes[MaterialBatchSize];
+		uint32 count = 0;
+		bool computed = false;
+	};
+
+	template<class F>
+	void forLanes(const Mask &mask, uint32 count, F f)
+	{
+		if (mask.count == count)
+		{
+			for (uint32 i = 0; i < count; i++)
+				f(i);
+		}
+		else
+		{
+			for (uint32 k = 0; k < mask.count; k++)
+				f(mask.lanes[k]);
+		}
+	}
+
+	uint32 laneIndex(real v, uint32 limit)
+	{
+		return min(uint32(max(v.value, 0.f)), limit - 1);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// GRAPH
+/////////////////////////////////////////////////////////////////////////////
+
+MaterialValue MaterialGraph::add(MaterialNode &&n)
+{
+	for (uint32 i : n.inputs)
+		CAGE_ASSERT(i < nodes.size());
+	for (uint32 i = 0; i < nodes.size(); i++)
+		if (nodes[i] == n)
+			return { this, i };
+	nodes.push_back(std::move(n));
+	return { this, numeric_cast<uint32>(nodes.size() - 1) };
+}
+
+uint32 MaterialGraph::width(MaterialValue v) const
+{
+	CAGE_ASSERT(v.graph == this);
+	return nodes[v.node].width;
+}
+
+MaterialValue MaterialGraph::scalar(real v)
+{
+	return constant(v);
+}
+
+MaterialValue MaterialGraph::constant(real v)
+{
+	MaterialNode n;
+	n.op = MaterialOpEnum::Constant;
+	n.constant = vec3(v);
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::constant(const vec3 &v)
+{
+	MaterialNode n;
+	n.op = MaterialOpEnum::Constant;
+	n.constant = v;
+	n.width = 3;
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::position()
+{
+	MaterialNode n;
+	n.op = MaterialOpEnum::Position;
+	n.width = 3;
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::noise(const Holder<NoiseFunction> &noise, MaterialValue p)
+{
+	CAGE_ASSERT(width(p) == 3);
+	MaterialNode n;
+	n.op = MaterialOpEnum::Noise;
+	n.noise = +noise;
+	n.inputs = { p.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::combine(MaterialValue x, MaterialValue y, MaterialValue z)
+{
+	CAGE_ASSERT(width(x) == 1 && width(y) == 1 && width(z) == 1);
+	MaterialNode n;
+	n.op = MaterialOpEnum::Combine;
+	n.width = 3;
+	n.inputs = { x.node, y.node, z.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::component(MaterialValue v, uint32 index)
+{
+	CAGE_ASSERT(index < 3);
+	if (width(v) == 1)
+		return v;
+	MaterialNode n;
+	n.op = MaterialOpEnum::Component;
+	n.param = index;
+	n.inputs = { v.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::binary(MaterialOpEnum op, MaterialValue a, MaterialValue b)
+{
+	const uint32 wa = width(a), wb = width(b);
+	CAGE_ASSERT(wa == wb || wa == 1 || wb == 1);
+	MaterialNode n;
+	n.op = op;
+	switch (op)
+	{
+	case MaterialOpEnum::Less:
+	case MaterialOpEnum::Greater:
+	case MaterialOpEnum::Equal:
+		CAGE_ASSERT(wa == 1 && wb == 1);
+		break;
+	default:
+		CAGE_ASSERT(op >= MaterialOpEnum::Add && op <= MaterialOpEnum::Pow);
+		break;
+	}
+	n.width = max(wa, wb);
+	n.inputs = { a.node, b.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::floor(MaterialValue v)
+{
+	MaterialNode n;
+	n.op = MaterialOpEnum::Floor;
+	n.width = width(v);
+	n.inputs = { v.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::hsvToRgb(MaterialValue v)
+{
+	CAGE_ASSERT(width(v) == 3);
+	MaterialNode n;
+	n.op = MaterialOpEnum::HsvToRgb;
+	n.width = 3;
+	n.inputs = { v.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::rgbToHsv(MaterialValue v)
+{
+	CAGE_ASSERT(width(v) == 3);
+	MaterialNode n;
+	n.op = MaterialOpEnum::RgbToHsv;
+	n.width = 3;
+	n.inputs = { v.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::gradient(MaterialValue index, MaterialValue fraction, PointerRange<const vec3> stops, bool cyclic)
+{
+	CAGE_ASSERT(width(index) == 1 && width(fraction) == 1);
+	CAGE_ASSERT(stops.size() >= 2);
+	MaterialNode n;
+	n.op = MaterialOpEnum::Gradient;
+	n.width = 3;
+	n.param = cyclic;
+	n.table = std::vector<vec3>(stops.begin(), stops.end());
+	n.inputs = { index.node, fraction.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::select(MaterialValue condition, MaterialValue a, MaterialValue b)
+{
+	CAGE_ASSERT(width(condition) == 1);
+	if (a.node == b.node)
+		return a;
+	MaterialNode n;
+	n.op = MaterialOpEnum::Select;
+	n.width = max(width(a), width(b));
+	n.inputs = { condition.node, a.node, b.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::mix(MaterialValue a, MaterialValue b, MaterialValue f)
+{
+	CAGE_ASSERT(width(f) == 1);
+	if (a.node == b.node)
+		return a;
+	const MaterialValue ca = binary(MaterialOpEnum::Equal, f, scalar(1));
+	const MaterialValue cb = binary(MaterialOpEnum::Equal, f, scalar(0));
+	MaterialNode n;
+	n.op = MaterialOpEnum::Mix;
+	n.width = max(width(a), width(b));
+	n.inputs = { a.node, b.node, f.node, ca.node, cb.node };
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::choose(MaterialValue index, std::initializer_list<MaterialValue> options)
+{
+	CAGE_ASSERT(width(index) == 1);
+	CAGE_ASSERT(options.size() > 0);
+	std::vector<uint32> conditions;
+	for (uint32 i = 0; i < options.size(); i++)
+		conditions.push_back(binary(MaterialOpEnum::Equal, index, scalar(i)).node);
+	MaterialNode n;
+	n.op = MaterialOpEnum::Choose;
+	n.param = numeric_cast<uint32>(options.size());
+	n.inputs.push_back(index.node);
+	for (MaterialValue o : options)
+	{
+		n.inputs.push_back(o.node);
+		n.width = max(n.width, width(o));
+	}
+	n.inputs.insert(n.inputs.end(), conditions.begin(), conditions.end());
+	return add(std::move(n));
+}
+
+MaterialValue MaterialGraph::custom(MaterialCustomFunction function, std::initializer_list<MaterialValue> inputs, uint32 width)
+{
+	CAGE_ASSERT(inputs.size() <= 16);
+	CAGE_ASSERT(width == 1 || width == 3);
+	MaterialNode n;
+	n.op = MaterialOpEnum::Custom;
+	n.function = function;
+	n.width = width;
+	for (MaterialValue i : inputs)
+		n.inputs.push_back(i.node);
+	return add(std::move(n));
+}
+
+MaterialProgram MaterialGraph::compile(std::initializer_list<MaterialValue> outputs) const
+{
+	const uint32 cnt = numeric_cast<uint32>(nodes.size());
+
+	// guards: under which conditions is each node needed
+	// consumers always follow their inputs, therefore walking backwards finalizes each guard before it is propagated
+	std::vector<Guard> guards(cnt);
+	std::vector<bool> reachable(cnt);
+	for (MaterialValue o : outputs)
+	{
+		CAGE_ASSERT(o.graph == this);
+		guards[o.node] = Guard(1);
+		reachable[o.node] = true;
+	}
+	for (uint32 n = cnt; n-- > 0;)
+	{
+		if (!reachable[n])
+			continue;
+		simplify(nodes, n, guards[n]);
+		const MaterialNode &node = nodes[n];
+		for (uint32 s = 0; s < node.inputs.size(); s++)
+		{
+			const uint32 i = node.inputs[s];
+			reachable[i] = true;
+			Literal l;
+			const bool conditional = edgeLiteral(node, s, l);
+			for (const Term &t : guards[n])
+			{
+				Term u = t;
+				if (conditional && !contains(u, l))
+					u.push_back(l);
+				guards[i].push_back(std::move(u));
+			}
+		}
+	}
+
+	// scheduling: data inputs and guard conditions must precede the node
+	std::vector<std::vector<uint32>> dependents(cnt);
+	std::vector<uint32> pending(cnt);
+	std::priority_queue<uint32, std::vector<uint32>, std::greater<uint32>> ready;
+	uint32 reachableCount = 0;
+	for (uint32 n = 0; n < cnt; n++)
+	{
+		if (!reachable[n])
+			continue;
+		reachableCount++;
+		std::vector<uint32> deps = nodes[n].inputs;
+		for (const Term &t : guards[n])
+			for (const Literal &l : t)
+				deps.push_back(l.node);
+		std::sort(deps.begin(), deps.end());
+		deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+		for (uint32 d : deps)
+			dependents[d].push_back(n);
+		pending[n] = numeric_cast<uint32>(deps.size());
+		if (pending[n] == 0)
+			ready.push(n);
+	}
+	std::vector<uint32> order;
+	order.reserve(reachableCount);
+	while (!ready.empty())
+	{
+		const uint32 n = ready.top();
+		ready.pop();
+		order.push_back(n);
+		for (uint32 d : dependents[n])
+			if (--pending[d] == 0)
+				ready.push(d);
+	}
+	if (order.size() != reachableCount)
+		CAGE_THROW_ERROR(Exception, "cyclic conditions in material graph");
+
+	// register allocation: registers are released after the last instruction that reads them
+	std::vector<uint32> position(cnt, m);
+	for (uint32 p = 0; p < order.size(); p++)
+		position[order[p]] = p;
+	std::vector<uint32> lastUse(cnt, 0);
+	for (uint32 p = 0; p < order.size(); p++)
+	{
+		const uint32 n = order[p];
+		for (uint32 i : nodes[n].inputs)
+			lastUse[i] = max(lastUse[i], p);
+		for (const Term &t : guards[n])
+			for (const Literal &l : t)
+				lastUse[l.node] = max(lastUse[l.node], p);
+	}
+	for (MaterialValue o : outputs)
+		lastUse[o.node] = m;
+
+	MaterialProgram prog;
+	prog.guards.push_back({ {} });
+	std::vector<uint32> freeRegs[2]; // scalars, vectors
+	std::vector<uint32> regs(cnt);
+	for (uint32 p = 0; p < order.size(); p++)
+	{
+		const uint32 n = order[p];
+		MaterialProgram::Instruction ins;
+		ins.node = nodes[n];
+		for (uint32 &i : ins.node.inputs)
+			i = position[i];
+
+		// guard
+		MaterialProgram::Guard g;
+		for (const Term &t : guards[n])
+		{
+			MaterialProgram::Term u;
+			for (const Literal &l : t)
+				u.push_back({ position[l.node], l.positive });
+			g.push_back(std::move(u));
+		}
+		ins.guard = m;
+		for (uint32 i = 0; i < prog.guards.size() && ins.guard == m; i++)
+		{
+			const MaterialProgram::Guard &k = prog.guards[i];
+			bool same = k.size() == g.size();
+			for (uint32 j = 0; same && j < g.size(); j++)
+			{
+				same = k[j].size() == g[j].size();
+				for (uint32 l = 0; same && l < g[j].size(); l++)
+					same = k[j][l].node == g[j][l].node && k[j][l].positive == g[j][l].positive;
+			}
+			if (same)
+				ins.guard = i;
+		}
+		if (ins.guard == m)
+		{
+			ins.guard = numeric_cast<uint32>(prog.guards.size());
+			prog.guards.push_back(std::move(g));
+		}
+
+		// registers
+		std::vector<uint32> &fr = freeRegs[ins.node.width == 3];
+		if (fr.empty())
+		{
+			ins.reg = prog.registers;
+			prog.registers += ins.node.width;
+		}
+		else
+		{
+			ins.reg = fr.back();
+			fr.pop_back();
+		}
+		regs[n] = ins.reg;
+		prog.instructions.push_back(std::move(ins));
+
+		std::vector<uint32> released = nodes[n].inputs;
+		for (const Term &t : guards[n])
+			for (const Literal &l : t)
+				released.push_back(l.node);
+		std::sort(released.begin(), released.end());
+		released.erase(std::unique(released.begin(), released.end()), released.end());
+		for (uint32 i : released)
+			if (lastUse[i] == p)
+				freeRegs[nodes[i].width == 3].push_back(regs[i]);
+	}
+
+	for (MaterialValue o : outputs)
+		for (uint32 c = 0; c < nodes[o.node].width; c++)
+			prog.outputs.push_back({ position[o.node], c });
+	return prog;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// PROGRAM
+/////////////////////////////////////////////////////////////////////////////
+
+void MaterialProgram::evaluate(const real *x, const real *y, const real *z, uint32 count, PointerRange<real *const> outputsData) const
+{
+	CAGE_ASSERT(count <= MaterialBatchSize);
+	CAGE_ASSERT(outputsData.size() == outputs.size());
+	if (count == 0)
+		return;
+
+	thread_local std::vector<real> regsStorage;
+	thread_local std::vector<Mask> masksStorage;
+	regsStorage.resize(registers * MaterialBatchSize);
+	masksStorage.resize(guards.size());
+	for (Mask &k : masksStorage)
+		k.computed = false;
+
+	const auto &reg = [&](uint32 instruction, uint32 component) -> real *
+	{
+		const Instruction &ins = instructions[instruction];
+		return regsStorage.data() + (ins.reg + min(component, ins.node.width - 1)) * MaterialBatchSize;
+	};
+
+	const auto &mask = [&](uint32 guard) -> const Mask &
+	{
+		Mask &k = masksStorage[guard];
+		if (k.computed)
+			return k;
+		k.computed = true;
+		k.count = 0;
+		const Guard &g = guards[guard];
+		for (uint32 lane = 0; lane < count; lane++)
+		{
+			bool any = false;
+			for (const Term &t : g)
+			{
+				bool all = true;
+				for (const Literal &l : t)
+				{
+					// literals are ordered such that each condition is only read on lanes where it was computed
+					if ((reg(l.node, 0)[lane] != 0) != l.positive)
+					{
+						all = false;
+						break;
+					}
+				}
+				if (all)
+				{
+					any = true;
+					break;
+				}
+			}
+			if (any)
+				k.lanes[k.count++] = lane;
+		}
+		return k;
+	};
+
+	for (uint32 index = 0; index < instructions.size(); index++)
+	{
+		const Instruction &ins = instructions[index];
+		const MaterialNode &n = ins.node;
+		const Mask &k = mask(ins.guard);
+		if (k.count == 0)
+			continue;
+		real *out[3] = { reg(index, 0), reg(index, 1), reg(index, 2) };
+		const auto &in = [&](uint32 slot, uint32 component) -> const real *
+		{
+			return reg(n.inputs[slot], component);
+		};
+
+		switch (n.op)
+		{
+		case MaterialOpEnum::Constant:
+			for (uint32 c = 0; c < n.width; c++)
+				forLanes(k, count, [&](uint32 i) { out[c][i] = n.constant[c]; });
+			break;
+		case MaterialOpEnum::Position:
+			forLanes(k, count, [&](uint32 i) {
+				out[0][i] = x[i];
+				out[1][i] = y[i];
+				out[2][i] = z[i];
+			});
+			break;
+		case MaterialOpEnum::Noise:
+		{
+			const real *p[3] = { in(0, 0), in(0, 1), in(0, 2) };
+			if (k.count == count)
+				n.noise->evaluate({ p[0], p[0] + count }, { p[1], p[1] + count }, { p[2], p[2] + count }, { out[0], out[0] + count });
+			else
+			{
+				real tmp[4][MaterialBatchSize];
+				for (uint32 j = 0; j < k.count; j++)
+					for (uint32 c = 0; c < 3; c++)
+						tmp[c][j] = p[c][k.lanes[j]];
+				n.noise->evaluate({ tmp[0], tmp[0] + k.count }, { tmp[1], tmp[1] + k.count }, { tmp[2], tmp[2] + k.count }, { tmp[3], tmp[3] + k.count });
+				for (uint32 j = 0; j < k.count; j++)
+					out[0][k.lanes[j]] = tmp[3][j];
+			}
+		} break;
+		case MaterialOpEnum::Combine:
+			for (uint32 c = 0; c < 3; c++)
+			{
+				const real *a = in(c, 0);
+				forLanes(k, count, [&](uint32 i) { out[c][i] = a[i]; });
+			}
+			break;
+		case MaterialOpEnum::Component:
+		{
+			const real *a = in(0, n.param);
+			forLanes(k, count, [&](uint32 i) { out[0][i] = a[i]; });
+		} break;
+#define GCHL_BINARY(OP, EXPR) \
+		case MaterialOpEnum::OP: \
+			for (uint32 c = 0; c < n.width; c++) \
+			{ \
+				const real *a = in(0, c); \
+				const real *b = in(1, c); \
+				forLanes(k, count, [&](uint32 i) { out[c][i] = EXPR; }); \
+			} \
+			break;
+		GCHL_BINARY(Add, a[i] + b[i])
+		GCHL_BINARY(Sub, a[i] - b[i])
+		GCHL_BINARY(Mul, a[i] * b[i])
+		GCHL_BINARY(Div, a[i] / b[i])
+		GCHL_BINARY(Mod, a[i] % b[i])
+		GCHL_BINARY(Min, min(a[i], b[i]))
+		GCHL_BINARY(Max, max(a[i], b[i]))
+		GCHL_BINARY(Pow, pow(a[i], b[i]))
+		GCHL_BINARY(Less, a[i] < b[i] ? 1 : 0)
+		GCHL_BINARY(Greater, a[i] > b[i] ? 1 : 0)
+		GCHL_BINARY(Equal, a[i] == b[i] ? 1 : 0)
+#undef GCHL_BINARY
+		case MaterialOpEnum::Floor:
+			for (uint32 c = 0; c < n.width; c++)
+			{
+				const real *a = in(0, c);
+				forLanes(k, count, [&](uint32 i) { out[c][i] = cage::floor(a[i]); });
+			}
+			break;
+		case MaterialOpEnum::HsvToRgb:
+		case MaterialOpEnum::RgbToHsv:
+		{
+			const real *a[3] = { in(0, 0), in(0, 1), in(0, 2) };
+			const bool toRgb = n.op == MaterialOpEnum::HsvToRgb;
+			forLanes(k, count, [&](uint32 i) {
+				const vec3 v = vec3(a[0][i], a[1][i], a[2][i]);
+				const vec3 r = toRgb ? colorHsvToRgb(v) : colorRgbToHsv(v);
+				for (uint32 c = 0; c < 3; c++)
+					out[c][i] = r[c];
+			});
+		} break;
+		case MaterialOpEnum::Gradient:
+		{
+			const real *idx = in(0, 0);
+			const real *frac = in(1, 0);
+			const uint32 stops = numeric_cast<uint32>(n.table.size());
+			forLanes(k, count, [&](uint32 i) {
+				const uint32 a = laneIndex(idx[i], stops);
+				const uint32 b = n.param ? (a + 1) % stops : min(a + 1, stops - 1);
+				const vec3 r = interpolate(n.table[a], n.table[b], frac[i]);
+				for (uint32 c = 0; c < 3; c++)
+					out[c][i] = r[c];
+			});
+		} break;
+		case MaterialOpEnum::Select:
+			for (uint32 c = 0; c < n.width; c++)
+			{
+				const real *cond = in(0, 0);
+				const real *a = in(1, c);
+				const real *b = in(2, c);
+				forLanes(k, count, [&](uint32 i) { out[c][i] = cond[i] != 0 ? a[i] : b[i]; });
+			}
+			break;
+		case MaterialOpEnum::Mix:
+			for (uint32 c = 0; c < n.width; c++)
+			{
+				const real *a = in(0, c);
+				const real *b = in(1, c);
+				const real *f = in(2, 0);
+				forLanes(k, count, [&](uint32 i) { out[c][i] = f[i] == 1 ? b[i] : f[i] == 0 ? a[i] : interpolate(a[i], b[i], f[i]); });
+			}
+			break;
+		case MaterialOpEnum::Choose:
+			for (uint32 c = 0; c < n.width; c++)
+			{
+				const real *idx = in(0, 0);
+				forLanes(k, count, [&](uint32 i) { out[c][i] = in(1 + laneIndex(idx[i], n.param), c)[i]; });
+			}
+			break;
+		case MaterialOpEnum::Custom:
+			forLanes(k, count, [&](uint32 i) {
+				real args[16];
+				real res[3];
+				for (uint32 s = 0; s < n.inputs.size(); s++)
+					args[s] = in(s, 0)[i];
+				n.function(args, res);
+				for (uint32 c = 0; c < n.width; c++)
+					out[c][i] = res[c];
+			});
+			break;
+		}
+	}
+
+	for (uint32 o = 0; o < outputs.size(); o++)
+	{
+		const real *src = reg(outputs[o].first, outputs[o].second);
+		real *dst = outputsData[o];
+		for (uint32 i = 0; i < count; i++)
+			dst[i] = src[i];
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// OPERATORS
+/////////////////////////////////////////////////////////////////////////////
+
+MaterialValue operator + (MaterialValue a, MaterialValue b) { return a.graph->binary(MaterialOpEnum::Add, a, b); }
+MaterialValue operator - (MaterialValue a, MaterialValue b) { return a.graph->binary(MaterialOpEnum::Sub, a, b); }
+MaterialValue operator * (MaterialValue a, MaterialValue b) { return a.graph->binary(MaterialOpEnum::Mul, a, b); }
+MaterialValue operator / (MaterialValue a, MaterialValue b) { return a.graph->binary(MaterialOpEnum::Div, a, b); }
+MaterialValue operator % (MaterialValue a, MaterialValue b) { return a.graph->binary(MaterialOpEnum::Mod, a, b); }
+MaterialValue operator + (MaterialValue a, real b) { return a + a.graph->constant(b); }
+MaterialValue operator - (MaterialValue a, real b) { return a - a.graph->constant(b); }
+MaterialValue operator * (MaterialValue a, real b) { return a * a.graph->constant(b); }
+MaterialValue operator / (MaterialValue a, real b) { return a / a.graph->constant(b); }
+MaterialValue operator % (MaterialValue a, real b) { return a % a.graph->constant(b); }
+MaterialValue operator < (MaterialValue a, real b) { return a.graph->binary(MaterialOpEnum::Less, a, a.graph->constant(b)); }
+MaterialValue operator > (MaterialValue a, real b) { return a.graph->binary(MaterialOpEnum::Greater, a, a.graph->constant(b)); }
+MaterialValue min(MaterialValue a, real b) { return a.graph->binary(MaterialOpEnum::Min, a, a.graph->constant(b)); }
+MaterialValue max(MaterialValue a, real b) { return a.graph->binary(MaterialOpEnum::Max, a, a.graph->constant(b)); }
+MaterialValue clamp(MaterialValue v, real a, real b) { return min(max(v, a), b); }
+MaterialValue pow(MaterialValue a, real b) { return a.graph->binary(MaterialOpEnum::Pow, a, a.graph->constant(b)); }
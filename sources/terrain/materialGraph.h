@@ -0,0 +1,151 @@
+#ifndef materialGraph_h_gh4k5j6df
+#define materialGraph_h_gh4k5j6df
+
+#include "../common.h"
+
+#include <vector>
+#include <initializer_list>
+
+// small expression graph for describing procedural materials
+// identical nodes are shared when the graph is built (common subexpression elimination)
+// the graph is compiled into a flat program evaluated over batches of positions
+// branches (select, choose, mix) are evaluated only on the lanes that actually need them
+
+constexpr uint32 MaterialBatchSize = 256;
+
+enum class MaterialOpEnum : uint8
+{
+	Constant,
+	Position,
+	Noise,
+	Combine, // three scalars into vector
+	Component, // one scalar from vector
+	Add,
+	Sub,
+	Mul,
+	Div,
+	Mod,
+	Min,
+	Max,
+	Pow,
+	Floor,
+	Less, // 1 or 0
+	Greater,
+	Equal,
+	HsvToRgb,
+	RgbToHsv,
+	Gradient, // interpolation between two consecutive stops of a color table
+	Select, // condition ? a : b
+	Mix, // interpolate(a, b, f), a is skipped where f == 1 and b is skipped where f == 0
+	Choose, // options[index]
+	Custom, // user function evaluated per lane
+};
+
+typedef void (*MaterialCustomFunction)(const real *inputs, real *outputs);
+
+class MaterialGraph;
+
+struct MaterialValue
+{
+	MaterialGraph *graph = nullptr;
+	uint32 node = m;
+};
+
+struct MaterialNode
+{
+	std::vector<uint32> inputs;
+	std::vector<vec3> table; // gradient stops
+	vec3 constant;
+	NoiseFunction *noise = nullptr;
+	MaterialCustomFunction function = nullptr;
+	uint32 width = 1; // 1 or 3 components
+	uint32 param = 0; // component index, cyclic gradient
+	MaterialOpEnum op = MaterialOpEnum::Constant;
+
+	bool operator == (const MaterialNode &other) const;
+};
+
+class MaterialProgram
+{
+public:
+	// evaluates all outputs of the program for the given positions
+	// outputs contains one array (of count elements) for each component of each output
+	void evaluate(const real *x, const real *y, const real *z, uint32 count, PointerRange<real *const> outputs) const;
+
+	uint32 instructionsCount() const { return numeric_cast<uint32>(instructions.size()); }
+	uint32 registersCount() const { return registers; }
+
+private:
+	struct Literal
+	{
+		uint32 node = m;
+		bool positive = true;
+	};
+
+	typedef std::vector<Literal> Term; // conjunction
+	typedef std::vector<Term> Guard; // disjunction, empty term means always
+
+	struct Instruction
+	{
+		MaterialNode node; // inputs are indices of instructions
+		uint32 guard = 0;
+		uint32 reg = 0; // first register of the output
+	};
+
+	std::vector<Instruction> instructions;
+	std::vector<Guard> guards; // guard 0 is always
+	std::vector<std::pair<uint32, uint32>> outputs; // instruction, component
+	uint32 registers = 0;
+
+	friend class MaterialGraph;
+};
+
+class MaterialGraph
+{
+public:
+	MaterialValue constant(real v);
+	MaterialValue constant(const vec3 &v);
+	MaterialValue position();
+	MaterialValue noise(const Holder<NoiseFunction> &noise, MaterialValue p);
+	MaterialValue combine(MaterialValue x, MaterialValue y, MaterialValue z);
+	MaterialValue component(MaterialValue v, uint32 index);
+	MaterialValue binary(MaterialOpEnum op, MaterialValue a, MaterialValue b);
+	MaterialValue floor(MaterialValue v);
+	MaterialValue hsvToRgb(MaterialValue v);
+	MaterialValue rgbToHsv(MaterialValue v);
+	MaterialValue gradient(MaterialValue index, MaterialValue fraction, PointerRange<const vec3> stops, bool cyclic = false);
+	MaterialValue select(MaterialValue condition, MaterialValue a, MaterialValue b);
+	MaterialValue mix(MaterialValue a, MaterialValue b, MaterialValue f);
+	MaterialValue choose(MaterialValue index, std::initializer_list<MaterialValue> options);
+	MaterialValue custom(MaterialCustomFunction function, std::initializer_list<MaterialValue> inputs, uint32 width);
+
+	MaterialProgram compile(std::initializer_list<MaterialValue> outputs) const;
+
+	uint32 nodesCount() const { return numeric_cast<uint32>(nodes.size()); }
+
+private:
+	std::vector<MaterialNode> nodes;
+
+	MaterialValue add(MaterialNode &&n);
+	uint32 width(MaterialValue v) const;
+	MaterialValue scalar(real v);
+};
+
+MaterialValue operator + (MaterialValue a, MaterialValue b);
+MaterialValue operator - (MaterialValue a, MaterialValue b);
+MaterialValue operator * (MaterialValue a, MaterialValue b);
+MaterialValue operator / (MaterialValue a, MaterialValue b);
+MaterialValue operator % (MaterialValue a, MaterialValue b);
+MaterialValue operator + (MaterialValue a, real b);
+MaterialValue operator - (MaterialValue a, real b);
+MaterialValue operator * (MaterialValue a, real b);
+MaterialValue operator / (MaterialValue a, real b);
+MaterialValue operator % (MaterialValue a, real b);
+MaterialValue operator < (MaterialValue a, real b);
+MaterialValue operator > (MaterialValue a, real b);
+MaterialValue min(MaterialValue a, real b);
+MaterialValue max(MaterialValue a, real b);
+MaterialValue clamp(MaterialValue v, real a, real b);
+MaterialValue pow(MaterialValue a, real b);
+
+#endif
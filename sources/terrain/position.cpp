@@ -2,6 +2,21 @@
 
 #include <cage-core/geometry.h>
 
+namespace
+{
+	// spreads the lowest 20 bits so that there are two zero bits between each of them
+	uint64 spreadBits(uint64 v)
+	{
+		v &= 0xfffff;
+		v = (v | (v << 32)) & 0x1f00000000ffff;
+		v = (v | (v << 16)) & 0x1f0000ff0000ff;
+		v = (v | (v << 8)) & 0x100f00f00f00f00f;
+		v = (v | (v << 4)) & 0x10c30c30c30c30c3;
+		v = (v | (v << 2)) & 0x1249249249249249;
+		return v;
+	}
+}
+
 Aabb TilePos::getBox() const
 {
 	return Aabb(vec3(-1), vec3(1)) * getTransform();
@@ -14,12 +29,35 @@ transform TilePos::getTransform() const
 
 real TilePos::distanceToPlayer() const
 {
-	return distance(getBox(), playerPosition);
+	return distance(playerPosition);
+}
+
+real TilePos::distance(const vec3 &position) const
+{
+	return cage::distance(getBox(), position);
+}
+
+uint64 TilePos::key() const
+{
+	// the position is always a multiple of the radius, and the radius is a power of two
+	CAGE_ASSERT(radius > 0 && (radius & (radius - 1)) == 0);
+	uint64 level = 0;
+	while ((1 << level) < radius)
+		level++;
+	CAGE_ASSERT(level < 16);
+	constexpr sint32 Bias = 1 << 19;
+	uint64 m = 0;
+	for (uint32 i = 0; i < 3; i++)
+	{
+		CAGE_ASSERT((pos[i] % radius) == 0);
+		const sint32 c = pos[i] / radius + Bias;
+		CAGE_ASSERT(c >= 0 && c < 2 * Bias);
+		m |= spreadBits(c) << i;
+	}
+	return (level << 60) | m;
 }
 
 bool TilePos::operator < (const TilePos &other) const
 {
-	if (pos == other.pos)
-		return radius < other.radius;
-	return detail::memcmp(&pos, &other.pos, sizeof(pos)) < 0;
+	return key() < other.key();
 }
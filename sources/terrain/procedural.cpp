@@ -1,4 +1,5 @@
 #include "terrain.h"
+#include "materialGraph.h"
 
 #include <cage-core/image.h>
 #include <cage-core/mesh.h>
@@ -7,6 +8,8 @@
 #include <cage-core/noiseFunction.h>
 #include <cage-core/random.h>
 #include <cage-core/color.h>
+#include <cage-core/config.h>
+#include <cage-core/timer.h>
 
 #include <algorithm>
 #include <vector>
@@ -14,7 +17,20 @@
 
 namespace
 {
-	const uint32 GlobalSeed = (uint32)detail::globalRandomGenerator().next();
+	ConfigBool confBatchedDensities("flittermouse/terrain/batchedDensities", true);
+	ConfigBool confBatchedTextures("flittermouse/terrain/batchedTextures", true);
+	ConfigBool confEmptyRejection("flittermouse/terrain/emptyRejection", true);
+	ConfigBool confColliderDecimation("flittermouse/terrain/collider/decimation", true);
+	ConfigFloat confColliderError("flittermouse/terrain/collider/error", 0.05); // world units
+
+	// the seed is persisted in the configuration so that the world (and the tiles cache) stays the same between runs
+	const uint32 GlobalSeed = []() -> uint32
+	{
+		ConfigUint32 seed("flittermouse/terrain/seed", 0);
+		while (seed == 0)
+			seed = (uint32)detail::globalRandomGenerator().next();
+		return seed;
+	}();
 
 	uint32 newSeed()
 	{
@@ -84,125 +100,213 @@ namespace
 		return interpolate(v[i], v[i + 1], f - i);
 	}
 
-	vec3 recolor(const vec3 &color, real deviation, const vec3 &pos)
+	// noise functions of each material, grouped so that the scalar and the batched evaluations share them
+	// the members are created in the same order as the original function-local statics, which keeps the seeds
+
+	struct RecolorNoises
+	{
+		Holder<NoiseFunction> value1 = newValue();
+		Holder<NoiseFunction> value2 = newValue();
+		Holder<NoiseFunction> value3 = newValue();
+	};
+
+	struct DarkRockNoises
+	{
+		Holder<NoiseFunction> clouds1 = newClouds(3);
+		Holder<NoiseFunction> clouds2 = newClouds(3);
+		Holder<NoiseFunction> clouds3 = newClouds(3);
+		Holder<NoiseFunction> clouds4 = newClouds(3);
+		Holder<NoiseFunction> clouds5 = newClouds(3);
+	};
+
+	struct PaperNoises
+	{
+		Holder<NoiseFunction> clouds1 = newClouds(5);
+		Holder<NoiseFunction> clouds2 = newClouds(5);
+		Holder<NoiseFunction> clouds3 = newClouds(5);
+		Holder<NoiseFunction> clouds4 = newClouds(3);
+		Holder<NoiseFunction> clouds5 = newClouds(3);
+		Holder<NoiseFunction> cell1 = newCell(NoiseOperationEnum::Distance2, NoiseDistanceEnum::Euclidean);
+		Holder<NoiseFunction> cell2 = newCell(NoiseOperationEnum::Distance2, NoiseDistanceEnum::Euclidean);
+		Holder<NoiseFunction> cell3 = newCell(NoiseOperationEnum::Distance2, NoiseDistanceEnum::Euclidean);
+	};
+
+	struct SphinxNoises
+	{
+		Holder<NoiseFunction> clouds1 = newClouds(4);
+		Holder<NoiseFunction> clouds2 = newClouds(3);
+	};
+
+	struct WhiteNoises
 	{
-		static Holder<NoiseFunction> value1 = newValue();
-		static Holder<NoiseFunction> value2 = newValue();
-		static Holder<NoiseFunction> value3 = newValue();
+		Holder<NoiseFunction> clouds1 = newClouds(3);
+		Holder<NoiseFunction> clouds2 = newClouds(3);
+		Holder<NoiseFunction> clouds3 = newClouds(3);
+		Holder<NoiseFunction> clouds4 = newClouds(3);
+		Holder<NoiseFunction> value1 = newValue();
+	};
+
+	struct DarkRock1Noises
+	{
+		Holder<NoiseFunction> clouds1 = newClouds(3);
+		Holder<NoiseFunction> clouds2 = newClouds(3);
+		Holder<NoiseFunction> clouds3 = newClouds(3);
+		Holder<NoiseFunction> clouds4 = newClouds(3);
+		Holder<NoiseFunction> clouds5 = newClouds(3);
+		Holder<NoiseFunction> cell1 = newCell(NoiseOperationEnum::Subtract);
+		Holder<NoiseFunction> value1 = newValue();
+	};
+
+	struct WeightsNoises
+	{
+		Holder<NoiseFunction> clouds1 = newClouds(3);
+		Holder<NoiseFunction> clouds2 = newClouds(3);
+		Holder<NoiseFunction> clouds3 = newClouds(3);
+		Holder<NoiseFunction> clouds4 = newClouds(3);
+		Holder<NoiseFunction> clouds5 = newClouds(3);
+	};
+
+	struct TextureNoises
+	{
+		Holder<NoiseFunction> cell1 = newCell(NoiseOperationEnum::Subtract);
+		Holder<NoiseFunction> cell2 = newCell();
+		Holder<NoiseFunction> clouds1 = newClouds(3);
+		Holder<NoiseFunction> clouds2 = newClouds(2);
+	};
+
+	template<class T>
+	T &noises()
+	{
+		static T n;
+		return n;
+	}
+
+	const vec3 sphinxColors[4] = {
+		// https://www.canstockphoto.com/egyptian-sphinx-palette-26815891.html
+		pdnToRgb(31, 34, 96),
+		pdnToRgb(31, 56, 93),
+		pdnToRgb(26, 68, 80),
+		pdnToRgb(21, 69, 55)
+	};
+
+	const vec3 whiteColors[3] = {
+		// https://www.pinterest.com/pin/432908582921844576/
+		pdnToRgb(19, 1, 96),
+		pdnToRgb(14, 3, 88),
+		pdnToRgb(217, 9, 74)
+	};
+
+	const vec3 darkRock1Colors[3] = {
+		pdnToRgb(240, 1, 45),
+		pdnToRgb(230, 5, 41),
+		pdnToRgb(220, 25, 27)
+	};
+
+	const vec3 darkRock1Vein[2] = {
+		pdnToRgb(18, 18, 60),
+		pdnToRgb(21, 22, 49)
+	};
 
-		real h = evaluateClamp(value1, pos) * 0.5 + 0.25;
-		real s = evaluateClamp(value2, pos);
-		real v = evaluateClamp(value3, pos);
+	const vec3 darkRock2Colors[4] = {
+		// https://www.schemecolor.com/rocky-cliff-color-scheme.php
+		pdnToRgb(240, 1, 45),
+		pdnToRgb(230, 6, 35),
+		pdnToRgb(240, 11, 28),
+		pdnToRgb(232, 27, 21)
+	};
+
+	vec3 recolorImpl(const vec3 &color, real deviation, real h, real s, real v)
+	{
+		h = h * 0.5 + 0.25;
 		vec3 hsv = colorRgbToHsv(color) + (vec3(h, s, v) - 0.5) * deviation;
 		hsv[0] = (hsv[0] + 1) % 1;
 		return colorHsvToRgb(clamp(hsv, 0, 1));
 	}
 
-	void darkRockGeneral(const vec3 &pos, vec3 &color, real &roughness, real &metallic, const vec3 *colors, uint32 colorsCount)
+	vec3 recolor(const vec3 &color, real deviation, const vec3 &pos)
 	{
-		static Holder<NoiseFunction> clouds1 = newClouds(3);
-		static Holder<NoiseFunction> clouds2 = newClouds(3);
-		static Holder<NoiseFunction> clouds3 = newClouds(3);
-		static Holder<NoiseFunction> clouds4 = newClouds(3);
-		static Holder<NoiseFunction> clouds5 = newClouds(3);
+		RecolorNoises &n = noises<RecolorNoises>();
+		return recolorImpl(color, deviation, evaluateClamp(n.value1, pos), evaluateClamp(n.value2, pos), evaluateClamp(n.value3, pos));
+	}
 
-		vec3 off = vec3(evaluateClamp(clouds1, pos * 0.065), evaluateClamp(clouds2, pos * 0.104), evaluateClamp(clouds3, pos * 0.083));
-		real f = evaluateClamp(clouds4, pos * 0.0756 + off);
+	vec3 darkRockColor(real f, const vec3 *colors, uint32 colorsCount)
+	{
 		switch (colorsCount)
 		{
-		case 3: color = ninterpolate<3>(colors, f); break;
-		case 4: color = ninterpolate<4>(colors, f); break;
+		case 3: return ninterpolate<3>(colors, f);
+		case 4: return ninterpolate<4>(colors, f);
 		default: CAGE_THROW_CRITICAL(NotImplemented, "unsupported colorsCount");
 		}
+	}
+
+	void darkRockGeneral(const vec3 &pos, vec3 &color, real &roughness, real &metallic, const vec3 *colors, uint32 colorsCount)
+	{
+		DarkRockNoises &n = noises<DarkRockNoises>();
+		vec3 off = vec3(evaluateClamp(n.clouds1, pos * 0.065), evaluateClamp(n.clouds2, pos * 0.104), evaluateClamp(n.clouds3, pos * 0.083));
+		real f = evaluateClamp(n.clouds4, pos * 0.0756 + off);
+		color = darkRockColor(f, colors, colorsCount);
 		color = recolor(color, 0.1, pos * 2.1);
-		roughness = evaluateClamp(clouds5, pos * 1.132) * 0.4 + 0.3;
+		roughness = evaluateClamp(n.clouds5, pos * 1.132) * 0.4 + 0.3;
 		metallic = 0.02;
 	}
 
 	void basePaper(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
 	{
-		static Holder<NoiseFunction> clouds1 = newClouds(5);
-		static Holder<NoiseFunction> clouds2 = newClouds(5);
-		static Holder<NoiseFunction> clouds3 = newClouds(5);
-		static Holder<NoiseFunction> clouds4 = newClouds(3);
-		static Holder<NoiseFunction> clouds5 = newClouds(3);
-		static Holder<NoiseFunction> cell1 = newCell(NoiseOperationEnum::Distance2, NoiseDistanceEnum::Euclidean);
-		static Holder<NoiseFunction> cell2 = newCell(NoiseOperationEnum::Distance2, NoiseDistanceEnum::Euclidean);
-		static Holder<NoiseFunction> cell3 = newCell(NoiseOperationEnum::Distance2, NoiseDistanceEnum::Euclidean);
-
-		vec3 off = vec3(evaluateClamp(cell1, pos * 0.063), evaluateClamp(cell2, pos * 0.063), evaluateClamp(cell3, pos * 0.063));
-		if (evaluateClamp(clouds4, pos * 0.097 + off * 2.2) < 0.6)
+		PaperNoises &n = noises<PaperNoises>();
+		vec3 off = vec3(evaluateClamp(n.cell1, pos * 0.063), evaluateClamp(n.cell2, pos * 0.063), evaluateClamp(n.cell3, pos * 0.063));
+		if (evaluateClamp(n.clouds4, pos * 0.097 + off * 2.2) < 0.6)
 		{ // rock 1
 			color = colorHsvToRgb(vec3(
-				evaluateClamp(clouds1, pos * 0.134) * 0.01 + 0.08,
-				evaluateClamp(clouds2, pos * 0.344) * 0.2 + 0.2,
-				evaluateClamp(clouds3, pos * 0.100) * 0.4 + 0.55
+				evaluateClamp(n.clouds1, pos * 0.134) * 0.01 + 0.08,
+				evaluateClamp(n.clouds2, pos * 0.344) * 0.2 + 0.2,
+				evaluateClamp(n.clouds3, pos * 0.100) * 0.4 + 0.55
 			));
-			roughness = evaluateClamp(clouds5, pos * 0.848) * 0.5 + 0.3;
+			roughness = evaluateClamp(n.clouds5, pos * 0.848) * 0.5 + 0.3;
 			metallic = 0.02;
 		}
 		else
 		{ // rock 2
 			color = colorHsvToRgb(vec3(
-				evaluateClamp(clouds1, pos * 0.321) * 0.02 + 0.094,
-				evaluateClamp(clouds2, pos * 0.258) * 0.3 + 0.08,
-				evaluateClamp(clouds3, pos * 0.369) * 0.2 + 0.59
+				evaluateClamp(n.clouds1, pos * 0.321) * 0.02 + 0.094,
+				evaluateClamp(n.clouds2, pos * 0.258) * 0.3 + 0.08,
+				evaluateClamp(n.clouds3, pos * 0.369) * 0.2 + 0.59
 			));
 			roughness = 0.5;
 			metallic = 0.049;
 		}
 	}
 
-	void baseSphinx(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
+	vec3 sphinxColor(const vec3 &pos, real off)
 	{
-		// https://www.canstockphoto.com/egyptian-sphinx-palette-26815891.html
-
-		static const vec3 colors[4] = {
-			pdnToRgb(31, 34, 96),
-			pdnToRgb(31, 56, 93),
-			pdnToRgb(26, 68, 80),
-			pdnToRgb(21, 69, 55)
-		};
-
-		static Holder<NoiseFunction> clouds1 = newClouds(4);
-		static Holder<NoiseFunction> clouds2 = newClouds(3);
-
-		real off = evaluateClamp(clouds1, pos * 0.0041);
 		real y = (pos[1] * 0.012 + 1000) % 4;
 		real c = (y + off * 2 - 1 + 4) % 4;
 		uint32 i = numeric_cast<uint32>(c);
 		real f = sharpEdge(c - i);
 		if (i < 3)
-			color = interpolate(colors[i], colors[i + 1], f);
+			return interpolate(sphinxColors[i], sphinxColors[i + 1], f);
 		else
-			color = interpolate(colors[3], colors[0], f);
+			return interpolate(sphinxColors[3], sphinxColors[0], f);
+	}
+
+	void baseSphinx(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
+	{
+		SphinxNoises &n = noises<SphinxNoises>();
+		real off = evaluateClamp(n.clouds1, pos * 0.0041);
+		color = sphinxColor(pos, off);
 		color = recolor(color, 0.1, pos * 1.1);
-		roughness = evaluateClamp(clouds2, pos * 0.941) * 0.3 + 0.4;
+		roughness = evaluateClamp(n.clouds2, pos * 0.941) * 0.3 + 0.4;
 		metallic = 0.02;
 	}
 
 	void baseWhite(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
 	{
-		// https://www.pinterest.com/pin/432908582921844576/
-
-		static const vec3 colors[3] = {
-			pdnToRgb(19, 1, 96),
-			pdnToRgb(14, 3, 88),
-			pdnToRgb(217, 9, 74)
-		};
-
-		static Holder<NoiseFunction> clouds1 = newClouds(3);
-		static Holder<NoiseFunction> clouds2 = newClouds(3);
-		static Holder<NoiseFunction> clouds3 = newClouds(3);
-		static Holder<NoiseFunction> clouds4 = newClouds(3);
-		static Holder<NoiseFunction> value1 = newValue();
-
-		vec3 off = vec3(evaluateClamp(clouds1, pos * 0.1), evaluateClamp(clouds2, pos * 0.1), evaluateClamp(clouds3, pos * 0.1));
-		real n = evaluateClamp(value1, pos * 0.1 + off);
-		color = ninterpolate<3>(colors, n);
+		WhiteNoises &n = noises<WhiteNoises>();
+		vec3 off = vec3(evaluateClamp(n.clouds1, pos * 0.1), evaluateClamp(n.clouds2, pos * 0.1), evaluateClamp(n.clouds3, pos * 0.1));
+		real v = evaluateClamp(n.value1, pos * 0.1 + off);
+		color = ninterpolate<3>(whiteColors, v);
 		color = recolor(color, 0.2, pos * 0.72);
 		color = recolor(color, 0.13, pos * 1.3);
-		roughness = pow(evaluateClamp(clouds4, pos * 1.441), 0.5) * 0.7 + 0.01;
+		roughness = pow(evaluateClamp(n.clouds4, pos * 1.441), 0.5) * 0.7 + 0.01;
 		metallic = 0.05;
 	}
 
@@ -210,52 +314,25 @@ namespace
 	{
 		// https://www.goodfreephotos.com/united-states/colorado/other-colorado/rock-cliff-in-the-fog-in-colorado.jpg.php
 
-		static Holder<NoiseFunction> clouds1 = newClouds(3);
-		static Holder<NoiseFunction> clouds2 = newClouds(3);
-		static Holder<NoiseFunction> clouds3 = newClouds(3);
-		static Holder<NoiseFunction> clouds4 = newClouds(3);
-		static Holder<NoiseFunction> clouds5 = newClouds(3);
-		static Holder<NoiseFunction> cell1 = newCell(NoiseOperationEnum::Subtract);
-		static Holder<NoiseFunction> value1 = newValue();
-
-		vec3 off = vec3(evaluateClamp(clouds1, pos * 0.043), evaluateClamp(clouds2, pos * 0.043), evaluateClamp(clouds3, pos * 0.043));
-		real f = evaluateClamp(cell1, pos * 0.0147 + off * 0.23);
-		real m = evaluateClamp(clouds4, pos * 0.018);
+		DarkRock1Noises &n = noises<DarkRock1Noises>();
+		vec3 off = vec3(evaluateClamp(n.clouds1, pos * 0.043), evaluateClamp(n.clouds2, pos * 0.043), evaluateClamp(n.clouds3, pos * 0.043));
+		real f = evaluateClamp(n.cell1, pos * 0.0147 + off * 0.23);
+		real m = evaluateClamp(n.clouds4, pos * 0.018);
 		if (f < 0.017 && m < 0.35)
 		{ // the vein
-			static const vec3 vein[2] = {
-				pdnToRgb(18, 18, 60),
-				pdnToRgb(21, 22, 49)
-			};
-
-			color = interpolate(vein[0], vein[1], evaluateClamp(value1, pos));
-			roughness = evaluateClamp(clouds5, pos * 0.718) * 0.3 + 0.3;
+			color = interpolate(darkRock1Vein[0], darkRock1Vein[1], evaluateClamp(n.value1, pos));
+			roughness = evaluateClamp(n.clouds5, pos * 0.718) * 0.3 + 0.3;
 			metallic = 0.6;
 		}
 		else
 		{ // the rocks
-			static const vec3 colors[3] = {
-				pdnToRgb(240, 1, 45),
-				pdnToRgb(230, 5, 41),
-				pdnToRgb(220, 25, 27)
-			};
-
-			darkRockGeneral(pos, color, roughness, metallic, colors, sizeof(colors) / sizeof(colors[0]));
+			darkRockGeneral(pos, color, roughness, metallic, darkRock1Colors, 3);
 		}
 	}
 
 	void baseDarkRock2(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
 	{
-		// https://www.schemecolor.com/rocky-cliff-color-scheme.php
-
-		static const vec3 colors[4] = {
-			pdnToRgb(240, 1, 45),
-			pdnToRgb(230, 6, 35),
-			pdnToRgb(240, 11, 28),
-			pdnToRgb(232, 27, 21)
-		};
-
-		darkRockGeneral(pos, color, roughness, metallic, colors, sizeof(colors) / sizeof(colors[0]));
+		darkRockGeneral(pos, color, roughness, metallic, darkRock2Colors, 4);
 	}
 
 	void basesSwitch(uint32 baseIndex, const vec3 &pos, vec3 &color, real &roughness, real &metallic)
@@ -273,19 +350,14 @@ namespace
 
 	std::array<real, 5> basesWeights(const vec3 &pos)
 	{
-		static Holder<NoiseFunction> clouds1 = newClouds(3);
-		static Holder<NoiseFunction> clouds2 = newClouds(3);
-		static Holder<NoiseFunction> clouds3 = newClouds(3);
-		static Holder<NoiseFunction> clouds4 = newClouds(3);
-		static Holder<NoiseFunction> clouds5 = newClouds(3);
-
+		WeightsNoises &n = noises<WeightsNoises>();
 		const vec3 p = pos * 0.005;
 		std::array<real, 5> result;
-		result[0] = clouds1->evaluate(p);
-		result[1] = clouds2->evaluate(p);
-		result[2] = clouds3->evaluate(p);
-		result[3] = clouds4->evaluate(p);
-		result[4] = clouds5->evaluate(p);
+		result[0] = n.clouds1->evaluate(p);
+		result[1] = n.clouds2->evaluate(p);
+		result[2] = n.clouds3->evaluate(p);
+		result[3] = n.clouds4->evaluate(p);
+		result[4] = n.clouds5->evaluate(p);
 		return result;
 	}
 
@@ -295,19 +367,260 @@ namespace
 		uint32 index = m;
 	};
 
+	// picks the two most prominent bases and their blending factor
+	void basesBlend(const std::array<real, 5> &weights5, uint32 &first, uint32 &second, real &f)
+	{
+		std::array<WeightIndex, 5> indices5;
+		for (uint32 i = 0; i < 5; i++)
+		{
+			indices5[i].index = i;
+			indices5[i].weight = weights5[i] + 1;
+		}
+		std::sort(std::begin(indices5), std::end(indices5), [](const WeightIndex &a, const WeightIndex &b) {
+			return a.weight > b.weight;
+			});
+		{ // normalize
+			real l;
+			for (uint32 i = 0; i < 5; i++)
+				l += sqr(indices5[i].weight);
+			l = 1 / sqrt(l);
+			for (uint32 i = 0; i < 5; i++)
+				indices5[i].weight *= l;
+		}
+		vec2 w2 = normalize(vec2(indices5[0].weight, indices5[1].weight));
+		CAGE_ASSERT(w2[0] >= w2[1]);
+		real d = w2[0] - w2[1];
+		f = clamp(rerange(d, 0, 0.1, 0.5, 0), 0, 0.5);
+		first = indices5[0].index;
+		second = indices5[1].index;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// MATERIAL GRAPH
+	/////////////////////////////////////////////////////////////////////////////
+
+	// the same materials expressed as a graph, compiled into a program evaluated over batches of texels
+	// shared noise samples are evaluated once, and bases, veins, cracks and spots only on the texels that show them
+
+	constexpr uint32 BatchSize = MaterialBatchSize;
+
+	struct GraphMaterial
+	{
+		MaterialValue color;
+		MaterialValue roughness;
+		MaterialValue metallic;
+	};
+
+	void basesBlendLane(const real *inputs, real *outputs)
+	{
+		uint32 first = m, second = m;
+		basesBlend({ inputs[0], inputs[1], inputs[2], inputs[3], inputs[4] }, first, second, outputs[2]);
+		outputs[0] = first;
+		outputs[1] = second;
+	}
+
+	struct MaterialBuilder : private Immovable
+	{
+		MaterialGraph g;
+		const MaterialValue pos = g.position();
+
+		MaterialValue constant(real v)
+		{
+			return g.constant(v);
+		}
+
+		MaterialValue noiseClamp(const Holder<NoiseFunction> &noise, MaterialValue p)
+		{
+			return g.noise(noise, p) * 0.5 + 0.5;
+		}
+
+		MaterialValue rerange(MaterialValue v, real ia, real ib, real oa, real ob)
+		{
+			return (v - ia) / (ib - ia) * (ob - oa) + oa;
+		}
+
+		MaterialValue sharpEdge(MaterialValue v)
+		{
+			return rerange(clamp(v, 0.45, 0.55), 0.45, 0.55, 0, 1);
+		}
+
+		MaterialValue ninterpolate(const vec3 *colors, uint32 colorsCount, MaterialValue f)
+		{
+			const MaterialValue t = f * real(colorsCount - 1);
+			const MaterialValue i = g.floor(t);
+			return g.gradient(i, t - i, { colors, colors + colorsCount });
+		}
+
+		MaterialValue recolor(MaterialValue color, real deviation, MaterialValue p)
+		{
+			RecolorNoises &n = noises<RecolorNoises>();
+			const MaterialValue h = noiseClamp(n.value1, p) * 0.5 + 0.25;
+			const MaterialValue s = noiseClamp(n.value2, p);
+			const MaterialValue v = noiseClamp(n.value3, p);
+			const MaterialValue hsv = g.rgbToHsv(color) + (g.combine(h, s, v) - 0.5) * deviation;
+			const MaterialValue hue = (g.component(hsv, 0) + 1) % 1;
+			return g.hsvToRgb(clamp(g.combine(hue, g.component(hsv, 1), g.component(hsv, 2)), 0, 1));
+		}
+
+		GraphMaterial darkRockGeneral(const vec3 *colors, uint32 colorsCount)
+		{
+			DarkRockNoises &n = noises<DarkRockNoises>();
+			const MaterialValue off = g.combine(noiseClamp(n.clouds1, pos * 0.065), noiseClamp(n.clouds2, pos * 0.104), noiseClamp(n.clouds3, pos * 0.083));
+			const MaterialValue f = noiseClamp(n.clouds4, pos * 0.0756 + off);
+			GraphMaterial r;
+			r.color = recolor(ninterpolate(colors, colorsCount, f), 0.1, pos * 2.1);
+			r.roughness = noiseClamp(n.clouds5, pos * 1.132) * 0.4 + 0.3;
+			r.metallic = constant(0.02);
+			return r;
+		}
+
+		GraphMaterial basePaper()
+		{
+			PaperNoises &n = noises<PaperNoises>();
+			const MaterialValue off = g.combine(noiseClamp(n.cell1, pos * 0.063), noiseClamp(n.cell2, pos * 0.063), noiseClamp(n.cell3, pos * 0.063));
+			const MaterialValue rock1 = noiseClamp(n.clouds4, pos * 0.097 + off * 2.2) < 0.6;
+			const MaterialValue color1 = g.hsvToRgb(g.combine(
+				noiseClamp(n.clouds1, pos * 0.134) * 0.01 + 0.08,
+				noiseClamp(n.clouds2, pos * 0.344) * 0.2 + 0.2,
+				noiseClamp(n.clouds3, pos * 0.100) * 0.4 + 0.55
+			));
+			const MaterialValue color2 = g.hsvToRgb(g.combine(
+				noiseClamp(n.clouds1, pos * 0.321) * 0.02 + 0.094,
+				noiseClamp(n.clouds2, pos * 0.258) * 0.3 + 0.08,
+				noiseClamp(n.clouds3, pos * 0.369) * 0.2 + 0.59
+			));
+			GraphMaterial r;
+			r.color = g.select(rock1, color1, color2);
+			r.roughness = g.select(rock1, noiseClamp(n.clouds5, pos * 0.848) * 0.5 + 0.3, constant(0.5));
+			r.metallic = g.select(rock1, constant(0.02), constant(0.049));
+			return r;
+		}
+
+		GraphMaterial baseSphinx()
+		{
+			SphinxNoises &n = noises<SphinxNoises>();
+			const MaterialValue off = noiseClamp(n.clouds1, pos * 0.0041);
+			const MaterialValue y = (g.component(pos, 1) * 0.012 + 1000) % 4;
+			const MaterialValue c = (y + off * 2 - 1 + 4) % 4;
+			const MaterialValue i = g.floor(c);
+			GraphMaterial r;
+			r.color = recolor(g.gradient(i, sharpEdge(c - i), { sphinxColors, sphinxColors + 4 }, true), 0.1, pos * 1.1);
+			r.roughness = noiseClamp(n.clouds2, pos * 0.941) * 0.3 + 0.4;
+			r.metallic = constant(0.02);
+			return r;
+		}
+
+		GraphMaterial baseWhite()
+		{
+			WhiteNoises &n = noises<WhiteNoises>();
+			const MaterialValue off = g.combine(noiseClamp(n.clouds1, pos * 0.1), noiseClamp(n.clouds2, pos * 0.1), noiseClamp(n.clouds3, pos * 0.1));
+			const MaterialValue v = noiseClamp(n.value1, pos * 0.1 + off);
+			GraphMaterial r;
+			r.color = recolor(recolor(ninterpolate(whiteColors, 3, v), 0.2, pos * 0.72), 0.13, pos * 1.3);
+			r.roughness = pow(noiseClamp(n.clouds4, pos * 1.441), 0.5) * 0.7 + 0.01;
+			r.metallic = constant(0.05);
+			return r;
+		}
+
+		GraphMaterial baseDarkRock1()
+		{
+			DarkRock1Noises &n = noises<DarkRock1Noises>();
+			const MaterialValue off = g.combine(noiseClamp(n.clouds1, pos * 0.043), noiseClamp(n.clouds2, pos * 0.043), noiseClamp(n.clouds3, pos * 0.043));
+			const MaterialValue f = noiseClamp(n.cell1, pos * 0.0147 + off * 0.23);
+			const MaterialValue vein = g.select(f < 0.017, noiseClamp(n.clouds4, pos * 0.018) < 0.35, constant(0));
+			const GraphMaterial rocks = darkRockGeneral(darkRock1Colors, 3);
+			GraphMaterial r;
+			r.color = g.select(vein, g.gradient(constant(0), noiseClamp(n.value1, pos), { darkRock1Vein, darkRock1Vein + 2 }), rocks.color);
+			r.roughness = g.select(vein, noiseClamp(n.clouds5, pos * 0.718) * 0.3 + 0.3, rocks.roughness);
+			r.metallic = g.select(vein, constant(0.6), rocks.metallic);
+			return r;
+		}
+
+		GraphMaterial baseDarkRock2()
+		{
+			return darkRockGeneral(darkRock2Colors, 4);
+		}
+
+		MaterialProgram texture()
+		{
+			const GraphMaterial bases[5] = { basePaper(), baseSphinx(), baseWhite(), baseDarkRock1(), baseDarkRock2() };
+
+			WeightsNoises &wn = noises<WeightsNoises>();
+			const MaterialValue p = pos * 0.005;
+			const MaterialValue blend = g.custom(&basesBlendLane, { g.noise(wn.clouds1, p), g.noise(wn.clouds2, p), g.noise(wn.clouds3, p), g.noise(wn.clouds4, p), g.noise(wn.clouds5, p) }, 3);
+			const MaterialValue first = g.component(blend, 0);
+			const MaterialValue second = g.component(blend, 1);
+			const MaterialValue f = g.component(blend, 2);
+			const auto &chosen = [&](MaterialValue index, MaterialValue GraphMaterial::*attribute) {
+				return g.choose(index, { bases[0].*attribute, bases[1].*attribute, bases[2].*attribute, bases[3].*attribute, bases[4].*attribute });
+			};
+			// the second base is skipped where it does not contribute
+			MaterialValue color = g.mix(chosen(first, &GraphMaterial::color), chosen(second, &GraphMaterial::color), f);
+			MaterialValue roughness = g.mix(chosen(first, &GraphMaterial::roughness), chosen(second, &GraphMaterial::roughness), f);
+			MaterialValue metallic = g.mix(chosen(first, &GraphMaterial::metallic), chosen(second, &GraphMaterial::metallic), f);
+
+			TextureNoises &n = noises<TextureNoises>();
+
+			{ // small cracks
+				const MaterialValue crack = g.select(noiseClamp(n.cell1, pos * 0.187) < 0.02, noiseClamp(n.clouds1, pos * 0.43) < 0.5, constant(0));
+				color = g.select(crack, color * 0.6, color);
+				roughness = g.select(crack, roughness * 1.2, roughness);
+			}
+
+			{ // white glistering spots
+				const MaterialValue spot = noiseClamp(n.cell2, pos * 0.084) > 0.95;
+				const MaterialValue c = noiseClamp(n.clouds2, pos * 3) * 0.2 + 0.8;
+				color = g.select(spot, g.combine(c, c, c), color);
+				roughness = g.select(spot, constant(0.2), roughness);
+				metallic = g.select(spot, constant(0.4), metallic);
+			}
+
+			return g.compile({ color, roughness, metallic });
+		}
+	};
+
+	const MaterialProgram &textureProgram()
+	{
+		static const MaterialProgram program = []() {
+			MaterialBuilder builder;
+			MaterialProgram p = builder.texture();
+			CAGE_LOG_DEBUG(SeverityEnum::Info, "terrain", stringizer() + "material graph nodes: " + builder.g.nodesCount() + ", instructions: " + p.instructionsCount() + ", registers: " + p.registersCount());
+			return p;
+		}();
+		return program;
+	}
+
 	struct ProcTile
 	{
 		TilePos pos;
+		const std::atomic<bool> *cancelled = nullptr;
+		TerrainGenerateStatistics *statistics = nullptr;
+		Holder<Timer> timer; // only used with statistics
 		Holder<Mesh> mesh;
+		Holder<Mesh> clipped; // before unwrap, the source of the collision mesh
 		Holder<Collider> collider;
 		Holder<Image> albedo;
 		Holder<Image> special;
+		TerrainLod lod;
 		uint32 textureResolution = 0;
+
+		bool isCancelled() const
+		{
+			return cancelled->load(std::memory_order_relaxed);
+		}
+
+		// attributes the time elapsed since the previous measurement to the stage
+		void measure(uint64 TerrainGenerateStatistics::*stage)
+		{
+			if (statistics)
+				statistics->*stage += timer->microsSinceLast();
+		}
 	};
 
-	real meshGeneratorImpl(const vec3 &pt)
+	// the configurations are shared, the noise functions themselves are instantiated per thread
+	const NoiseFunctionCreateConfig &densityBaseConfig()
 	{
-		static Holder<NoiseFunction> baseNoise = []()
+		static const NoiseFunctionCreateConfig config = []()
 		{
 			NoiseFunctionCreateConfig cfg;
 			cfg.type = NoiseTypeEnum::Cubic;
@@ -315,9 +628,14 @@ namespace
 			cfg.fractalType = NoiseFractalTypeEnum::Fbm;
 			cfg.octaves = 1;
 			cfg.frequency = 0.12;
-			return newNoiseFunction(cfg);
+			return cfg;
 		}();
-		static Holder<NoiseFunction> bumpsNoise = []()
+		return config;
+	}
+
+	const NoiseFunctionCreateConfig &densityBumpsConfig()
+	{
+		static const NoiseFunctionCreateConfig config = []()
 		{
 			NoiseFunctionCreateConfig cfg;
 			cfg.type = NoiseTypeEnum::Value;
@@ -325,61 +643,237 @@ namespace
 			cfg.octaves = 3;
 			cfg.seed = newSeed();
 			cfg.frequency = 0.4;
-			return newNoiseFunction(cfg);
+			return cfg;
 		}();
+		return config;
+	}
+
+	constexpr uint32 MaxDensityResolution = 40;
+
+	struct DensityGenerator
+	{
+		Holder<NoiseFunction> baseNoise = newNoiseFunction(densityBaseConfig());
+		Holder<NoiseFunction> bumpsNoise = newNoiseFunction(densityBumpsConfig());
+
+		// one slice of the grid
+		real xs[MaxDensityResolution * MaxDensityResolution];
+		real ys[MaxDensityResolution * MaxDensityResolution];
+		real zs[MaxDensityResolution * MaxDensityResolution];
+		real base[MaxDensityResolution * MaxDensityResolution];
+		real bumps[MaxDensityResolution * MaxDensityResolution];
+		ivec3 lattice[MaxDensityResolution * MaxDensityResolution]; // keys for the density cache
+		real values[MaxDensityResolution * MaxDensityResolution];
+		bool found[MaxDensityResolution * MaxDensityResolution];
+		uint32 missing[MaxDensityResolution * MaxDensityResolution];
+
+		real evaluate(const vec3 &pt)
+		{
+			return baseNoise->evaluate(pt) + 0.15 + bumpsNoise->evaluate(pt) * 0.05;
+		}
+
+		// combines the noises exactly as the scalar evaluate does
+		void evaluate(uint32 count)
+		{
+			baseNoise->evaluate({ xs, xs + count }, { ys, ys + count }, { zs, zs + count }, { base, base + count });
+			bumpsNoise->evaluate({ xs, xs + count }, { ys, ys + count }, { zs, zs + count }, { bumps, bumps + count });
+			for (uint32 i = 0; i < count; i++)
+				base[i] = base[i] + 0.15 + bumps[i] * 0.05;
+		}
+	};
 
-		const real base = baseNoise->evaluate(pt) + 0.15;
-		const real bumps = bumpsNoise->evaluate(pt) * 0.05;
-		return base + bumps;
+	DensityGenerator &densityGenerator()
+	{
+		thread_local DensityGenerator generator;
+		return generator;
 	}
 
 	real meshGenerator(ProcTile *t, const vec3 &pl)
 	{
 		const vec3 pt = t->pos.getTransform() * pl;
-		return meshGeneratorImpl(pt);
+		return densityGenerator().evaluate(pt);
 	}
 
-	void textureGeneratorImpl(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
+	// fills the grid one z-slice at a time with batched noise evaluations
+	// the samples are placed on a world space lattice with spacing 2 / denominator
+	// the lattice of a tile contains the samples on the faces shared with its neighbors and all samples of its parent with the same resolution
+	// positions are computed from the integer lattice coordinates so that all tiles evaluate exactly the same points
+	void generateDensities(ProcTile &t, MarchingCubes *cubes)
+	{
+		DensityGenerator &g = densityGenerator();
+		const uint32 res = t.lod.gridResolution;
+		CAGE_ASSERT(res <= MaxDensityResolution);
+		const sint32 denominator = res - 1;
+		const sint32 radius = t.pos.radius;
+		const ivec3 origin = (t.pos.pos - radius) * denominator;
+		const real invDenominator = 1 / real(denominator);
+		const bool cached = terrainDensityCacheEnabled();
+		const uint32 count = res * res;
+		for (uint32 z = 0; z < res; z++)
+		{
+			uint32 i = 0;
+			for (uint32 y = 0; y < res; y++)
+			{
+				for (uint32 x = 0; x < res; x++)
+				{
+					g.lattice[i] = origin + ivec3(x, y, z) * (2 * radius);
+					g.found[i] = false;
+					i++;
+				}
+			}
+			if (cached)
+				terrainDensityCacheLookup(denominator, { g.lattice, g.lattice + count }, { g.values, g.values + count }, { g.found, g.found + count });
+			uint32 misses = 0;
+			for (i = 0; i < count; i++)
+			{
+				if (g.found[i])
+					continue;
+				g.xs[misses] = real(g.lattice[i][0]) * invDenominator;
+				g.ys[misses] = real(g.lattice[i][1]) * invDenominator;
+				g.zs[misses] = real(g.lattice[i][2]) * invDenominator;
+				g.missing[misses] = i;
+				misses++;
+			}
+			if (misses)
+			{
+				g.evaluate(misses);
+				for (uint32 j = 0; j < misses; j++)
+				{
+					// the simd kernels may round differently than the scalar ones
+					CAGE_ASSERT(abs(g.base[j] - g.evaluate(vec3(g.xs[j], g.ys[j], g.zs[j]))) < 1e-4);
+					g.values[g.missing[j]] = g.base[j];
+				}
+				if (cached)
+				{
+					// reuse the coordinates arrays for the compacted keys
+					for (uint32 j = 0; j < misses; j++)
+						g.lattice[j] = g.lattice[g.missing[j]];
+					terrainDensityCacheStore(denominator, { g.lattice, g.lattice + misses }, { g.base, g.base + misses });
+				}
+			}
+			if (t.statistics)
+				t.statistics->sampleHits += count - misses;
+			i = 0;
+			for (uint32 y = 0; y < res; y++)
+				for (uint32 x = 0; x < res; x++)
+					cubes->density(x, y, z, g.values[i++]);
+		}
+	}
+
+	// upper bound of the magnitude of the gradient of a lattice noise with unit frequency and values in -1 .. 1
+	real noiseGradientBound(NoiseTypeEnum type)
 	{
-		static Holder<NoiseFunction> cell1 = newCell(NoiseOperationEnum::Subtract);
-		static Holder<NoiseFunction> cell2 = newCell();
-		static Holder<NoiseFunction> clouds1 = newClouds(3);
-		static Holder<NoiseFunction> clouds2 = newClouds(2);
+		switch (type)
+		{
+		case NoiseTypeEnum::Value:
+			// the steepest (quintic) interpolation changes by at most 1.875 times the difference of two lattice values along each axis
+			return 1.875 * 2 * sqrt(real(3));
+		case NoiseTypeEnum::Cubic:
+			// the derivatives of the four cubic weights sum to at most 3 along the differentiated axis
+			// the weights along the other two axes sum to at most 1.5 each, and the noise is normalized by 1 / 1.5^3
+			return 3 * 1.5 * 1.5 / (1.5 * 1.5 * 1.5) * sqrt(real(3));
+		default:
+			CAGE_THROW_CRITICAL(Exception, "missing gradient bound for the terrain noise type");
+		}
+	}
 
-		{ // base
-			std::array<real, 5> weights5 = basesWeights(pos);
-			std::array<WeightIndex, 5> indices5;
-			for (uint32 i = 0; i < 5; i++)
+	// each octave contributes its amplitude times its frequency, the fbm normalizes the sum by the sum of the amplitudes
+	real noiseGradientBound(const NoiseFunctionCreateConfig &cfg)
+	{
+		CAGE_ASSERT(cfg.fractalType == NoiseFractalTypeEnum::Fbm);
+		real amplitude = 1, frequency = cfg.frequency, sum = 0, amplitudes = 0;
+		for (uint32 i = 0; i < cfg.octaves; i++)
+		{
+			sum += amplitude * frequency;
+			amplitudes += amplitude;
+			amplitude *= cfg.gain;
+			frequency *= cfg.lacunarity;
+		}
+		return noiseGradientBound(cfg.type) * sum / amplitudes;
+	}
+
+	// upper bound of the magnitude of the gradient of the density function, in world units
+	// follows the composition in DensityGenerator::evaluate
+	real densityLipschitz()
+	{
+		static const real bound = noiseGradientBound(densityBaseConfig()) + noiseGradientBound(densityBumpsConfig()) * 0.05;
+		return bound;
+	}
+
+	constexpr uint32 EmptyRejectionDepth = 3;
+	constexpr uint32 EmptyRejectionMaxProbes = 600; // about 4 % of the default grid
+
+	// conservative test whether the density keeps one sign over the whole tile, in which case there is no surface
+	// a box is proven when the density at its center is farther from zero than it can change within the box
+	// other boxes are subdivided, up to a limit
+	struct EmptyRejection
+	{
+		transform tr;
+		real lipschitz;
+		uint32 probes = 0;
+		sint32 sign = 0;
+		bool failed = false;
+
+		void prove(const vec3 &center, real half, uint32 depth)
+		{
+			if (failed)
+				return;
+			const real d = densityGenerator().evaluate(tr * center);
+			probes++;
+			const sint32 s = d > 0 ? 1 : -1;
+			if (sign == 0)
+				sign = s;
+			if (s != sign)
 			{
-				indices5[i].index = i;
-				indices5[i].weight = weights5[i] + 1;
+				failed = true; // the surface is certainly somewhere in between
+				return;
 			}
-			std::sort(std::begin(indices5), std::end(indices5), [](const WeightIndex &a, const WeightIndex &b) {
-				return a.weight > b.weight;
-				});
-			{ // normalize
-				real l;
-				for (uint32 i = 0; i < 5; i++)
-					l += sqr(indices5[i].weight);
-				l = 1 / sqrt(l);
-				for (uint32 i = 0; i < 5; i++)
-					indices5[i].weight *= l;
+			if (abs(d) > half * sqrt(real(3)) * tr.scale * lipschitz)
+				return;
+			if (depth == 0 || probes >= EmptyRejectionMaxProbes)
+			{
+				failed = true;
+				return;
 			}
-			vec2 w2 = normalize(vec2(indices5[0].weight, indices5[1].weight));
-			CAGE_ASSERT(w2[0] >= w2[1]);
-			real d = w2[0] - w2[1];
-			real f = clamp(rerange(d, 0, 0.1, 0.5, 0), 0, 0.5);
+			const real h = half * 0.5;
+			for (uint32 i = 0; i < 8; i++)
+				prove(center + vec3(i % 2 ? h : -h, (i / 2) % 2 ? h : -h, i / 4 ? h : -h), h, depth - 1);
+		}
+	};
+
+	// true if the tile is provably empty or provably solid
+	bool rejectEmpty(ProcTile &t)
+	{
+		OPTICK_EVENT("rejectEmpty");
+		EmptyRejection r;
+		r.tr = t.pos.getTransform();
+		r.lipschitz = densityLipschitz();
+		r.prove(vec3(), 1, EmptyRejectionDepth); // the grid covers the local box -1 .. 1
+		if (t.statistics)
+			t.statistics->probes += r.probes;
+		t.measure(&TerrainGenerateStatistics::rejection);
+		OPTICK_TAG("probes", r.probes);
+		return !r.failed;
+	}
+
+	void textureGeneratorImpl(const vec3 &pos, vec3 &color, real &roughness, real &metallic)
+	{
+		TextureNoises &n = noises<TextureNoises>();
+
+		{ // base
+			uint32 first = m, second = m;
+			real f;
+			basesBlend(basesWeights(pos), first, second, f);
 			vec3 c[2]; real r[2]; real m[2];
-			for (uint32 i = 0; i < 2; i++)
-				basesSwitch(indices5[i].index, pos, c[i], r[i], m[i]);
+			basesSwitch(first, pos, c[0], r[0], m[0]);
+			basesSwitch(second, pos, c[1], r[1], m[1]);
 			color = interpolate(c[0], c[1], f);
 			roughness = interpolate(r[0], r[1], f);
 			metallic = interpolate(m[0], m[1], f);
 		}
 
 		{ // small cracks
-			real f = evaluateClamp(cell1, pos * 0.187);
-			real m = evaluateClamp(clouds1, pos * 0.43);
+			real f = evaluateClamp(n.cell1, pos * 0.187);
+			real m = evaluateClamp(n.clouds1, pos * 0.43);
 			if (f < 0.02 && m < 0.5)
 			{
 				color *= 0.6;
@@ -388,9 +882,9 @@ namespace
 		}
 
 		{ // white glistering spots
-			if (evaluateClamp(cell2, pos * 0.084) > 0.95)
+			if (evaluateClamp(n.cell2, pos * 0.084) > 0.95)
 			{
-				real c = evaluateClamp(clouds2, pos * 3) * 0.2 + 0.8;
+				real c = evaluateClamp(n.clouds2, pos * 3) * 0.2 + 0.8;
 				color = vec3(c);
 				roughness = 0.2;
 				metallic = 0.4;
@@ -398,9 +892,56 @@ namespace
 		}
 	}
 
+	// texels collected from the rasterizer until a whole batch can be evaluated
+	struct TexelBatch
+	{
+		real xs[BatchSize];
+		real ys[BatchSize];
+		real zs[BatchSize];
+		uint32 us[BatchSize];
+		uint32 vs[BatchSize];
+		uint32 count = 0;
+	};
+
+	TexelBatch &texelBatch()
+	{
+		thread_local TexelBatch batch;
+		return batch;
+	}
+
+	void flushTexels(ProcTile *t)
+	{
+		TexelBatch &b = texelBatch();
+		if (b.count == 0)
+			return;
+		real results[5][BatchSize]; // color, roughness, metallic
+		real *const outputs[5] = { results[0], results[1], results[2], results[3], results[4] };
+		textureProgram().evaluate(b.xs, b.ys, b.zs, b.count, { outputs, outputs + 5 });
+		for (uint32 i = 0; i < b.count; i++)
+		{
+			t->albedo->set(b.us[i], b.vs[i], vec3(results[0][i], results[1][i], results[2][i]));
+			t->special->set(b.us[i], b.vs[i], vec2(results[3][i], results[4][i]));
+		}
+		b.count = 0;
+	}
+
 	void textureGenerator(ProcTile *t, uint32 x, uint32 y, const ivec3 &idx, const vec3 &weights)
 	{
+		if (t->isCancelled())
+			return;
 		vec3 position = t->mesh->positionAt(idx, weights) * t->pos.getTransform() * 10;
+		if (confBatchedTextures)
+		{
+			TexelBatch &b = texelBatch();
+			b.xs[b.count] = position[0];
+			b.ys[b.count] = position[1];
+			b.zs[b.count] = position[2];
+			b.us[b.count] = x;
+			b.vs[b.count] = y;
+			if (++b.count == BatchSize)
+				flushTexels(t);
+			return;
+		}
 		vec3 color; real roughness; real metallic;
 		textureGeneratorImpl(position, color, roughness, metallic);
 		t->albedo->set(x, y, color);
@@ -425,23 +966,32 @@ namespace
 		return (len / inds).value;
 	}
 
+	constexpr uint32 MaxUnwrapAttempts = 10;
+
 	void generateMesh(ProcTile &t)
 	{
 		OPTICK_EVENT("generateMesh");
 
 		{
 			MarchingCubesCreateConfig cfg;
-			cfg.resolution = ivec3(24);
+			cfg.resolution = ivec3(t.lod.gridResolution);
 			cfg.box = Aabb(vec3(-1), vec3(1));
 			cfg.clip = false;
 			Holder<MarchingCubes> cubes = newMarchingCubes(cfg);
 			{
 				OPTICK_EVENT("densities");
-				cubes->updateByPosition(Delegate<real(const vec3 &)>().bind<ProcTile *, &meshGenerator>(&t));
+				if (confBatchedDensities)
+					generateDensities(t, +cubes);
+				else
+					cubes->updateByPosition(Delegate<real(const vec3 &)>().bind<ProcTile *, &meshGenerator>(&t));
+				t.measure(&TerrainGenerateStatistics::densities);
 			}
+			if (t.isCancelled())
+				return;
 			{
 				OPTICK_EVENT("marchingCubes");
 				t.mesh = cubes->makeMesh();
+				t.measure(&TerrainGenerateStatistics::marchingCubes);
 				OPTICK_TAG("faces", t.mesh->facesCount());
 				OPTICK_TAG("avgEdgeLen", averageEdgeLength(+t.mesh));
 			}
@@ -461,31 +1011,91 @@ namespace
 		}
 		*/
 
+		if (t.isCancelled())
+			return;
+
 		{
 			OPTICK_EVENT("clip");
 			meshClip(+t.mesh, Aabb(vec3(-1.005), vec3(1.005)));
+			t.measure(&TerrainGenerateStatistics::clip);
 			OPTICK_TAG("faces", t.mesh->facesCount());
 		}
 
+		if (t.isCancelled())
+			return;
+
 		{
 			OPTICK_EVENT("unwrap");
 			MeshUnwrapConfig cfg;
-			cfg.texelsPerUnit = 50.0f;
+			cfg.texelsPerUnit = t.lod.texelsPerUnit;
+			t.clipped = t.mesh->copy();
 			t.textureResolution = meshUnwrap(+t.mesh, cfg);
-			CAGE_ASSERT(t.textureResolution <= 2048);
+			for (uint32 attempt = 0; t.textureResolution > t.lod.maxTextureResolution; attempt++)
+			{
+				if (attempt == MaxUnwrapAttempts)
+				{
+					// the uvs are normalized, the texture is just sampled with fewer texels than planned
+					t.textureResolution = t.lod.maxTextureResolution;
+					break;
+				}
+				// too much surface for the texture, lower the density, faster with every attempt
+				cfg.texelsPerUnit *= (attempt < 3 ? 0.95f : 0.8f) * t.lod.maxTextureResolution / t.textureResolution;
+				t.mesh = t.clipped->copy();
+				t.textureResolution = meshUnwrap(+t.mesh, cfg);
+			}
+			CAGE_ASSERT(t.textureResolution <= t.lod.maxTextureResolution);
 			if (t.textureResolution == 0)
 				t.mesh->clear();
+			t.measure(&TerrainGenerateStatistics::unwrap);
 			OPTICK_TAG("faces", t.mesh->facesCount());
 			OPTICK_TAG("resolution", t.textureResolution);
 		}
 	}
 
+	// the collision mesh does not need the texture seams nor the render resolution
+	// welded and decimated to within the configured error, which makes the collider and its bvh smaller
+	void generateCollisionMesh(ProcTile &t)
+	{
+		OPTICK_EVENT("collisionMesh");
+		const real radius = t.pos.radius;
+		const real spacing = 2 / real(t.lod.gridResolution - 1); // tile-local
+		{
+			MeshMergeCloseVerticesConfig cfg;
+			cfg.distanceThreshold = spacing * 1e-3;
+			meshMergeCloseVertices(+t.clipped, cfg);
+		}
+		if (t.isCancelled())
+			return;
+		{
+			MeshSimplifyConfig cfg;
+			cfg.approximateError = real(confColliderError) / radius;
+			cfg.minEdgeLength = spacing * 0.5;
+			cfg.maxEdgeLength = spacing * 8;
+			cfg.useProjection = false;
+			meshSimplify(+t.clipped, cfg);
+		}
+		OPTICK_TAG("faces", t.clipped->facesCount());
+	}
+
 	void generateCollider(ProcTile &t)
 	{
 		OPTICK_EVENT("generateCollider");
+		const Mesh *source = +t.mesh;
+		if (confColliderDecimation && t.clipped)
+		{
+			generateCollisionMesh(t);
+			if (t.isCancelled())
+				return;
+			source = +t.clipped;
+		}
+		if (t.statistics)
+			t.statistics->colliderFaces += source->facesCount();
 		t.collider = newCollider();
-		t.collider->importMesh(t.mesh.get());
+		t.collider->importMesh(source);
+		if (t.isCancelled())
+			return;
 		t.collider->rebuild();
+		t.measure(&TerrainGenerateStatistics::collider);
 	}
 
 	void generateTextures(ProcTile &t)
@@ -502,12 +1112,18 @@ namespace
 		cfg.width = cfg.height = t.textureResolution;
 		{
 			OPTICK_EVENT("generating");
+			texelBatch().count = 0; // discard leftovers from an interrupted tile
 			meshGenerateTexture(+t.mesh, cfg);
+			flushTexels(&t);
+			t.measure(&TerrainGenerateStatistics::textures);
 		}
+		if (t.isCancelled())
+			return;
 		{
 			OPTICK_EVENT("dilation");
 			imageDilation(+t.albedo, 2);
 			imageDilation(+t.special, 2);
+			t.measure(&TerrainGenerateStatistics::dilation);
 		}
 
 		//auto tex = t.albedo->copy();
@@ -526,24 +1142,75 @@ namespace
 			for (uint32 i = 0; i < 5; i++)
 				basesSwitch(i, p, c, r, m);
 			textureGeneratorImpl(p, c, r, m);
-			meshGeneratorImpl(p);
+			densityBaseConfig();
+			densityBumpsConfig();
+			textureProgram();
 		}
 	} initializer;
 }
 
-void terrainGenerate(const TilePos &tilePos, Holder<Mesh> &mesh, Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special)
+uint32 terrainSeed()
+{
+	return GlobalSeed;
+}
+
+real terrainDensityLipschitz()
+{
+	return densityLipschitz();
+}
+
+real terrainDensity(const vec3 &position)
+{
+	return densityGenerator().evaluate(position);
+}
+
+uint32 terrainColliderPolicy()
+{
+	if (!confColliderDecimation)
+		return 0;
+	return numeric_cast<uint32>(max((float)confColliderError, 0.f) * 10000) + 1; // tenths of millimeter
+}
+
+void terrainGenerate(const TilePos &tilePos, const std::atomic<bool> &cancelled, Holder<Mesh> &mesh, Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special, TerrainGenerateStatistics *statistics)
 {
 	OPTICK_EVENT("terrainGenerate");
 	OPTICK_TAG("Tile", (stringizer() + tilePos).value.c_str());
 	
 	ProcTile t;
 	t.pos = tilePos;
+	t.lod = terrainLod(tilePos);
+	t.cancelled = &cancelled;
+	t.statistics = statistics;
+	if (statistics)
+	{
+		t.timer = newTimer();
+		statistics->tiles++;
+	}
 
+	// the outputs are left empty when the generation is cancelled
+	if (confEmptyRejection && rejectEmpty(t))
+	{
+		if (statistics)
+			statistics->rejectedTiles++;
+		return;
+	}
+	if (statistics)
+		statistics->samples += uint64(t.lod.gridResolution) * t.lod.gridResolution * t.lod.gridResolution;
 	generateMesh(t);
-	if (t.mesh->facesCount() == 0)
+	if (t.isCancelled() || t.mesh->facesCount() == 0)
 		return;
+	if (statistics)
+	{
+		statistics->faces += t.mesh->facesCount();
+		statistics->texels += uint64(t.textureResolution) * t.textureResolution;
+		statistics->nonEmptyTiles++;
+	}
 	generateCollider(t);
+	if (t.isCancelled())
+		return;
 	generateTextures(t);
+	if (t.isCancelled())
+		return;
 
 	mesh = std::move(t.mesh);
 	collider = std::move(t.collider);
@@ -0,0 +1,131 @@
+#ifndef scheduler_h_d4f5g6h7
+#define scheduler_h_d4f5g6h7
+
+#include "terrain.h"
+
+#include <cage-core/concurrent.h>
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+// binary heap of tiles waiting for the generator threads, no engine involved, thread safe
+// the tile type provides pos (TilePos) and prefetch (bool, read under the lock when the priorities are updated)
+// once stopped, pop returns nullptr immediately, even if there are tiles left in the queue
+
+template<class T>
+class TerrainScheduler
+{
+public:
+	// called from the control thread
+	void push(T *tile, bool cached)
+	{
+		ScopeLock<Mutex> lock(mutex);
+		Request r;
+		r.tile = tile;
+		r.radius = tile->pos.radius;
+		r.distance = tile->pos.distance(player);
+		r.cached = cached;
+		r.prefetch = tile->prefetch;
+		queue.push_back(r);
+		std::push_heap(queue.begin(), queue.end());
+		signal->signal();
+	}
+
+	// called from the control thread, recomputes the priorities when the player has moved or some tiles changed
+	void updatePlayer(const vec3 &position)
+	{
+		ScopeLock<Mutex> lock(mutex);
+		if (!dirty && distanceSquared(position, player) < 1)
+			return; // the priorities would not change much
+		dirty = false;
+		player = position;
+		if (queue.empty())
+			return;
+		OPTICK_EVENT("schedulerReprioritize");
+		for (Request &r : queue)
+		{
+			r.distance = r.tile->pos.distance(position);
+			r.prefetch = r.tile->prefetch;
+		}
+		std::make_heap(queue.begin(), queue.end());
+	}
+
+	// called from the control thread
+	void invalidate()
+	{
+		ScopeLock<Mutex> lock(mutex);
+		dirty = true;
+	}
+
+	// called from the generator threads, blocks until there is a tile to generate or the scheduler is stopped
+	T *pop()
+	{
+		ScopeLock<Mutex> lock(mutex);
+		while (!stopped && queue.empty())
+			signal->wait(+mutex);
+		if (stopped)
+			return nullptr;
+		std::pop_heap(queue.begin(), queue.end());
+		T *t = queue.back().tile;
+		queue.pop_back();
+		return t;
+	}
+
+	// wakes all waiting threads, returns the tiles that were still queued
+	std::vector<T *> stop()
+	{
+		ScopeLock<Mutex> lock(mutex);
+		stopped = true;
+		std::vector<T *> remaining;
+		remaining.reserve(queue.size());
+		for (const Request &r : queue)
+			remaining.push_back(r.tile);
+		queue.clear();
+		signal->broadcast();
+		return remaining;
+	}
+
+	bool stopping() const
+	{
+		return stopped;
+	}
+
+	uint32 size()
+	{
+		ScopeLock<Mutex> lock(mutex);
+		return numeric_cast<uint32>(queue.size());
+	}
+
+private:
+	struct Request
+	{
+		T *tile = nullptr;
+		sint32 radius = 0;
+		real distance;
+		bool cached = false; // restoring the tile from the memory cache is cheap
+		bool prefetch = false;
+
+		// lower priority compares less
+		bool operator < (const Request &other) const
+		{
+			if (cached != other.cached)
+				return other.cached;
+			if (prefetch != other.prefetch)
+				return prefetch; // needed tiles first
+			if (radius != other.radius)
+				return radius < other.radius; // larger tiles first
+			return distance > other.distance; // closer tiles first
+		}
+	};
+
+	// all members are guarded by the mutex
+	std::vector<Request> queue;
+	vec3 player; // consistent snapshot of the player position used for the priorities
+	Holder<Mutex> mutex = newMutex();
+	Holder<ConditionalVariableBase> signal = newConditionalVariableBase();
+	std::atomic<bool> stopped {false};
+	bool dirty = false; // some priorities have changed
+};
+
+#endif
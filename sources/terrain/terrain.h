@@ -3,7 +3,8 @@
 
 #include "../common.h"
 
-#include <set>
+#include <vector>
+#include <atomic>
 
 struct TilePos
 {
@@ -14,7 +15,10 @@ struct TilePos
 	Aabb getBox() const; // aabb in world space
 	transform getTransform() const;
 	real distanceToPlayer() const;
+	real distance(const vec3 &position) const;
+	uint64 key() const; // morton code of the position combined with the level; unique for each tile
 	bool operator < (const TilePos &other) const;
+	bool operator == (const TilePos &other) const { return pos == other.pos && radius == other.radius; }
 };
 
 inline stringizer &operator + (stringizer &s, const TilePos &p)
@@ -22,7 +26,133 @@ inline stringizer &operator + (stringizer &s, const TilePos &p)
 	return s + p.radius + "__" + p.pos[0] + "_" + p.pos[1] + "_" + p.pos[2];
 }
 
-std::set<TilePos> findNeededTiles(const std::set<TilePos> &tilesReady);
-void terrainGenerate(const TilePos &tilePos, Holder<Mesh> &mesh, Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special);
+enum class TileChangeEnum
+{
+	Add,
+	Remove,
+	Visibility,
+	Priority,
+};
+
+struct TileChange
+{
+	TilePos pos; // including the requested visibility
+	TileChangeEnum change = TileChangeEnum::Add;
+	bool prefetch = false; // the tile is not needed yet, it is predicted to be needed soon
+};
+
+// tiles of the finest level are displayed at any distance, other tiles are refined closer than RefineFactor * radius
+constexpr sint32 TerrainMinTileRadius = 4;
+constexpr sint32 TerrainRefineFactor = 4;
+
+// the changes must be applied in order
+void updateNeededTiles(std::vector<TileChange> &changes);
+void clearNeededTiles(std::vector<TileChange> &changes);
+void neededTileReady(const TilePos &pos, bool ready);
+// multiplies the distance at which tiles are refined, the memory budget lowers it to request fewer fine tiles
+void terrainRefineScale(real scale);
+real terrainRefineScale();
+// increment whenever the output of the procedural generation changes
+constexpr uint32 TerrainGeneratorVersion = 4;
+uint32 terrainSeed();
+
+// level of detail policy: grid and texture resolution of each tile
+struct TerrainLod
+{
+	uint32 gridResolution = 24; // marching cubes samples along each axis
+	float texelsPerUnit = 50; // in tile-local space
+	uint32 maxTextureResolution = 2048;
+};
+TerrainLod terrainLod(const TilePos &tilePos);
+real terrainProjectedSize(const TilePos &tilePos); // pixels covered by the tile at the closest distance it is displayed from
+uint32 terrainLodPolicy(); // identifies the current policy (quality tier), tiles generated with different policies differ
+uint32 terrainColliderPolicy(); // identifies the collider decimation settings
+uint32 terrainTexturePolicy(); // identifies the texture compression and atlas settings
+struct TerrainGenerateStatistics
+{
+	// accumulated durations of the individual stages, in microseconds
+	uint64 rejection = 0; // proving that a tile has no surface
+	uint64 densities = 0;
+	uint64 marchingCubes = 0;
+	uint64 clip = 0;
+	uint64 unwrap = 0;
+	uint64 collider = 0;
+	uint64 textures = 0;
+	uint64 dilation = 0;
+	uint64 samples = 0; // density grid
+	uint64 faces = 0;
+	uint64 colliderFaces = 0; // after the decimation
+	uint64 texels = 0;
+	uint64 probes = 0; // density evaluations of the empty tile rejection
+	uint64 sampleHits = 0; // density samples found in the shared cache
+	uint32 tiles = 0;
+	uint32 nonEmptyTiles = 0;
+	uint32 rejectedTiles = 0; // skipped before meshing
+};
+void terrainGenerate(const TilePos &tilePos, const std::atomic<bool> &cancelled, Holder<Mesh> &mesh, Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special, TerrainGenerateStatistics *statistics = nullptr);
+real terrainDensity(const vec3 &position); // world space, the surface is at zero
+real terrainDensityLipschitz(); // upper bound of the magnitude of the gradient of the density, derived from the noise parameters
+
+// density samples shared between neighboring and nested tiles, thread safe
+// samples are keyed by integer world coordinates in units of 1 / denominator
+struct TerrainDensityCacheStatistics
+{
+	uint64 hits = 0;
+	uint64 misses = 0;
+	uint64 evictions = 0;
+	uint64 entries = 0;
+	uint64 bytes = 0;
+};
+bool terrainDensityCacheEnabled();
+void terrainDensityCacheLookup(uint32 denominator, PointerRange<const ivec3> positions, PointerRange<real> values, PointerRange<bool> found);
+void terrainDensityCacheStore(uint32 denominator, PointerRange<const ivec3> positions, PointerRange<const real> values);
+void terrainDensityCacheClear();
+TerrainDensityCacheStatistics terrainDensityCacheStatistics();
+uint64 terrainDensityCacheBytes(); // cheap, without the statistics
+
+// textures encoded on the cpu into a gpu block compressed format, including the whole mip chain
+enum class TerrainCompressionEnum : uint32
+{
+	Bc1, // rgb, 8 bytes per block
+	Bc5, // two channels, 16 bytes per block
+};
+struct TerrainCompressedTexture
+{
+	std::vector<std::vector<char>> levels; // level 0 first, down to 1x1
+	uint32 width = 0;
+	uint32 height = 0;
+	TerrainCompressionEnum format = TerrainCompressionEnum::Bc1;
+	bool gamma = false; // srgb
+
+	uint64 bytes() const;
+	explicit operator bool () const { return !levels.empty(); }
+};
+TerrainCompressedTexture terrainCompressTexture(Image *image); // rgb images are encoded as bc1, two channel images as bc5
+Holder<Image> terrainDecompressTexture(const TerrainCompressedTexture &texture, uint32 level);
+
+// tile data serialized for the caches
+Holder<PointerRange<char>> terrainTileSerialize(const TilePos &tilePos, const Holder<Mesh> &mesh, const Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special);
+bool terrainTileDeserialize(PointerRange<const char> buffer, const TilePos &tilePos, Holder<Mesh> &mesh, Holder<Collider> &collider, Holder<Image> &albedo, Holder<Image> &special);
+
+// persistent cache on disk, thread safe
+Holder<PointerRange<char>> terrainCacheLoad(const TilePos &tilePos);
+void terrainCacheStore(const TilePos &tilePos, PointerRange<const char> buffer);
+
+// cache of recently evicted tiles in memory
+// packing and unpacking is thread safe, storing and taking is for the control thread only
+struct TerrainMemoryCacheStatistics
+{
+	uint64 bytes = 0;
+	uint32 entries = 0;
+	uint32 hits = 0;
+	uint32 misses = 0;
+	uint32 evictions = 0;
+};
+Holder<PointerRange<char>> terrainMemoryCachePack(Holder<PointerRange<char>> &&buffer); // returns empty holder if the memory cache is disabled
+Holder<PointerRange<char>> terrainMemoryCacheUnpack(const Holder<PointerRange<char>> &payload);
+void terrainMemoryCacheStore(const TilePos &tilePos, Holder<PointerRange<char>> &&payload);
+Holder<PointerRange<char>> terrainMemoryCacheTake(const TilePos &tilePos);
+void terrainMemoryCacheTrim(uint64 bytes); // evicts the least recently used entries until the cache fits
+TerrainMemoryCacheStatistics terrainMemoryCacheStatistics();
 
 #endif // !baseTile_h_dsfg7d8f5
@@ -1,9 +1,16 @@
 #include "terrain.h"
+#include "atlas.h"
+#include "scheduler.h"
+#include "upload.h"
 
 #include <cage-core/entities.h>
 #include <cage-core/concurrent.h>
 #include <cage-core/assetManager.h>
-#include <cage-core/debug.h>
+#include <cage-core/config.h>
+#include <cage-core/timer.h>
+#include <cage-core/mesh.h>
+#include <cage-core/collider.h>
+#include <cage-core/image.h>
 
 #include <cage-engine/engine.h>
 #include <cage-engine/graphics.h>
@@ -11,8 +18,20 @@
 #include <cage-engine/assetStructs.h>
 
 #include <vector>
-#include <array>
+#include <deque>
+#include <unordered_map>
 #include <atomic>
+#include <algorithm>
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT 0x8C4C
+#endif
+
+uint64 terrainMemoryUsage;
+uint64 terrainMemoryBudget;
 
 namespace
 {
@@ -32,149 +51,426 @@ namespace
 		Holder<Mesh> cpuMesh;
 		Holder<Model> gpuMesh;
 		Holder<Image> cpuAlbedo;
+		TerrainCompressedTexture cpuAlbedoCompressed;
 		Holder<Texture> gpuAlbedo;
 		Holder<Image> cpuSpecial;
+		TerrainCompressedTexture cpuSpecialCompressed;
 		Holder<Texture> gpuSpecial;
 		Holder<RenderObject> renderObject;
+		Holder<PointerRange<char>> payload; // serialized tile data, kept for the memory cache
+		TerrainAtlasRegion atlasRegion; // both textures are placed in the shared atlas pages
 		TilePos pos;
+		uint64 cpuBytes = 0; // estimated memory once the tile is ready, including the payload
+		uint64 takenBytes = 0; // payload taken from the memory cache, counted while the tile is pending
+		uint64 gpuBytes = 0;
 		Entity *entity = nullptr;
 		uint32 meshName = 0;
 		uint32 albedoName = 0;
 		uint32 specialName = 0;
 		uint32 objectName = 0;
-
-		real distanceToPlayer() const
-		{
-			return pos.distanceToPlayer();
-		}
 	};
 
+	struct TileList;
+
 	struct Tile : public TileBase
 	{
 		std::atomic<TileStateEnum> status {TileStateEnum::Init};
+		std::atomic<bool> cancelled {false}; // the tile is no longer needed, any work on it should stop as soon as possible
+		Tile *uploadNext = nullptr; // link in the upload handoff
+
+		// membership in one of the state lists
+		TileList *list = nullptr;
+		Tile *prev = nullptr;
+		Tile *next = nullptr;
+
+		bool requestedVisible = false;
+		bool prefetch = false; // lower priority
+	};
+
+	// intrusive doubly linked list of tiles, used by the control thread only
+	struct TileList
+	{
+		Tile *first = nullptr;
+		uint32 count = 0;
+
+		void insert(Tile *t)
+		{
+			CAGE_ASSERT(!t->list);
+			t->list = this;
+			t->prev = nullptr;
+			t->next = first;
+			if (first)
+				first->prev = t;
+			first = t;
+			count++;
+		}
+
+		void erase(Tile *t)
+		{
+			CAGE_ASSERT(t->list == this);
+			if (t->prev)
+				t->prev->next = t->next;
+			else
+				first = t->next;
+			if (t->next)
+				t->next->prev = t->prev;
+			t->list = nullptr;
+			t->prev = t->next = nullptr;
+			count--;
+		}
 	};
 
+	ConfigFloat confUploadBudget("flittermouse/terrain/uploadBudget", 3); // milliseconds per frame
+	ConfigBool confCompressTextures("flittermouse/terrain/compressTextures", true); // encode textures on the generator threads
+	ConfigBool confTextureAtlas("flittermouse/terrain/textureAtlas", true); // share texture pages among tiles, requires compressed textures
+	ConfigUint32 confMemoryBudget("flittermouse/terrain/memoryBudget", 1024); // MB, cpu and gpu together, including the memory cache, 0 = unlimited
+
 	std::vector<Holder<Thread>> generatorThreads;
-	std::array<Tile, 4096> tiles;
-	std::atomic<bool> stopping;
+
+	std::deque<Tile> tilesStorage; // grows on demand, addresses of the tiles are stable
+	std::unordered_map<uint64, Tile *> tilesIndex; // TilePos::key -> tile, contains all tiles that are not free
+	std::vector<TileChange> tilesChanges;
+
+	TileList freeTiles;
+	TileList pendingTiles; // requested tiles that are not ready yet
+	TileList readyTiles;
+	std::atomic<Tile *> uploadHandoff {nullptr}; // lock-free stack of tiles pushed by the generator threads
+	std::deque<Tile *> uploadTiles; // dispatch thread only, in order of completion
+	std::vector<Tile *> completedTiles; // tiles finished by other threads, waiting for the control thread; guarded by completedMutex
+	Holder<Mutex> completedMutex = newMutex();
+
+	struct Statistics
+	{
+		std::atomic<uint32> cancelledQueued {0}; // cancelled before the generation has started
+		std::atomic<uint32> cancelledGenerating {0}; // interrupted during the generation
+		std::atomic<uint32> wasted {0}; // fully generated but no longer needed
+		std::atomic<uint32> completed {0}; // finished and still needed
+		std::atomic<uint32> memoryCacheHits {0};
+		std::atomic<uint32> cacheHits {0};
+		std::atomic<uint32> cacheMisses {0};
+	} statistics;
+
+	constexpr uint32 AtlasPageSize = 4096;
+	constexpr uint32 AtlasMinRegion = 64;
+	constexpr uint32 AtlasLevels = 5; // the smallest regions keep at least one compressed block in the last level
+
+	// regions are allocated by the generator threads and released by the control thread
+	TerrainAtlasAllocator atlasAllocator(AtlasPageSize, AtlasMinRegion);
+	Holder<Mutex> atlasMutex = newMutex();
+
+	struct AtlasPage
+	{
+		Holder<Texture> albedo;
+		Holder<Texture> special;
+		uint32 albedoName = 0;
+		uint32 specialName = 0;
+	};
+	std::vector<AtlasPage> atlasPages; // dispatch thread only, the textures are shared with the asset manager, released pages have none
+	std::vector<char> atlasBuffer; // dispatch thread only
+
+	// used by the control thread only
+	struct Memory
+	{
+		uint64 cpuBytes = 0; // ready tiles
+		uint64 takenBytes = 0; // payloads of pending tiles, they are no longer in the memory cache
+		uint64 gpuBytes = 0;
+		uint64 peakBytes = 0;
+		real minRefineScale = 1;
+		uint32 reductions = 0;
+		uint32 cooldown = 0; // control ticks before the next change of the refine scale
+	} memory;
+
+	/////////////////////////////////////////////////////////////////////////////
+	// SCHEDULER
+	/////////////////////////////////////////////////////////////////////////////
+
+	TerrainScheduler<Tile> scheduler;
+
+	// called from the control thread
+	void schedulerPush(Tile *t)
+	{
+		t->status = TileStateEnum::Generate;
+		scheduler.push(t, !!t->payload);
+	}
 
 	/////////////////////////////////////////////////////////////////////////////
 	// CONTROL
 	/////////////////////////////////////////////////////////////////////////////
 
-	std::set<TilePos> findReadyTiles()
+	Tile *acquireTile()
 	{
-		std::set<TilePos> readyTiles;
-		for (Tile &t : tiles)
+		if (freeTiles.first)
 		{
-			if (t.status == TileStateEnum::Ready)
-				readyTiles.insert(t.pos);
+			Tile *t = freeTiles.first;
+			freeTiles.erase(t);
+			return t;
 		}
-		return readyTiles;
+		tilesStorage.emplace_back();
+		return &tilesStorage.back();
 	}
 
-	void engineUpdate()
+	void requestTile(const TilePos &pos, bool prefetch)
 	{
-		OPTICK_EVENT("terrainTiles");
+		Tile *t = acquireTile();
+		CAGE_ASSERT(t->status == TileStateEnum::Init);
+		t->pos = pos;
+		t->pos.visible = false;
+		t->requestedVisible = pos.visible;
+		t->prefetch = prefetch;
+		t->payload = terrainMemoryCacheTake(pos);
+		t->takenBytes = t->payload ? t->payload->size() : 0;
+		memory.takenBytes += t->takenBytes;
+		tilesIndex[pos.key()] = t;
+		pendingTiles.insert(t);
+		schedulerPush(t);
+	}
+
+	void resetTile(Tile *t)
+	{
+		if (t->atlasRegion)
+		{
+			ScopeLock<Mutex> lock(atlasMutex);
+			atlasAllocator.deallocate(t->atlasRegion);
+		}
+		CAGE_ASSERT(!t->gpuAlbedo && !t->gpuSpecial && !t->gpuMesh); // released on the dispatch thread
+		(TileBase&)*t = TileBase();
+		t->cancelled = false;
+		t->status = TileStateEnum::Init;
+		freeTiles.insert(t);
+	}
 
+	// the tile is still owned by some other thread, which will return it through the completed tiles
+	void cancelTile(Tile *t)
+	{
+		CAGE_ASSERT(t->list == &pendingTiles);
+		pendingTiles.erase(t);
+		tilesIndex.erase(t->pos.key());
+		t->cancelled = true;
+	}
+
+	void removeAssets(Tile *t)
+	{
 		AssetManager *ass = engineAssets();
-		std::set<TilePos> neededTiles = stopping ? std::set<TilePos>() : findNeededTiles(findReadyTiles());
-		for (Tile &t : tiles)
+		ass->remove(t->meshName);
+		if (!t->atlasRegion) // atlas pages are shared
 		{
-			bool visible = false;
-			bool requested = false;
+			ass->remove(t->albedoName);
+			ass->remove(t->specialName);
+		}
+		ass->remove(t->objectName);
+	}
 
-			// find visibility
-			if (t.status != TileStateEnum::Init)
-			{
-				auto it = neededTiles.find(t.pos);
-				if (it != neededTiles.end())
-				{
-					visible = it->visible;
-					requested = true;
-					neededTiles.erase(it);
-				}
-			}
+	void recycleCancelledTile(Tile *t)
+	{
+		CAGE_ASSERT(t->cancelled);
+		CAGE_ASSERT(!t->list);
+		CAGE_ASSERT(!t->entity);
+		if (t->status != TileStateEnum::Generating)
+			statistics.wasted++;
+		terrainMemoryCacheStore(t->pos, std::move(t->payload));
+		if (t->status == TileStateEnum::Entity)
+			removeAssets(t);
+		resetTile(t);
+	}
 
-			// remove tiles
-			if (t.status == TileStateEnum::Ready && (!requested || stopping))
-			{
-				if (t.entity)
-				{
-					ass->remove(t.meshName);
-					ass->remove(t.albedoName);
-					ass->remove(t.specialName);
-					ass->remove(t.objectName);
-					t.entity->destroy();
-				}
-				if (t.pos.visible)
-					terrainRemoveCollider(t.objectName);
-				(TileBase&)t = TileBase();
-				t.status = TileStateEnum::Init;
-			}
+	void releaseTile(Tile *t)
+	{
+		CAGE_ASSERT(t->status == TileStateEnum::Ready);
+		if (t->entity)
+		{
+			removeAssets(t);
+			t->entity->destroy();
+		}
+		if (t->pos.visible)
+			terrainRemoveCollider(t->objectName);
+		CAGE_ASSERT(memory.cpuBytes >= t->cpuBytes && memory.gpuBytes >= t->gpuBytes);
+		memory.cpuBytes -= t->cpuBytes;
+		memory.gpuBytes -= t->gpuBytes;
+		readyTiles.erase(t);
+		neededTileReady(t->pos, false);
+		terrainMemoryCacheStore(t->pos, std::move(t->payload));
+		tilesIndex.erase(t->pos.key());
+		resetTile(t);
+	}
 
-			// create entity
-			else if (t.status == TileStateEnum::Entity)
-			{
-				{ // create the entity
-					t.entity = engineEntities()->createAnonymous();
-					CAGE_COMPONENT_ENGINE(Transform, tr, t.entity);
-					tr = t.pos.getTransform();
-				}
+	void updateVisibility(Tile *t, bool visible)
+	{
+		if (!t->entity || t->pos.visible == visible)
+			return;
+		CAGE_ASSERT(!!t->cpuCollider);
+		if (visible)
+		{
+			terrainAddCollider(t->objectName, t->cpuCollider.share(), t->pos.getTransform());
+			CAGE_COMPONENT_ENGINE(Render, r, t->entity);
+			r.object = t->objectName;
+		}
+		else
+		{
+			terrainRemoveCollider(t->objectName);
+			t->entity->remove(RenderComponent::component);
+		}
+		t->pos.visible = visible;
+	}
 
-				t.status = TileStateEnum::Ready;
+	void collectCompletedTiles()
+	{
+		std::vector<Tile *> completed;
+		{
+			ScopeLock<Mutex> lock(completedMutex);
+			std::swap(completed, completedTiles);
+		}
+		for (Tile *t : completed)
+		{
+			CAGE_ASSERT(memory.takenBytes >= t->takenBytes);
+			memory.takenBytes -= t->takenBytes; // the payload is counted by the memory cache or by the ready tile from now on
+			t->takenBytes = 0;
+			if (t->cancelled)
+			{
+				recycleCancelledTile(t);
+				continue;
 			}
-
-			if (t.entity)
+			statistics.completed++;
+			pendingTiles.erase(t);
+			if (t->status == TileStateEnum::Entity)
 			{
-				CAGE_ASSERT(t.status == TileStateEnum::Ready);
-				CAGE_ASSERT(!!t.cpuCollider);
-				if (t.pos.visible != visible)
-				{
-					if (visible)
-					{
-						terrainAddCollider(t.objectName, t.cpuCollider.share(), t.pos.getTransform());
-						CAGE_COMPONENT_ENGINE(Render, r, t.entity);
-						r.object = t.objectName;
-					}
-					else
-					{
-						terrainRemoveCollider(t.objectName);
-						t.entity->remove(RenderComponent::component);
-					}
-					t.pos.visible = visible;
-				}
+				t->entity = engineEntities()->createAnonymous();
+				CAGE_COMPONENT_ENGINE(Transform, tr, t->entity);
+				tr = t->pos.getTransform();
+				t->status = TileStateEnum::Ready;
 			}
+			CAGE_ASSERT(t->status == TileStateEnum::Ready);
+			memory.cpuBytes += t->cpuBytes;
+			memory.gpuBytes += t->gpuBytes;
+			readyTiles.insert(t);
+			neededTileReady(t->pos, true);
+			updateVisibility(t, t->requestedVisible);
+		}
+	}
+
+	void applyChange(const TileChange &c)
+	{
+		if (c.change == TileChangeEnum::Add)
+		{
+			requestTile(c.pos, c.prefetch);
+			return;
+		}
+		auto it = tilesIndex.find(c.pos.key());
+		CAGE_ASSERT(it != tilesIndex.end());
+		Tile *t = it->second;
+		switch (c.change)
+		{
+		case TileChangeEnum::Remove:
+			if (t->list == &readyTiles)
+				releaseTile(t);
 			else
-				t.pos.visible = false;
+				cancelTile(t);
+			break;
+		case TileChangeEnum::Visibility:
+			t->requestedVisible = c.pos.visible;
+			if (t->list == &readyTiles)
+				updateVisibility(t, c.pos.visible);
+			break;
+		case TileChangeEnum::Priority:
+			t->prefetch = c.prefetch;
+			if (t->status == TileStateEnum::Generate)
+				scheduler.invalidate();
+			break;
+		default:
+			break;
 		}
+	}
 
-		terrainRebuildColliders();
+	const real RefineScaleStep = 0.85;
+	const real MinRefineScale = 0.25;
 
-		// generate new needed tiles
-		for (Tile &t : tiles)
+	// lowering the refine scale releases the finest tiles in the most distant parts of the tree first
+	void updateMemoryBudget()
+	{
+		const uint64 budget = uint64(confMemoryBudget) * 1024 * 1024;
+		uint64 cacheBytes = terrainMemoryCacheStatistics().bytes;
+		uint64 atlasBytes = 0;
 		{
-			if (neededTiles.empty())
-				break;
-			if (t.status == TileStateEnum::Init)
-			{
-				t.pos = *neededTiles.begin();
-				neededTiles.erase(neededTiles.begin());
-				t.status = TileStateEnum::Generate;
-			}
+			ScopeLock<Mutex> lock(atlasMutex);
+			atlasBytes = atlasAllocator.statistics().pageTexels * 2; // bc1 and bc5 with mipmaps, including the free regions
 		}
+		const uint64 tilesBytes = memory.cpuBytes + memory.gpuBytes + memory.takenBytes + atlasBytes + terrainDensityCacheBytes(); // the density cache is bounded by its own budget
+		terrainMemoryBudget = budget;
+		terrainMemoryUsage = tilesBytes + cacheBytes;
+		memory.peakBytes = max(memory.peakBytes, terrainMemoryUsage);
 
-		if (!neededTiles.empty())
+		if (memory.cooldown > 0)
 		{
-			CAGE_LOG(SeverityEnum::Warning, "flittermouse", "not enough terrain tile slots");
-			detail::debugBreakpoint();
+			memory.cooldown--;
+			return;
 		}
+
+		if (budget == 0)
+		{
+			terrainRefineScale(1);
+			return;
+		}
+
+		if (terrainMemoryUsage > budget)
+		{
+			// the tiles in the memory cache are not needed, they go first
+			terrainMemoryCacheTrim(budget > tilesBytes ? budget - tilesBytes : 0);
+			cacheBytes = terrainMemoryCacheStatistics().bytes;
+			terrainMemoryUsage = tilesBytes + cacheBytes;
+			if (terrainMemoryUsage <= budget)
+				return;
+			const real scale = terrainRefineScale();
+			if (scale <= MinRefineScale)
+				return;
+			terrainRefineScale(max(scale * RefineScaleStep, MinRefineScale));
+			memory.minRefineScale = min(memory.minRefineScale, terrainRefineScale());
+			memory.reductions++;
+			memory.cooldown = 30; // give the tiles time to be released
+			CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "terrain memory: " + (terrainMemoryUsage / 1024 / 1024) + " MB exceeds the budget, refine scale lowered to: " + terrainRefineScale());
+		}
+		else if (terrainRefineScale() < 1 && terrainMemoryUsage < budget * 3 / 4 && pendingTiles.count == 0)
+		{
+			terrainRefineScale(min(terrainRefineScale() / RefineScaleStep, real(1)));
+			memory.cooldown = 90; // avoid oscillations
+		}
+	}
+
+	void engineUpdate()
+	{
+		OPTICK_EVENT("terrainTiles");
+
+		collectCompletedTiles();
+		if (scheduler.stopping())
+			clearNeededTiles(tilesChanges);
+		else
+			updateNeededTiles(tilesChanges);
+		for (const TileChange &c : tilesChanges)
+			applyChange(c);
+		tilesChanges.clear();
+		scheduler.updatePlayer(playerPosition);
+		updateMemoryBudget();
+
+		terrainRebuildColliders();
 	}
 
 	void engineFinalize()
 	{
-		stopping = true;
+		// the tiles being generated are interrupted and the queued tiles are dropped, the generator threads exit promptly
+		for (Tile *t = pendingTiles.first; t; t = t->next)
+			t->cancelled = true;
+		statistics.cancelledQueued += numeric_cast<uint32>(scheduler.stop().size());
 		generatorThreads.clear();
+		CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "tiles completed: " + statistics.completed.load() + ", cancelled while queued: " + statistics.cancelledQueued.load() + ", cancelled while generating: " + statistics.cancelledGenerating.load() + ", wasted: " + statistics.wasted.load());
+		CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "tiles cache hits: " + statistics.cacheHits.load() + ", memory cache hits: " + statistics.memoryCacheHits.load() + ", misses: " + statistics.cacheMisses.load());
+		const TerrainMemoryCacheStatistics mc = terrainMemoryCacheStatistics();
+		CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "tiles memory cache entries: " + mc.entries + ", bytes: " + mc.bytes + ", hits: " + mc.hits + ", misses: " + mc.misses + ", evictions: " + mc.evictions);
+		{
+			ScopeLock<Mutex> lock(atlasMutex);
+			const TerrainAtlasStatistics as = atlasAllocator.statistics();
+			CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "tiles atlas pages: " + as.pages + ", released: " + as.releasedPages + ", regions: " + as.regions + ", allocations: " + as.allocations + ", used: " + (as.pageTexels ? 100.0 * as.requestedTexels / as.pageTexels : 0.0) + " %, fragmentation: " + as.fragmentation() * 100 + " %");
+		}
+		const TerrainDensityCacheStatistics dc = terrainDensityCacheStatistics();
+		CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "density cache entries: " + dc.entries + ", hits: " + dc.hits + ", misses: " + dc.misses + ", evictions: " + dc.evictions);
+		CAGE_LOG(SeverityEnum::Info, "terrain", stringizer() + "tiles memory peak: " + (memory.peakBytes / 1024 / 1024) + " MB, budget: " + (uint32)confMemoryBudget + " MB, reductions: " + memory.reductions + ", lowest refine scale: " + memory.minRefineScale);
 	}
 
 	/////////////////////////////////////////////////////////////////////////////
@@ -193,6 +489,120 @@ namespace
 		return t;
 	}
 
+	uint32 compressedFormat(const TerrainCompressedTexture &tex)
+	{
+		switch (tex.format)
+		{
+		case TerrainCompressionEnum::Bc1: return tex.gamma ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case TerrainCompressionEnum::Bc5: return GL_COMPRESSED_RG_RGTC2;
+		default: CAGE_THROW_CRITICAL(Exception, "invalid terrain texture compression format");
+		}
+	}
+
+	// the mip chain is already prepared by the generator thread
+	Holder<Texture> dispatchTexture(TerrainCompressedTexture &tex)
+	{
+		OPTICK_EVENT("dispatchCompressedTexture");
+		Holder<Texture> t = newTexture();
+		t->bind();
+		const uint32 format = compressedFormat(tex);
+		const uint32 levels = numeric_cast<uint32>(tex.levels.size());
+		for (uint32 level = 0; level < levels; level++)
+		{
+			const auto &data = tex.levels[level];
+			glCompressedTexImage2D(GL_TEXTURE_2D, level, format, max(tex.width >> level, 1u), max(tex.height >> level, 1u), 0, numeric_cast<GLsizei>(data.size()), data.data());
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		t->filters(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, 100);
+		t->wraps(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		tex = TerrainCompressedTexture();
+		return t;
+	}
+
+	Holder<Texture> newAtlasTexture(uint32 format)
+	{
+		Holder<Texture> t = newTexture();
+		t->bind();
+		glTexStorage2D(GL_TEXTURE_2D, AtlasLevels, format, AtlasPageSize, AtlasPageSize);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, AtlasLevels - 1);
+		t->filters(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, 100);
+		t->wraps(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		return t;
+	}
+
+	const AtlasPage &atlasPage(uint32 index, const Tile *t)
+	{
+		if (atlasPages.size() <= index)
+			atlasPages.resize(index + 1);
+		AtlasPage &p = atlasPages[index];
+		if (!p.albedo)
+		{
+			OPTICK_EVENT("newAtlasPage");
+			AssetManager *ass = engineAssets();
+			p.albedo = newAtlasTexture(compressedFormat(t->cpuAlbedoCompressed));
+			p.special = newAtlasTexture(compressedFormat(t->cpuSpecialCompressed));
+			p.albedoName = ass->generateUniqueName();
+			p.specialName = ass->generateUniqueName();
+			ass->fabricate<AssetSchemeIndexTexture, Texture>(p.albedoName, p.albedo.share(), stringizer() + "atlas albedo " + index);
+			ass->fabricate<AssetSchemeIndexTexture, Texture>(p.specialName, p.special.share(), stringizer() + "atlas special " + index);
+		}
+		return p;
+	}
+
+	// a page reallocated after this check is uploaded later on this thread, which creates its textures again
+	void atlasReleasePages()
+	{
+		std::vector<uint32> released;
+		{
+			ScopeLock<Mutex> lock(atlasMutex);
+			for (uint32 i = 0; i < atlasPages.size(); i++)
+				if (atlasPages[i].albedo && !atlasAllocator.pageLive(i))
+					released.push_back(i);
+		}
+		AssetManager *ass = engineAssets();
+		for (uint32 i : released)
+		{
+			AtlasPage &p = atlasPages[i];
+			ass->remove(p.albedoName);
+			ass->remove(p.specialName);
+			p = AtlasPage();
+		}
+	}
+
+	// levels missing in small textures are filled with the last level, which is a single block
+	// the whole region is written in every level, the blocks outside of the texture repeat its last column and row
+	// neither the filtering at the edges nor the coarser levels see texels left in the region by previous tiles
+	void dispatchAtlas(Texture *page, const TerrainAtlasRegion &r, TerrainCompressedTexture &tex)
+	{
+		OPTICK_EVENT("dispatchAtlas");
+		CAGE_ASSERT(tex.width == r.width && tex.height == r.height);
+		page->bind();
+		const uint32 format = compressedFormat(tex);
+		for (uint32 level = 0; level < AtlasLevels; level++)
+		{
+			const uint32 source = min(level, numeric_cast<uint32>(tex.levels.size()) - 1);
+			const auto &data = tex.levels[source];
+			const uint32 sw = (max(tex.width >> source, 1u) + 3) / 4, sh = (max(tex.height >> source, 1u) + 3) / 4; // blocks
+			const uint32 blockBytes = numeric_cast<uint32>(data.size()) / (sw * sh);
+			const uint32 size = r.size >> level;
+			const uint32 blocks = size / 4;
+			CAGE_ASSERT(size % 4 == 0 && sw <= blocks && sh <= blocks);
+			atlasBuffer.resize(uint64(blocks) * blocks * blockBytes);
+			for (uint32 y = 0; y < blocks; y++)
+			{
+				const char *src = data.data() + uint64(min(y, sh - 1)) * sw * blockBytes;
+				char *dst = atlasBuffer.data() + uint64(y) * blocks * blockBytes;
+				detail::memcpy(dst, src, sw * blockBytes);
+				for (uint32 x = sw; x < blocks; x++)
+					detail::memcpy(dst + x * blockBytes, src + (sw - 1) * blockBytes, blockBytes);
+			}
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, r.x >> level, r.y >> level, size, size, format, numeric_cast<GLsizei>(atlasBuffer.size()), atlasBuffer.data());
+		}
+		tex = TerrainCompressedTexture();
+	}
+
 	Holder<Model> dispatchMesh(Holder<Mesh> &poly)
 	{
 		OPTICK_EVENT("dispatchMesh");
@@ -203,67 +613,131 @@ namespace
 		return m;
 	}
 
-	void engineDispatch()
+	void dispatchComplete(Tile *t)
+	{
+		ScopeLock<Mutex> lock(completedMutex);
+		completedTiles.push_back(t);
+	}
+
+	void dispatchFinish(Tile *t)
 	{
-		OPTICK_EVENT("terrainDispatch");
 		AssetManager *ass = engineAssets();
-		CAGE_CHECK_GL_ERROR_DEBUG();
-		for (Tile &t : tiles)
+
+		if (t->atlasRegion)
 		{
-			if (t.status == TileStateEnum::Upload)
-			{
-				t.gpuAlbedo = dispatchTexture(t.cpuAlbedo);
-				t.gpuSpecial = dispatchTexture(t.cpuSpecial);
-				t.gpuMesh = dispatchMesh(t.cpuMesh);
-
-				{ // set texture names for the mesh
-					uint32 textures[MaxTexturesCountPerMaterial];
-					detail::memset(textures, 0, sizeof(textures));
-					textures[0] = t.albedoName;
-					textures[1] = t.specialName;
-					t.gpuMesh->setTextureNames(textures);
-				}
+			const AtlasPage &page = atlasPages[t->atlasRegion.page];
+			t->albedoName = page.albedoName;
+			t->specialName = page.specialName;
+		}
 
-				// transfer asset ownership
-				ass->fabricate<AssetSchemeIndexTexture, Texture>(t.albedoName, std::move(t.gpuAlbedo), stringizer() + "albedo " + t.pos);
-				ass->fabricate<AssetSchemeIndexTexture, Texture>(t.specialName, std::move(t.gpuSpecial), stringizer() + "special " + t.pos);
-				ass->fabricate<AssetSchemeIndexModel, Model>(t.meshName, std::move(t.gpuMesh), stringizer() + "mesh " + t.pos);
-				ass->fabricate<AssetSchemeIndexRenderObject, RenderObject>(t.objectName, std::move(t.renderObject), stringizer() + "object " + t.pos);
+		{ // set texture names for the mesh
+			uint32 textures[MaxTexturesCountPerMaterial];
+			detail::memset(textures, 0, sizeof(textures));
+			textures[0] = t->albedoName;
+			textures[1] = t->specialName;
+			t->gpuMesh->setTextureNames(textures);
+		}
 
-				t.status = TileStateEnum::Entity;
-				break;
-			}
+		// transfer asset ownership
+		if (!t->atlasRegion)
+		{
+			ass->fabricate<AssetSchemeIndexTexture, Texture>(t->albedoName, std::move(t->gpuAlbedo), stringizer() + "albedo " + t->pos);
+			ass->fabricate<AssetSchemeIndexTexture, Texture>(t->specialName, std::move(t->gpuSpecial), stringizer() + "special " + t->pos);
 		}
-		CAGE_CHECK_GL_ERROR_DEBUG();
+		ass->fabricate<AssetSchemeIndexModel, Model>(t->meshName, std::move(t->gpuMesh), stringizer() + "mesh " + t->pos);
+		ass->fabricate<AssetSchemeIndexRenderObject, RenderObject>(t->objectName, std::move(t->renderObject), stringizer() + "object " + t->pos);
+
+		t->status = TileStateEnum::Entity;
+		dispatchComplete(t);
 	}
 
-	/////////////////////////////////////////////////////////////////////////////
-	// GENERATOR
-	/////////////////////////////////////////////////////////////////////////////
+	// takes over all tiles from the handoff, preserving their order
+	void dispatchCollect()
+	{
+		Tile *t = uploadHandoff.exchange(nullptr);
+		const uint32 start = numeric_cast<uint32>(uploadTiles.size());
+		while (t)
+		{
+			uploadTiles.push_back(t);
+			t = t->uploadNext;
+		}
+		std::reverse(uploadTiles.begin() + start, uploadTiles.end());
+	}
 
-	Tile *generatorChooseTile()
+	struct DispatchUploader
 	{
-		static Holder<Mutex> mut = newMutex();
-		ScopeLock<Mutex> lock(mut);
-		Tile *result = nullptr;
-		for (Tile &t : tiles)
+		bool step(Tile *t)
 		{
-			if (t.status != TileStateEnum::Generate)
-				continue;
-			if (result)
+			CAGE_ASSERT(t->status == TileStateEnum::Upload);
+			if (t->atlasRegion && t->cpuAlbedoCompressed)
 			{
-				if (t.pos.radius < result->pos.radius)
-					continue;
-				if (t.distanceToPlayer() > result->distanceToPlayer())
-					continue;
+				const AtlasPage &page = atlasPage(t->atlasRegion.page, t);
+				dispatchAtlas(+page.albedo, t->atlasRegion, t->cpuAlbedoCompressed);
+				dispatchAtlas(+page.special, t->atlasRegion, t->cpuSpecialCompressed);
 			}
-			result = &t;
+			else if (t->cpuAlbedo)
+				t->gpuAlbedo = dispatchTexture(t->cpuAlbedo);
+			else if (t->cpuAlbedoCompressed)
+				t->gpuAlbedo = dispatchTexture(t->cpuAlbedoCompressed);
+			else if (t->cpuSpecial)
+				t->gpuSpecial = dispatchTexture(t->cpuSpecial);
+			else if (t->cpuSpecialCompressed)
+				t->gpuSpecial = dispatchTexture(t->cpuSpecialCompressed);
+			else
+			{
+				t->gpuMesh = dispatchMesh(t->cpuMesh);
+				return true;
+			}
+			return false;
+		}
+
+		void finish(Tile *t)
+		{
+			dispatchFinish(t);
+		}
+
+		// the gpu objects must be destroyed on the thread that owns the opengl context
+		void release(Tile *t)
+		{
+			CAGE_ASSERT(t->status == TileStateEnum::Upload);
+			t->gpuAlbedo.clear();
+			t->gpuSpecial.clear();
+			t->gpuMesh.clear();
 		}
-		if (result)
-			result->status = TileStateEnum::Generating;
-		return result;
+
+		void complete(Tile *t)
+		{
+			dispatchComplete(t);
+		}
+	};
+
+	void engineDispatch()
+	{
+		OPTICK_EVENT("terrainDispatch");
+		static Holder<Timer> timer = newTimer();
+		timer->reset();
+		const uint64 budget = numeric_cast<uint64>(max((float)confUploadBudget, 0.f) * 1000);
+
+		dispatchCollect();
+		atlasReleasePages();
+		CAGE_CHECK_GL_ERROR_DEBUG();
+
+		DispatchUploader uploader;
+		terrainUploadTiles(uploadTiles, uploader, budget, +timer);
+
+		CAGE_CHECK_GL_ERROR_DEBUG();
+		OPTICK_TAG("remaining", numeric_cast<uint32>(uploadTiles.size()));
+	}
+
+	void engineDispatchFinalize()
+	{
+		atlasPages.clear();
 	}
 
+	/////////////////////////////////////////////////////////////////////////////
+	// GENERATOR
+	/////////////////////////////////////////////////////////////////////////////
+
 	void generateRenderObject(Tile &t)
 	{
 		t.renderObject = newRenderObject();
@@ -273,34 +747,144 @@ namespace
 		t.renderObject->setLods(thresholds, meshIndices, meshNames);
 	}
 
+	uint64 textureBytes(const Holder<Image> &image, const TerrainCompressedTexture &compressed)
+	{
+		if (compressed)
+			return compressed.bytes();
+		if (image)
+			return uint64(image->width()) * image->height() * image->channels() * 4 / 3; // including mipmaps
+		return 0;
+	}
+
+	// the mesh is remapped to the region in the page, the textures are uploaded into the same region of both pages
+	void generatorAtlas(Tile *t)
+	{
+		OPTICK_EVENT("atlasAllocate");
+		{
+			ScopeLock<Mutex> lock(atlasMutex);
+			t->atlasRegion = atlasAllocator.allocate(t->cpuAlbedoCompressed.width, t->cpuAlbedoCompressed.height);
+		}
+		const TerrainAtlasRegion &r = t->atlasRegion;
+		const vec2 offset = vec2(r.x, r.y) / real(AtlasPageSize);
+		const vec2 scale = vec2(r.width, r.height) / real(AtlasPageSize);
+		std::vector<vec2> uvs(t->cpuMesh->uvs().begin(), t->cpuMesh->uvs().end());
+		for (vec2 &uv : uvs)
+			uv = offset + uv * scale;
+		t->cpuMesh->uvs(uvs);
+	}
+
+	// the payload stays with the ready tile, the mesh and textures are released after the upload and the memory cache is refilled from the payload on eviction
+	void estimateMemory(Tile *t)
+	{
+		t->cpuBytes = t->payload ? t->payload->size() : 0;
+		if (t->cpuCollider)
+			t->cpuBytes += t->cpuCollider->triangles().size() * sizeof(Triangle) * 2; // triangles and the bounding volume hierarchy
+		t->gpuBytes = 0;
+		if (t->cpuMesh)
+			t->gpuBytes += uint64(t->cpuMesh->verticesCount()) * (sizeof(vec3) * 2 + sizeof(vec2)) + uint64(t->cpuMesh->indicesCount()) * sizeof(uint32);
+		if (!t->atlasRegion) // the atlas pages are counted as a whole
+		{
+			t->gpuBytes += textureBytes(t->cpuAlbedo, t->cpuAlbedoCompressed);
+			t->gpuBytes += textureBytes(t->cpuSpecial, t->cpuSpecialCompressed);
+		}
+	}
+
+	bool generatorLoad(Tile *t)
+	{
+		if (t->payload)
+		{
+			Holder<PointerRange<char>> buffer = terrainMemoryCacheUnpack(t->payload);
+			if (terrainTileDeserialize(*buffer, t->pos, t->cpuMesh, t->cpuCollider, t->cpuAlbedo, t->cpuSpecial))
+			{
+				statistics.memoryCacheHits++;
+				return true;
+			}
+			t->payload.clear();
+		}
+
+		if (Holder<PointerRange<char>> buffer = terrainCacheLoad(t->pos))
+		{
+			if (terrainTileDeserialize(*buffer, t->pos, t->cpuMesh, t->cpuCollider, t->cpuAlbedo, t->cpuSpecial))
+			{
+				statistics.cacheHits++;
+				t->payload = terrainMemoryCachePack(std::move(buffer));
+				return true;
+			}
+		}
+
+		return false;
+	}
+
 	void generatorEntry()
 	{
 		AssetManager *ass = engineAssets();
-		while (!stopping)
+		while (true)
 		{
-			Tile *t = generatorChooseTile();
+			Tile *t = scheduler.pop();
 			if (!t)
+				break;
+			CAGE_ASSERT(t->status == TileStateEnum::Generate);
+			t->status = TileStateEnum::Generating;
+
+			if (t->cancelled)
 			{
-				threadSleep(10000);
+				statistics.cancelledQueued++;
+				ScopeLock<Mutex> lock(completedMutex);
+				completedTiles.push_back(t);
 				continue;
 			}
 
-			terrainGenerate(t->pos, t->cpuMesh, t->cpuCollider, t->cpuAlbedo, t->cpuSpecial);
+			if (!generatorLoad(t))
+			{
+				statistics.cacheMisses++;
+				terrainGenerate(t->pos, t->cancelled, t->cpuMesh, t->cpuCollider, t->cpuAlbedo, t->cpuSpecial);
+				if (t->cancelled)
+				{
+					statistics.cancelledGenerating++;
+					ScopeLock<Mutex> lock(completedMutex);
+					completedTiles.push_back(t);
+					continue;
+				}
+				Holder<PointerRange<char>> buffer = terrainTileSerialize(t->pos, t->cpuMesh, t->cpuCollider, t->cpuAlbedo, t->cpuSpecial);
+				terrainCacheStore(t->pos, *buffer);
+				t->payload = terrainMemoryCachePack(std::move(buffer));
+			}
+
 			if (!t->cpuMesh)
 			{
+				estimateMemory(t);
 				t->status = TileStateEnum::Ready;
+				ScopeLock<Mutex> lock(completedMutex);
+				completedTiles.push_back(t);
 				continue;
 			}
 
+			if (confCompressTextures)
+			{
+				OPTICK_EVENT("compressTextures");
+				t->cpuAlbedoCompressed = terrainCompressTexture(+t->cpuAlbedo);
+				t->cpuSpecialCompressed = terrainCompressTexture(+t->cpuSpecial);
+				t->cpuAlbedo.clear();
+				t->cpuSpecial.clear();
+				if (confTextureAtlas)
+					generatorAtlas(t);
+			}
+			estimateMemory(t);
+
 			// assets names
-			t->albedoName = ass->generateUniqueName();
-			t->specialName = ass->generateUniqueName();
+			if (!t->atlasRegion)
+			{
+				t->albedoName = ass->generateUniqueName();
+				t->specialName = ass->generateUniqueName();
+			}
 			t->meshName = ass->generateUniqueName();
 			t->objectName = ass->generateUniqueName();
 
 			generateRenderObject(*t);
 
 			t->status = TileStateEnum::Upload;
+			t->uploadNext = uploadHandoff.load(std::memory_order_relaxed);
+			while (!uploadHandoff.compare_exchange_weak(t->uploadNext, t, std::memory_order_release, std::memory_order_relaxed));
 		}
 	}
 
@@ -322,6 +906,7 @@ namespace
 		EventListener<void()> engineFinalizeListener;
 		EventListener<void()> engineUnloadListener;
 		EventListener<void()> engineDispatchListener;
+		EventListener<void()> engineDispatchFinalizeListener;
 	public:
 		Callbacks()
 		{
@@ -335,6 +920,15 @@ namespace
 			engineUnloadListener.bind<&engineUpdate>();
 			engineDispatchListener.attach(graphicsDispatchThread().dispatch);
 			engineDispatchListener.bind<&engineDispatch>();
+			engineDispatchFinalizeListener.attach(graphicsDispatchThread().finalize);
+			engineDispatchFinalizeListener.bind<&engineDispatchFinalize>();
 		}
 	} callbacksInstance;
 }
+
+uint32 terrainTexturePolicy()
+{
+	if (!confCompressTextures)
+		return 0;
+	return confTextureAtlas ? 2 : 1;
+}
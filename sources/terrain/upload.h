@@ -0,0 +1,43 @@
+#ifndef upload_h_k8l7m6n5
+#define upload_h_k8l7m6n5
+
+#include "terrain.h"
+
+#include <cage-core/timer.h>
+
+#include <deque>
+
+// the upload loop of the dispatch thread, no engine involved
+// the uploader provides:
+//   bool step(T *) - uploads one texture or mesh of the tile, returns true once the tile is complete
+//   void finish(T *) - the tile is fully uploaded
+//   void release(T *) - the tile was cancelled, destroys its partially uploaded gpu resources, still on the dispatch thread
+//   void complete(T *) - hands the cancelled tile back to the control thread
+// individual steps run while there is time left in the budget, at least one always runs
+
+template<class T, class Uploader>
+void terrainUploadTiles(std::deque<T *> &tiles, Uploader &uploader, uint64 budget, Timer *timer)
+{
+	bool any = false;
+	while (!tiles.empty())
+	{
+		T *t = tiles.front();
+		if (t->cancelled)
+		{
+			tiles.pop_front();
+			uploader.release(t);
+			uploader.complete(t);
+			continue;
+		}
+		if (any && timer->microsSinceStart() >= budget)
+			break;
+		any = true;
+		if (uploader.step(t))
+		{
+			tiles.pop_front();
+			uploader.finish(t);
+		}
+	}
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "common.h"
+#include "timingWheel.h"
 
 #include <cage-core/entities.h>
 #include <cage-core/hashString.h>
@@ -7,18 +8,53 @@
 #include <cage-engine/core.h>
 #include <cage-engine/engine.h>
 
+#include <vector>
+
 EntityGroup *entitiesToDestroy;
 EntityComponent *TimeoutComponent::component;
 
 namespace
 {
+	constexpr uint32 RecycledLimit = 1000; // more entities returned to the pool are destroyed
+
+	TimingWheel wheel;
+	std::vector<uint32> expired;
+	std::vector<uint32> recycled; // names of the entities ready for reuse
+
+	// the entity keeps its name only, all components are removed so that the next user starts with a clean entity
+	void recycle(Entity *e)
+	{
+		if (recycled.size() >= RecycledLimit)
+		{
+			e->add(entitiesToDestroy);
+			return;
+		}
+		for (EntityComponent *c : engineEntities()->components())
+			e->remove(c);
+		recycled.push_back(e->name());
+	}
+
 	void engineUpdate()
 	{
 		OPTICK_EVENT("timeout & entities destroy");
-		for (Entity *e : TimeoutComponent::component->entities())
+		EntityManager *ents = engineEntities();
+		expired.clear();
+		wheel.advance(expired);
+		OPTICK_TAG("expired", expired.size());
+		for (uint32 name : expired)
 		{
+			// the entity may have been destroyed or given another timeout meanwhile
+			if (!ents->has(name))
+				continue;
+			Entity *e = ents->get(name);
+			if (!e->has(TimeoutComponent::component))
+				continue;
 			GAME_COMPONENT(Timeout, t, e);
-			if (t.ttl-- == 0)
+			if (t.expiry != wheel.tick())
+				continue;
+			if (t.recycle)
+				recycle(e);
+			else
 				e->add(entitiesToDestroy);
 		}
 		entitiesToDestroy->destroy();
@@ -30,17 +66,48 @@ namespace
 		TimeoutComponent::component = engineEntities()->defineComponent(TimeoutComponent());
 	}
 
+	void engineFinalize()
+	{
+		wheel.clear();
+		recycled.clear();
+	}
+
 	class Callbacks
 	{
 		EventListener<void()> engineInitListener;
+		EventListener<void()> engineFinalizeListener;
 		EventListener<void()> engineUpdateListener;
 	public:
 		Callbacks()
 		{
 			engineInitListener.attach(controlThread().initialize);
 			engineInitListener.bind<&engineInitialize>();
+			engineFinalizeListener.attach(controlThread().finalize);
+			engineFinalizeListener.bind<&engineFinalize>();
 			engineUpdateListener.attach(controlThread().update);
 			engineUpdateListener.bind<&engineUpdate>();
 		}
 	} callbacksInstance;
 }
+
+void entityTimeout(Entity *e, uint32 ttl, bool recycle)
+{
+	CAGE_ASSERT(e->name() != 0);
+	GAME_COMPONENT(Timeout, t, e);
+	t.expiry = wheel.tick() + ttl + 1; // survives the next ttl updates
+	t.recycle = recycle;
+	wheel.insert(e->name(), t.expiry);
+}
+
+Entity *entityRecycled()
+{
+	EntityManager *ents = engineEntities();
+	while (!recycled.empty())
+	{
+		const uint32 name = recycled.back();
+		recycled.pop_back();
+		if (ents->has(name))
+			return ents->get(name);
+	}
+	return ents->createUnique();
+}
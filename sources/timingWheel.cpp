@@ -0,0 +1,63 @@
+#include "timingWheel.h"
+
+void TimingWheel::place(const Entry &e)
+{
+	CAGE_ASSERT(e.expiry > current || (e.expiry == current && (current & (Slots - 1)) == 0));
+	const uint64 delta = e.expiry - current;
+	for (uint32 level = 0; level < Levels; level++)
+	{
+		if (delta < (uint64(1) << (Bits * (level + 1))))
+		{
+			buckets[level][(e.expiry >> (Bits * level)) & (Slots - 1)].push_back(e);
+			return;
+		}
+	}
+	overflow.push_back(e);
+}
+
+// the entries move to lower levels, the ones expiring in the current tick end in its bucket, which is processed right after
+void TimingWheel::cascade(std::vector<Entry> &bucket)
+{
+	std::swap(cascading, bucket);
+	for (const Entry &e : cascading)
+		place(e);
+	cascading.clear();
+}
+
+void TimingWheel::insert(uint32 name, uint64 expiry)
+{
+	Entry e;
+	e.name = name;
+	e.expiry = max(expiry, current + 1);
+	place(e);
+	count++;
+}
+
+void TimingWheel::advance(std::vector<uint32> &expired)
+{
+	current++;
+	if ((current & ((uint64(1) << (Bits * Levels)) - 1)) == 0)
+		cascade(overflow);
+	for (uint32 level = Levels - 1; level > 0; level--)
+	{
+		if ((current & ((uint64(1) << (Bits * level)) - 1)) == 0)
+			cascade(buckets[level][(current >> (Bits * level)) & (Slots - 1)]);
+	}
+	std::vector<Entry> &bucket = buckets[0][current & (Slots - 1)];
+	for (const Entry &e : bucket)
+	{
+		CAGE_ASSERT(e.expiry == current);
+		expired.push_back(e.name);
+	}
+	count -= numeric_cast<uint32>(bucket.size());
+	bucket.clear();
+}
+
+void TimingWheel::clear()
+{
+	for (auto &level : buckets)
+		for (auto &bucket : level)
+			bucket.clear();
+	overflow.clear();
+	count = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef timingWheel_h_g5h4j3k2
+#define timingWheel_h_g5h4j3k2
+
+#include "common.h"
+
+#include <array>
+#include <vector>
+
+// hierarchical timing wheel of names expiring at given ticks, no engine involved
+// three levels of 256 buckets cover 2^24 ticks, later expiries wait in an overflow list
+// each advance touches the bucket of the new tick only, the higher levels are cascaded down once per 256 ticks of the level below
+
+class TimingWheel
+{
+public:
+	void insert(uint32 name, uint64 expiry); // expiries not after the current tick are moved to the next one
+	void advance(std::vector<uint32> &expired); // moves to the next tick, appends the names expiring in it
+	void clear();
+
+	uint64 tick() const { return current; }
+	uint32 size() const { return count; }
+
+private:
+	static constexpr uint32 Levels = 3;
+	static constexpr uint32 Bits = 8;
+	static constexpr uint32 Slots = 1 << Bits;
+
+	struct Entry
+	{
+		uint64 expiry = 0;
+		uint32 name = 0;
+	};
+
+	std::array<std::array<std::vector<Entry>, Slots>, Levels> buckets;
+	std::vector<Entry> overflow;
+	std::vector<Entry> cascading;
+	uint64 current = 0;
+	uint32 count = 0;
+
+	void place(const Entry &e);
+	void cascade(std::vector<Entry> &bucket);
+};
+
+#endif